@@ -30,6 +30,7 @@ int  FsUmount       (void);
 int  FileOpen       (const char *fileName, int writeMode);
 int  FileRead       (int fd, void *buffer, int len);
 int  FileWrite      (int fd, const void *buffer, int len);
+int  FileSeek       (int fd, int offset);
 int  FileClose      (int fd); 
 
 int  FileDelete     (const char *fileName);
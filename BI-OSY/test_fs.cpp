@@ -1,5 +1,6 @@
 #include "common_fs.h"
 #include <cassert>
+#include <pthread.h>
 
 #define DISK_SECTORS 87654 // 524288
 static FILE *g_Fp = NULL;
@@ -221,6 +222,62 @@ basic_check (void)
 	delete [] buffer;
 }
 
+/* Jump around files, both when reading and writing them. */
+static void
+check_seek (void)
+{
+	int size = BLOCK_UNIT * 32;
+
+	char *data   = new char [size];
+	char *buffer = new char [BLOCK_UNIT];
+	blk_random (data, size);
+
+	/* Write the file, going back to rewrite parts of it now and then. */
+	int fd;
+	PWNCHECK ((fd = FileOpen ("seek", 1)) != -1);
+	PWNCHECK (FileSeek (fd, 1) == 0);
+	for (int done = 0; done < size; )
+	{
+		int to_write = RAND_RANGE (1, BLOCK_UNIT);
+		to_write = MIN (to_write, size - done);
+		PWNCHECK (FileWrite (fd, data + done, to_write) == to_write);
+		done += to_write;
+
+		int back = RAND_RANGE (0, done);
+		PWNCHECK (FileSeek (fd, back) == 1);
+		blk_random (data + back, done - back);
+		PWNCHECK (FileWrite (fd, data + back, done - back) == done - back);
+	}
+	PWNCHECK (FileSeek (fd, size + 1) == 0);
+	PWNCHECK (FileClose (fd) == 0);
+	PWNCHECK (FileSize ("seek") == size);
+
+	/* Read it whole, parts of it may still be in the cache. */
+	char *whole = new char [size];
+	PWNCHECK ((fd = FileOpen ("seek", 0)) != -1);
+	PWNCHECK (FileRead (fd, whole, size) == size);
+	PWNCHECK (memcmp (data, whole, size) == 0);
+	delete [] whole;
+
+	/* Read random pieces of it. */
+	for (int i = 0; i < 1000; i++)
+	{
+		int offset = RAND_RANGE (0, size);
+		int to_read = RAND_RANGE (1, BLOCK_UNIT);
+		to_read = MIN (to_read, size - offset);
+		PWNCHECK (FileSeek (fd, offset) == 1);
+		PWNCHECK (FileRead (fd, buffer, to_read) == to_read);
+		PWNCHECK (memcmp (data + offset, buffer, to_read) == 0);
+	}
+	PWNCHECK (FileSeek (fd, size + 1) == 0);
+	PWNCHECK (FileSeek (fd, -1) == 0);
+	PWNCHECK (FileClose (fd) == 0);
+	PWNCHECK (FileDelete ("seek") == 1);
+
+	delete [] data;
+	delete [] buffer;
+}
+
 /* Create some random files and back them up in a table. */
 static void
 fill_fs (void)
@@ -502,6 +559,119 @@ check_parallel (void)
 	}
 }
 
+/* Threads writing their own files, and threads reading a shared one. */
+#define WRITER_THREADS 3
+#define READER_THREADS 4
+#define THREAD_ROUNDS 30
+
+static char *g_shared_data;
+static int g_shared_size;
+
+/* Keep rewriting a file and checking what's in it. */
+static void *
+writer_main (void *arg)
+{
+	unsigned seed = (unsigned long) arg;
+	char filename[FILENAME_LEN_MAX + 1];
+	sprintf (filename, "writer%lu", (unsigned long) arg);
+
+	char *data = new char [MAX_FILE_SIZE];
+	for (int round = 0; round < THREAD_ROUNDS; round++)
+	{
+		int size = rand_r (&seed) % MAX_FILE_SIZE;
+		for (int i = 0; i < size; i++)
+			data[i] = rand_r (&seed);
+
+		int fd = FileOpen (filename, 1);
+		PWNCHECK (fd != -1);
+		for (int done = 0; done < size; )
+		{
+			int to_write = 1 + rand_r (&seed) % (BLOCK_UNIT * 4);
+			to_write = MIN (to_write, size - done);
+			PWNCHECK (FileWrite (fd, data + done, to_write) == to_write);
+			done += to_write;
+		}
+		PWNCHECK (FileClose (fd) == 0);
+		PWNCHECK (FileSize (filename) == size);
+
+		static char buffer[WRITER_THREADS][BLOCK_UNIT * 4];
+		char *pbuf = buffer[(unsigned long) arg];
+		PWNCHECK ((fd = FileOpen (filename, 0)) != -1);
+		for (int done = 0; done < size; )
+		{
+			int to_read = 1 + rand_r (&seed) % (BLOCK_UNIT * 4);
+			to_read = MIN (to_read, size - done);
+			PWNCHECK (FileRead (fd, pbuf, to_read) == to_read);
+			PWNCHECK (memcmp (data + done, pbuf, to_read) == 0);
+			done += to_read;
+		}
+		PWNCHECK (FileClose (fd) == 0);
+	}
+
+	PWNCHECK (FileDelete (filename) == 1);
+	delete [] data;
+	return NULL;
+}
+
+/* Read random pieces of the shared file. */
+static void *
+reader_main (void *arg)
+{
+	unsigned seed = (unsigned long) arg;
+	char *buffer = new char [BLOCK_UNIT * 4];
+
+	for (int round = 0; round < THREAD_ROUNDS; round++)
+	{
+		int fd = FileOpen ("shared", 0);
+		PWNCHECK (fd != -1);
+		for (int i = 0; i < 20; i++)
+		{
+			int offset = rand_r (&seed) % g_shared_size;
+			int to_read = 1 + rand_r (&seed) % (BLOCK_UNIT * 4);
+			to_read = MIN (to_read, g_shared_size - offset);
+			PWNCHECK (FileSeek (fd, offset) == 1);
+			PWNCHECK (FileRead (fd, buffer, to_read) == to_read);
+			PWNCHECK (memcmp (g_shared_data + offset, buffer, to_read) == 0);
+		}
+		PWNCHECK (FileClose (fd) == 0);
+	}
+
+	delete [] buffer;
+	return NULL;
+}
+
+/* Use the filesystem from several threads at once. */
+static void
+check_threads (void)
+{
+	g_shared_size = MAX_FILE_SIZE * 20;
+	blk_random (g_shared_data = new char [g_shared_size], g_shared_size);
+
+	int fd;
+	PWNCHECK ((fd = FileOpen ("shared", 1)) != -1);
+	PWNCHECK (FileWrite (fd, g_shared_data, g_shared_size) == g_shared_size);
+	PWNCHECK (FileClose (fd) == 0);
+
+	pthread_t threads[WRITER_THREADS + READER_THREADS];
+	for (unsigned long i = 0; i < WRITER_THREADS; i++)
+		PWNCHECK (!pthread_create (&threads[i], NULL, writer_main, (void *) i));
+	for (unsigned long i = 0; i < READER_THREADS; i++)
+		PWNCHECK (!pthread_create (&threads[WRITER_THREADS + i], NULL,
+			reader_main, (void *) i));
+	for (unsigned i = 0; i < WRITER_THREADS + READER_THREADS; i++)
+		PWNCHECK (!pthread_join (threads[i], NULL));
+
+	/* Only the shared file should be left. */
+	TFile info;
+	PWNCHECK (FileFindFirst (&info) == 1);
+	PWNCHECK (strcmp (info.m_FileName, "shared") == 0);
+	PWNCHECK (info.m_FileSize == g_shared_size);
+	PWNCHECK (FileFindNext (&info) == 0);
+
+	PWNCHECK (FileDelete ("shared") == 1);
+	delete [] g_shared_data;
+}
+
 // ---------------------------------------------------------------------------
 
 int
@@ -516,6 +686,7 @@ main (int argc, char *argv[])
 	assert (FsCreate (dev) == 1);
 	assert (FsMount  (dev) == 1);
 	basic_check ();
+	check_seek ();
 	fill_fs ();
 	check_fs_contents ();
 	assert (FsUmount ()    == 1);
@@ -548,6 +719,13 @@ main (int argc, char *argv[])
 	assert (FsUmount ()    == 1);
 	doneDisk (dev);
 
+	/* Stage 5: Several threads at once. */
+	dev = openDisk ();
+	assert (FsMount  (dev) == 1);
+	check_threads ();
+	assert (FsUmount ()    == 1);
+	doneDisk (dev);
+
 	return 0;
 }
 
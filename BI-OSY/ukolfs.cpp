@@ -15,6 +15,7 @@
 #ifndef __PROGTEST__
 #include "common_fs.h"
 #include <assert.h>
+#include <pthread.h>
 
 #include <stdarg.h>
 static int DEBUG (const char *format, ...)
@@ -55,11 +56,19 @@ typedef struct TBlkDev TBlkDev;
 
 /* ===== Disk cache ========================================================= */
 
-#define DC_LIST_SIZE   (1 << 8)
+#define DC_LIST_SIZE   (1 << 8)         //! Cache entries in all parts.
+#define DC_SHARD_SIZE  (DC_LIST_SIZE / DC_SHARDS)  //! Entries in each part.
 #define DC_HASH(id)    ((id) % DC_HMAP_SIZE)
-#define DC_HMAP_SIZE   (DC_LIST_SIZE >> 2)
-#define DC_READ_UNIT    8
-#define DC_FLUSH_LEN   (DC_LIST_SIZE >> 2)
+#define DC_HMAP_SIZE   (DC_SHARD_SIZE >> 2)
+#define DC_READ_UNIT    8               //! Initial readahead window in blocks.
+#define DC_READ_MAX    (DC_IO_MAX >> 1) //! Maximum readahead window.
+#define DC_WRITE_MAX    DC_IO_MAX       //! Maximum blocks written at once.
+#define DC_IO_MAX      (DC_LIST_SIZE >> 2)  //! Size of the I/O buffer in blocks.
+#define DC_FLUSH_LEN   (DC_SHARD_SIZE >> 1)
+#define DC_DIRECT_MIN   DC_READ_UNIT    //! Minimum blocks to bypass the cache.
+#define DC_SHARDS       4               //! Count of separately locked parts.
+#define DC_SHARD_SPAN  (DC_IO_MAX << 3) //! Successive blocks in the same part.
+#define DC_SHARD(id)   (&g_ctx.cache[(id) / DC_SHARD_SPAN % DC_SHARDS])
 
 /** A single cache entry. */
 typedef struct DCEntry DCEntry;
@@ -70,13 +79,16 @@ struct DCEntry
 	                            //! or the next entry in the free list.
 	DCEntry *next, *prev;       //! Less and more recently used entries.
 
+	unsigned short pins;                //! How many users hold the entry.
 	unsigned dirty : 1;                 //! Data have been modified.
 	unsigned char data[BLK_SIZE_REAL];  //! Cached block data.
 };
 
-/** Disk cache object. */
+/** Disk cache object.  Blocks are spread over DC_SHARDS of these by their
+ *  ID, so that threads working with different files rarely meet. */
 typedef struct
 {
+	pthread_mutex_t lock;               //! Protects the whole object.
 	DCEntry *hmap[DC_HMAP_SIZE];        //! Hashmap for faster searches.
 	DCEntry *mru, *lru;                 //! Most and least recently used.
 
@@ -85,19 +97,35 @@ typedef struct
 	 *      |--|p___|--<--|p___|--<--|p___|--< lru
 	 */
 
-	DCEntry entries[DC_LIST_SIZE];      //! Preallocated cache entries.
+	DCEntry entries[DC_SHARD_SIZE];     //! Preallocated cache entries.
 	DCEntry *free;                      //! First free entry to use.
+
+	/** Buffer for reading or writing multiple blocks at once. */
+	unsigned char io_buf[DC_IO_MAX * BLK_SIZE_REAL];
 }
 DCache;
 
 static void       dcache_init           (void);
 static DCEntry *  dcache_get_block      (unsigned blk_id, int for_overwriting);
-static int        dcache_partial_flush  (void);
+static DCEntry *  dcache_read_ahead     (unsigned blk_id, unsigned len,
+                                         unsigned *fetched);
+static void       dcache_put_block      (DCEntry *pentry);
 static int        dcache_flush          (void);
-
-static void       dcache_unlink_entry   (DCEntry *pentry);
-static void       dcache_trash_entry    (DCEntry *pentry);
+static int        dcache_read_direct    (unsigned blk_id, unsigned len,
+                                         void *buffer);
+static int        dcache_write_direct   (unsigned blk_id, unsigned len,
+                                         const void *buffer);
+
+static DCEntry *  dcache_find_entry     (DCache *pc, unsigned blk_id);
+static DCEntry *  dcache_new_entry      (DCache *pc, unsigned blk_id);
+static DCEntry *  dcache_lookup         (DCache *pc, unsigned blk_id,
+                                         int for_overwriting);
+static void       dcache_unlink_entry   (DCache *pc, DCEntry *pentry);
+static void       dcache_trash_entry    (DCache *pc, DCEntry *pentry);
+static int        dcache_partial_flush  (DCache *pc);
 static int        dcache_entry_cmp      (const void *i1, const void *i2);
+static int        dcache_write_entries  (DCache *pc, DCEntry **array,
+                                         unsigned len);
 
 /* ===== Filesystem ========================================================= */
 
@@ -179,6 +207,9 @@ typedef struct
 	//      Then the code in FileRead/Write simplifies a bit.
 	unsigned blk_id;            //! Current block ID in extent.
 	unsigned short ext_rem;     //! Count of remaining blocks in extent.
+
+	unsigned ra_next;           //! Offset where a sequential read would go on.
+	unsigned short ra_window;   //! Blocks to read ahead, 0 if not sequential.
 }
 FD;
 
@@ -188,13 +219,34 @@ typedef struct
 	unsigned *blk_id;           //! The current indirect block.
 	DCEntry *pentry;            //! Cache entry for the current block,
 	                            //! or the previous one if we're at the end.
+	DCEntry *pparent;           //! Cache entry `blk_id' points into.
 	unsigned i_ext;             //! Extent iterator.
 	unsigned offset;            //! Where we want to get,
 	                            //! offset into the extent on return.
 	Extent *pext;               //! Points to the actual extent on return.
+	unsigned short inode;       //! The i-node we're iterating through.
 }
 GECtx;
 
+/** An extent along with its position within a file. */
+typedef struct
+{
+	unsigned offset;            //! Offset of the extent within the file.
+	Extent ext;                 //! The extent itself.
+}
+XMapEntry;
+
+/** In-memory map of extents of an open file, so that we don't have to walk
+ *  through the indirect blocks every time we need to find an offset. */
+typedef struct
+{
+	XMapEntry *entries;         //! Extents sorted by their offset.
+	unsigned len;               //! Count of extents in the map.
+	unsigned alloc;             //! Allocated count of entries.
+	unsigned valid : 1;         //! Does the map reflect the file?
+}
+XMap;
+
 static int      fs_find_entry    (const char *filename, DirEntry **entry);
 static int      fs_add_entry     (const char *filename, unsigned short inode);
 static void     fs_remove_entry  (DirEntry *pentry);
@@ -202,9 +254,21 @@ static void     fs_remove_entry  (DirEntry *pentry);
 static int      fs_get_extent_try     (GECtx *i, Extent *extent,
                                        unsigned short inode, unsigned offset);
 static int      fs_get_extent_finish  (GECtx *i, Extent *extent);
+static void     fs_get_extent_done    (GECtx *i);
+
+static int        fs_map_push    (XMap *pmap, unsigned offset, Extent *ext);
+static int        fs_map_build   (unsigned short inode);
+static XMapEntry *fs_map_find    (XMap *pmap, unsigned offset);
+static int        fs_map_extent  (unsigned short inode, unsigned offset,
+                                  Extent *extent);
+static void       fs_map_drop    (unsigned short inode);
+
+static unsigned   fs_direct_run      (FD *pfd, unsigned max);
+static void       fs_direct_advance  (FD *pfd, unsigned run);
 
 static inline
 INode *         fs_find_inode    (const char *filename, unsigned short *inode);
+static unsigned fs_get_size      (unsigned short inode);
 static void     fs_unref_inode   (unsigned short inode);
 static void     fs_truncate      (unsigned short inode);
 
@@ -237,16 +301,30 @@ static void      bmap_release           (unsigned blk_id, unsigned short len);
 
 /* ===== Implementation ===================================================== */
 
+/*  Locks are always taken in this order: `fs_lock', an i-node lock,
+ *  then `bmap_lock' or a cache lock, and `dev_lock' last.  Only a single
+ *  i-node is locked at a time.  A descriptor mustn't be used from two
+ *  threads at once, and mounting and unmounting must happen while no
+ *  other calls are in progress.
+ */
 static struct
 {
 	TBlkDev dev;                //! Disk device interface.
+	pthread_mutex_t dev_lock;   //! Serializes requests to the device.
 	unsigned mounted : 1;       //! Is anything mounted right now?
 
-	DCache cache;               //! Disk cache.
+	DCache cache[DC_SHARDS];    //! Disk cache.
 	BMap bmap;                  //! Block bitmap.
+	pthread_mutex_t bmap_lock;  //! Protects the block bitmap.
 
 	SBPadded super_blk;         //! In-memory copy of the superblock.
 	FD fds[OPEN_FILES_MAX];     //! File descriptor array.
+	XMap xmaps[INODES_MAX];     //! Extent maps of open i-nodes.
+
+	/** Protects the directory, i-node allocation and descriptor slots. */
+	pthread_mutex_t fs_lock;
+	/** Protects data, size, extents and descriptors of an i-node. */
+	pthread_rwlock_t inode_locks[INODES_MAX];
 
 	/** How many times an i-node is referenced by either directories or FD's.
 	 *  This is effectively removing the need for vnodes. */
@@ -287,10 +365,14 @@ static unsigned
 bmap_alloc (void)
 {
 	BMap *bm = &g_ctx.bmap;
+	pthread_mutex_lock (&g_ctx.bmap_lock);
 
 	unsigned unit_id = bm->free_iter;
 	if (!bmap_find_free_unit (&unit_id))
+	{
+		pthread_mutex_unlock (&g_ctx.bmap_lock);
 		return BLK_INVALID;
+	}
 
 	BMAP_TYPE unit_bits = bm->bits[unit_id];
 	assert (~unit_bits != 0);
@@ -302,6 +384,8 @@ bmap_alloc (void)
 
 	bm->bits[unit_id] |= bit;
 	bm->free_iter = unit_id;
+
+	pthread_mutex_unlock (&g_ctx.bmap_lock);
 	return blk_id;
 }
 
@@ -378,13 +462,17 @@ static unsigned
 bmap_alloc_prealloc (unsigned short *len)
 {
 	BMap *bm = &g_ctx.bmap;
+	pthread_mutex_lock (&g_ctx.bmap_lock);
 
 	unsigned short n_bits;
 	unsigned blk_id = bmap_find_free_extent (&n_bits);
 	*len = n_bits;
 
 	if (blk_id == BLK_INVALID)
+	{
+		pthread_mutex_unlock (&g_ctx.bmap_lock);
 		return BLK_INVALID;
+	}
 
 	unsigned unit_id = blk_id / BMAP_UNIT;
 	unsigned bit_id  = blk_id % BMAP_UNIT;
@@ -409,6 +497,7 @@ bmap_alloc_prealloc (unsigned short *len)
 	if (n_bits)
 		bm->bits[unit_id] |= ((1UL << n_bits) - 1);
 
+	pthread_mutex_unlock (&g_ctx.bmap_lock);
 	return blk_id;
 }
 
@@ -417,6 +506,7 @@ bmap_release (unsigned blk_id, unsigned short len)
 {
 	BMap *bm = &g_ctx.bmap;
 	assert ((blk_id + len + BMAP_UNIT - 1) / BMAP_UNIT <= bm->size);
+	pthread_mutex_lock (&g_ctx.bmap_lock);
 
 	unsigned unit_id = blk_id / BMAP_UNIT;
 	unsigned bit_id  = blk_id % BMAP_UNIT;
@@ -444,6 +534,29 @@ bmap_release (unsigned blk_id, unsigned short len)
 
 	if (len)
 		bm->bits[unit_id] &= ~((1UL << len) - 1);
+
+	pthread_mutex_unlock (&g_ctx.bmap_lock);
+}
+
+/* ----- Device ------------------------------------------------------------- */
+/** Read sectors from the device.  Requests go to it one at a time. */
+static int
+dev_read (int sector, void *data, int count)
+{
+	pthread_mutex_lock (&g_ctx.dev_lock);
+	int result = g_ctx.dev.m_Read (sector, data, count);
+	pthread_mutex_unlock (&g_ctx.dev_lock);
+	return result;
+}
+
+/** Write sectors to the device.  Requests go to it one at a time. */
+static int
+dev_write (int sector, const void *data, int count)
+{
+	pthread_mutex_lock (&g_ctx.dev_lock);
+	int result = g_ctx.dev.m_Write (sector, data, count);
+	pthread_mutex_unlock (&g_ctx.dev_lock);
+	return result;
 }
 
 /* ----- Disk block cache --------------------------------------------------- */
@@ -451,23 +564,25 @@ bmap_release (unsigned blk_id, unsigned short len)
 static void
 dcache_init (void)
 {
-	DCache *pc = &g_ctx.cache;
-	memset (pc, 0, sizeof *pc);
-
-	/* Link entries in the free list. */
-	for (unsigned i = DC_LIST_SIZE; i--; )
+	for (unsigned shard = 0; shard < DC_SHARDS; shard++)
 	{
-		pc->entries[i].hmap_next = pc->free;
-		pc->free = &pc->entries[i];
+		DCache *pc = &g_ctx.cache[shard];
+		memset (pc, 0, sizeof *pc);
+		pthread_mutex_init (&pc->lock, NULL);
+
+		/* Link entries in the free list. */
+		for (unsigned i = DC_SHARD_SIZE; i--; )
+		{
+			pc->entries[i].hmap_next = pc->free;
+			pc->free = &pc->entries[i];
+		}
 	}
 }
 
 /** Unlink a cache entry from the LRU list. */
 static void
-dcache_unlink_entry (DCEntry *pentry)
+dcache_unlink_entry (DCache *pc, DCEntry *pentry)
 {
-	DCache *pc = &g_ctx.cache;
-
 	/* Remove from the double-linked list. */
 	if (pentry->next)
 		pentry->next->prev = pentry->prev;
@@ -482,11 +597,10 @@ dcache_unlink_entry (DCEntry *pentry)
 
 /** Remove an entry from the cache altogether. */
 static void
-dcache_trash_entry (DCEntry *pentry)
+dcache_trash_entry (DCache *pc, DCEntry *pentry)
 {
-	DCache *pc = &g_ctx.cache;
-
-	dcache_unlink_entry (pentry);
+	assert (pentry->pins == 0);
+	dcache_unlink_entry (pc, pentry);
 
 	/* Remove from the hashmap. */
 	DCEntry **ppentry = &pc->hmap[DC_HASH (pentry->blk_id)];
@@ -502,65 +616,77 @@ dcache_trash_entry (DCEntry *pentry)
 }
 
 
-/** Get a cache entry for a block.  Returns NULL on failure. */
+/** Search for a block in the cache, without touching the LRU list. */
 static DCEntry *
-dcache_get_block (unsigned blk_id, int for_overwriting)
+dcache_find_entry (DCache *pc, unsigned blk_id)
 {
-	DCache *pc = &g_ctx.cache;
+	DCEntry *pentry = pc->hmap[DC_HASH (blk_id)];
+	while (pentry && pentry->blk_id != blk_id)
+		pentry = pentry->hmap_next;
+	return pentry;
+}
 
-	/* Search for the block in the hashmap. */
+/** Take a free entry for a block and make it the most recently used one.
+ *  There has to be a free entry available. */
+static DCEntry *
+dcache_new_entry (DCache *pc, unsigned blk_id)
+{
+	assert (pc->free != NULL);
+
+	DCEntry *pentry = pc->free;
+	pc->free = pentry->hmap_next;
+	pentry->blk_id = blk_id;
+	pentry->dirty = 0;
+	pentry->pins = 0;
+
+	/* Place it in the hashmap. */
 	unsigned blk_hash = DC_HASH (blk_id);
-	DCEntry *pentry = pc->hmap[blk_hash];
-	while (pentry)
+	pentry->hmap_next = pc->hmap[blk_hash];
+	pc->hmap[blk_hash] = pentry;
+
+	/* Place it in the linked list. */
+	pentry->prev = pentry->next = NULL;
+	if (pc->mru)
 	{
-		if (pentry->blk_id == blk_id)
-			break;
-		pentry = pentry->hmap_next;
+		pc->mru->prev = pentry;
+		pentry->next = pc->mru;
+		pc->mru = pentry;
 	}
+	else
+		pc->mru = pc->lru = pentry;
+
+	return pentry;
+}
 
+/** Find or load a block in a locked part of the cache. */
+static DCEntry *
+dcache_lookup (DCache *pc, unsigned blk_id, int for_overwriting)
+{
+	/* Search for the block in the hashmap. */
+	DCEntry *pentry = dcache_find_entry (pc, blk_id);
 	if (!pentry)
 	{
 		/* Cache miss, we have to read from disk. */
-		// TODO: Readahead (DC_READ_UNIT); only if !for_overwriting.
-
 		if (!pc->free)
-			dcache_partial_flush ();
+			dcache_partial_flush (pc);
 		assert (pc->free != NULL);
 
 		/* Try to read the block from disk if requested. */
-		pentry = pc->free;
 		if (!for_overwriting)
-			if (g_ctx.dev.m_Read (blk_id * BLK_SIZE,
-				pentry->data, BLK_SIZE) != BLK_SIZE)
+			if (dev_read (blk_id * BLK_SIZE,
+				pc->free->data, BLK_SIZE) != BLK_SIZE)
 			{
 				DEBUG ("EE Failed to read block %u\n", blk_id);
 				return NULL;
 			}
 
 		/* We have succeeded, so allocate the cache entry. */
-		pc->free = pentry->hmap_next;
-		pentry->blk_id = blk_id;
-		pentry->dirty = 0;
-
-		/* Place it in the hashmap. */
-		pentry->hmap_next = pc->hmap[blk_hash];
-		pc->hmap[blk_hash] = pentry;
-
-		/* Place it in the linked list. */
-		pentry->prev = pentry->next = NULL;
-		if (pc->mru)
-		{
-			pc->mru->prev = pentry;
-			pentry->next = pc->mru;
-			pc->mru = pentry;
-		}
-		else
-			pc->mru = pc->lru = pentry;
+		pentry = dcache_new_entry (pc, blk_id);
 	}
 	else if (pentry != pc->mru)
 	{
 		/* Move the entry to MRU. */
-		dcache_unlink_entry (pentry);
+		dcache_unlink_entry (pc, pentry);
 		pentry->next = pc->mru;
 		pentry->prev = NULL;
 
@@ -575,47 +701,252 @@ dcache_get_block (unsigned blk_id, int for_overwriting)
 	return pentry;
 }
 
-/** Compare two entries by block ID. */
+/** Get a cache entry for a block.  Returns NULL on failure.  The entry
+ *  stays in the cache until it's given back with dcache_put_block(). */
+static DCEntry *
+dcache_get_block (unsigned blk_id, int for_overwriting)
+{
+	DCache *pc = DC_SHARD (blk_id);
+
+	pthread_mutex_lock (&pc->lock);
+	DCEntry *pentry = dcache_lookup (pc, blk_id, for_overwriting);
+	if (pentry)
+		pentry->pins++;
+	pthread_mutex_unlock (&pc->lock);
+	return pentry;
+}
+
+/** Give back an entry returned by dcache_get_block() or dcache_read_ahead(),
+ *  so that it can be flushed and evicted. */
+static void
+dcache_put_block (DCEntry *pentry)
+{
+	DCache *pc = DC_SHARD (pentry->blk_id);
+
+	pthread_mutex_lock (&pc->lock);
+	assert (pentry->pins != 0);
+	pentry->pins--;
+	pthread_mutex_unlock (&pc->lock);
+}
+
+/** Get a cache entry for a block, reading up to @a len successive blocks
+ *  from disk in a single request on a miss.  The number of blocks that have
+ *  been read is stored in @a fetched.  Returns NULL on failure. */
+static DCEntry *
+dcache_read_ahead (unsigned blk_id, unsigned len, unsigned *fetched)
+{
+	DCache *pc = DC_SHARD (blk_id);
+	DCEntry *pentry = NULL;
+	*fetched = 0;
+
+	pthread_mutex_lock (&pc->lock);
+	if (dcache_find_entry (pc, blk_id))
+	{
+		pentry = dcache_lookup (pc, blk_id, 0);
+		goto dcache_ra_return;
+	}
+
+	/* Stop at the first block that's cached, it may be dirty,
+	 * and don't go past blocks belonging to this part of the cache. */
+	if (len > DC_READ_MAX)
+		len = DC_READ_MAX;
+	if (len > DC_SHARD_SPAN - blk_id % DC_SHARD_SPAN)
+		len = DC_SHARD_SPAN - blk_id % DC_SHARD_SPAN;
+
+	unsigned n;
+	for (n = 1; n < len; n++)
+		if (dcache_find_entry (pc, blk_id + n))
+			break;
+
+	/* Don't evict more than a partial flush would. */
+	if (!pc->free)
+		dcache_partial_flush (pc);
+
+	unsigned n_free;
+	n_free = 0;
+	for (DCEntry *iter = pc->free; iter && n_free < n; iter = iter->hmap_next)
+		n_free++;
+	if (n > n_free)
+		n = n_free;
+
+	/* Entries pinned by other threads may leave none to read ahead into,
+	 * dcache_lookup() then takes care of the single block. */
+	if (n <= 1)
+	{
+		*fetched = 1;
+		pentry = dcache_lookup (pc, blk_id, 0);
+		goto dcache_ra_return;
+	}
+
+	*fetched = n;
+
+	if (dev_read (blk_id * BLK_SIZE,
+		pc->io_buf, n * BLK_SIZE) != (signed) (n * BLK_SIZE))
+	{
+		DEBUG ("EE Failed to read blocks %u-%u\n", blk_id, blk_id + n - 1);
+		*fetched = 1;
+		pentry = dcache_lookup (pc, blk_id, 0);
+		goto dcache_ra_return;
+	}
+
+	/* Insert the blocks backwards, leaving the first one as the MRU. */
+	while (n--)
+	{
+		pentry = dcache_new_entry (pc, blk_id + n);
+		memcpy (pentry->data, pc->io_buf + n * BLK_SIZE_REAL, BLK_SIZE_REAL);
+	}
+
+dcache_ra_return:
+	if (pentry)
+		pentry->pins++;
+	pthread_mutex_unlock (&pc->lock);
+	return pentry;
+}
+
+/** Read blocks straight into a buffer, bypassing the cache.  Blocks that
+ *  are dirty in the cache are newer than on disk and get copied over. */
+static int
+dcache_read_direct (unsigned blk_id, unsigned len, void *buffer)
+{
+	/* Keep each part of the cache locked while reading its blocks,
+	 * so that they can't get flushed in the meantime. */
+	while (len)
+	{
+		DCache *pc = DC_SHARD (blk_id);
+		unsigned n = DC_SHARD_SPAN - blk_id % DC_SHARD_SPAN;
+		if (n > len)
+			n = len;
+
+		pthread_mutex_lock (&pc->lock);
+		if (dev_read (blk_id * BLK_SIZE, buffer, n * BLK_SIZE)
+			!= (signed) (n * BLK_SIZE))
+		{
+			pthread_mutex_unlock (&pc->lock);
+			DEBUG ("EE Failed to read blocks %u-%u\n", blk_id, blk_id + n - 1);
+			return 0;
+		}
+
+		for (unsigned i = 0; i < n; i++)
+		{
+			DCEntry *pentry = dcache_find_entry (pc, blk_id + i);
+			if (pentry && pentry->dirty)
+				memcpy ((char *) buffer + i * BLK_SIZE_REAL,
+					pentry->data, BLK_SIZE_REAL);
+		}
+		pthread_mutex_unlock (&pc->lock);
+
+		blk_id += n;
+		len -= n;
+		buffer = (char *) buffer + n * BLK_SIZE_REAL;
+	}
+	return 1;
+}
+
+/** Write blocks straight from a buffer, bypassing the cache.
+ *  Any cached copies of the blocks are outdated and get thrown away. */
+static int
+dcache_write_direct (unsigned blk_id, unsigned len, const void *buffer)
+{
+	/* Like in dcache_read_direct(), old copies mustn't get flushed later. */
+	while (len)
+	{
+		DCache *pc = DC_SHARD (blk_id);
+		unsigned n = DC_SHARD_SPAN - blk_id % DC_SHARD_SPAN;
+		if (n > len)
+			n = len;
+
+		pthread_mutex_lock (&pc->lock);
+		if (dev_write (blk_id * BLK_SIZE, buffer, n * BLK_SIZE)
+			!= (signed) (n * BLK_SIZE))
+		{
+			pthread_mutex_unlock (&pc->lock);
+			DEBUG ("EE Failed to write blocks %u-%u\n", blk_id, blk_id + n - 1);
+			return 0;
+		}
+
+		for (unsigned i = 0; i < n; i++)
+		{
+			DCEntry *pentry = dcache_find_entry (pc, blk_id + i);
+			if (pentry)
+				dcache_trash_entry (pc, pentry);
+		}
+		pthread_mutex_unlock (&pc->lock);
+
+		blk_id += n;
+		len -= n;
+		buffer = (const char *) buffer + n * BLK_SIZE_REAL;
+	}
+	return 1;
+}
+
+/** Compare two pointers to entries by block ID. */
 static int
 dcache_entry_cmp (const void *i1, const void *i2)
 {
-	DCEntry *e1 = (DCEntry *) i1;
-	DCEntry *e2 = (DCEntry *) i2;
-	return (signed) e1->blk_id - (signed) e2->blk_id;
+	DCEntry *e1 = *(DCEntry **) i1;
+	DCEntry *e2 = *(DCEntry **) i2;
+	return (e1->blk_id > e2->blk_id) - (e1->blk_id < e2->blk_id);
 }
 
-/** Make space for new cache entries. */
+/** Write entries sorted by block ID to disk.  Runs of successive blocks
+ *  are gathered into the I/O buffer and written in a single request. */
 static int
-dcache_partial_flush (void)
+dcache_write_entries (DCache *pc, DCEntry **array, unsigned len)
 {
-	DCache *pc = &g_ctx.cache;
+	unsigned i, run;
+	int fail = 0;
+
+	for (i = 0; i < len; i += run)
+	{
+		for (run = 1; i + run < len && run < DC_WRITE_MAX; run++)
+			if (array[i + run]->blk_id != array[i]->blk_id + run)
+				break;
+
+		/* Single blocks can go straight from the cache. */
+		const unsigned char *data = array[i]->data;
+		if (run > 1)
+		{
+			for (unsigned k = 0; k < run; k++)
+				memcpy (pc->io_buf + k * BLK_SIZE_REAL,
+					array[i + k]->data, BLK_SIZE_REAL);
+			data = pc->io_buf;
+		}
+
+		if (dev_write (array[i]->blk_id * BLK_SIZE,
+			data, run * BLK_SIZE) != (signed) (run * BLK_SIZE))
+			fail = 1;
+	}
+	return !fail;
+}
 
+/** Make space for new cache entries in a locked part of the cache.
+ *  Entries that are in use are left alone. */
+static int
+dcache_partial_flush (DCache *pc)
+{
 	/* We should only call this function when the cache is full. */
 	assert (pc->free == NULL);
 
 	/* Put pointers on items into an array and sort them by block ID. */
-	DCEntry *iter, *array[DC_LIST_SIZE];
+	DCEntry *iter, *array[DC_SHARD_SIZE];
 	unsigned i, to_write = 0;
 	for (iter = pc->lru, i = 0;
 		iter && i < DC_FLUSH_LEN; iter = iter->prev, i++)
 	{
+		if (iter->pins)
+			continue;
 		if (iter->dirty)
 			array[to_write++] = iter;
 		else
-			dcache_trash_entry (iter);
+			dcache_trash_entry (pc, iter);
 	}
 
 	qsort (array, to_write, sizeof *array, dcache_entry_cmp);
 
 	/* Write blocks from array to disk. */
-	int fail = 0;
+	int fail = !dcache_write_entries (pc, array, to_write);
 	for (i = 0; i < to_write; i++)
-	{
-		if (g_ctx.dev.m_Write (array[i]->blk_id * BLK_SIZE,
-			array[i]->data, BLK_SIZE) != BLK_SIZE)
-			fail = 1;
-		dcache_trash_entry (array[i]);
-	}
+		dcache_trash_entry (pc, array[i]);
 
 	if (fail)
 		DEBUG ("EE Failed to flush some blocks\n");
@@ -626,27 +957,30 @@ dcache_partial_flush (void)
 static int
 dcache_flush (void)
 {
-	DCache *pc = &g_ctx.cache;
+	int fail = 0;
+	for (unsigned shard = 0; shard < DC_SHARDS; shard++)
+	{
+		DCache *pc = &g_ctx.cache[shard];
+		pthread_mutex_lock (&pc->lock);
 
-	/* Put pointers on items into an array and sort them by block ID. */
-	DCEntry *iter, *array[DC_LIST_SIZE];
-	unsigned i, to_write = 0;
-	for (iter = pc->lru; iter; iter = iter->prev)
-		if (iter->dirty)
-			array[to_write++] = iter;
+		/* Put pointers on items into an array and sort them by block ID. */
+		DCEntry *iter, *array[DC_SHARD_SIZE];
+		unsigned i, to_write = 0;
+		for (iter = pc->lru; iter; iter = iter->prev)
+			if (iter->dirty)
+				array[to_write++] = iter;
 
-	qsort (array, to_write, sizeof *array, dcache_entry_cmp);
+		qsort (array, to_write, sizeof *array, dcache_entry_cmp);
 
-	/* Write blocks from array to disk. */
-	int fail = 0;
-	for (i = 0; i < to_write; i++)
-	{
-		if (g_ctx.dev.m_Write (array[i]->blk_id * BLK_SIZE,
-			array[i]->data, BLK_SIZE) != BLK_SIZE)
+		/* Write blocks from array to disk. */
+		if (!dcache_write_entries (pc, array, to_write))
 			fail = 1;
+		for (i = 0; i < to_write; i++)
+			array[i]->dirty = 0;
+
+		pthread_mutex_unlock (&pc->lock);
 	}
 
-	dcache_init ();
 	if (fail)
 		DEBUG ("EE Failed to flush some blocks\n");
 	return !fail;
@@ -733,6 +1067,7 @@ fs_truncate (unsigned short inode)
 	unsigned blk_id = psb->inodes[inode].indir_id;
 	psb->inodes[inode].indir_id = BLK_INVALID;
 	psb->inodes[inode].size = 0;
+	g_ctx.xmaps[inode].len = 0;
 
 	while (blk_id != BLK_INVALID)
 	{
@@ -748,6 +1083,7 @@ fs_truncate (unsigned short inode)
 		bmap_release (blk_id, 1);
 		pentry->dirty = 0;
 		blk_id = pindir->next_id;
+		dcache_put_block (pentry);
 	}
 }
 
@@ -763,6 +1099,7 @@ fs_truncate (unsigned short inode)
   * structure is modified, so that this condition holds true.
   * The function returns 0 if no such extent has been allocated.
   * To allocate the required extents, call fs_get_extent_finish().
+  * Either way, fs_get_extent_done() has to be called afterwards.
   */
 static int
 fs_get_extent_try (GECtx *i, Extent *extent,
@@ -770,9 +1107,10 @@ fs_get_extent_try (GECtx *i, Extent *extent,
 {
 	SuperBlk *psb = &g_ctx.super_blk.sb;
 
-	i->pentry = NULL;
+	i->pentry = i->pparent = NULL;
 	i->blk_id = &psb->inodes[inode].indir_id;
 	i->offset = offset;
+	i->inode = inode;
 	while (*i->blk_id != BLK_INVALID)
 	{
 		i->pentry = dcache_get_block (*i->blk_id, 0);
@@ -798,6 +1136,10 @@ fs_get_extent_try (GECtx *i, Extent *extent,
 			break;
 		}
 
+		/* Keep hold of the block we're pointing into. */
+		if (i->pparent)
+			dcache_put_block (i->pparent);
+		i->pparent = i->pentry;
 		i->blk_id = &pindir->next_id;
 	}
 
@@ -830,10 +1172,12 @@ fs_get_extent_finish (GECtx *i, Extent *extent)
 
 			/* Set the previous indirect block dirty,
 			 * as we've changed the next block pointer. */
-			if (i->pentry != BLK_INVALID)
-				i->pentry->dirty = 1;
+			if (i->pparent)
+				i->pparent->dirty = 1;
 
-			/* Fill out the header. */
+			/* Fill out the header.  The previous entry, if any,
+			 * is held through `pparent'. */
+			assert (i->pentry == i->pparent);
 			i->pentry = dcache_get_block (*i->blk_id, 1);
 			assert (i->pentry != NULL);
 			pindir = (IndirBlk *) i->pentry->data;
@@ -855,8 +1199,27 @@ fs_get_extent_finish (GECtx *i, Extent *extent)
 		pindir->len++;
 		i->pentry->dirty = 1;
 
+		/* Extents are only ever appended, so the map can follow. */
+		XMap *pmap = &g_ctx.xmaps[i->inode];
+		if (pmap->valid)
+		{
+			unsigned end = 0;
+			if (pmap->len)
+			{
+				XMapEntry *plast = &pmap->entries[pmap->len - 1];
+				end = plast->offset + plast->ext.len * BLK_SIZE_REAL;
+			}
+			if (!fs_map_push (pmap, end, &pexts[i->i_ext]))
+				fs_map_drop (i->inode);
+		}
+
 		if (pindir->len == psb->extents_in_indir_blk)
+		{
+			if (i->pparent && i->pparent != i->pentry)
+				dcache_put_block (i->pparent);
+			i->pparent = i->pentry;
 			i->blk_id = &pindir->next_id;
+		}
 
 		unsigned allocated = pexts[i->i_ext].len * BLK_SIZE_REAL;
 		if (i->offset < allocated)
@@ -869,6 +1232,167 @@ fs_get_extent_finish (GECtx *i, Extent *extent)
 	FSGE_RETURN
 }
 
+/** Give back cache entries held by the iterator. */
+static void
+fs_get_extent_done (GECtx *i)
+{
+	if (i->pparent && i->pparent != i->pentry)
+		dcache_put_block (i->pparent);
+	if (i->pentry)
+		dcache_put_block (i->pentry);
+	i->pentry = i->pparent = NULL;
+}
+
+/** Append an extent to the map. */
+static int
+fs_map_push (XMap *pmap, unsigned offset, Extent *ext)
+{
+	if (pmap->len == pmap->alloc)
+	{
+		unsigned alloc = pmap->alloc ? pmap->alloc << 1 : 16;
+		XMapEntry *entries = (XMapEntry *)
+			realloc (pmap->entries, alloc * sizeof *entries);
+		if (!entries)
+			return 0;
+
+		pmap->entries = entries;
+		pmap->alloc = alloc;
+	}
+
+	pmap->entries[pmap->len].offset = offset;
+	pmap->entries[pmap->len].ext = *ext;
+	pmap->len++;
+	return 1;
+}
+
+/** Read all extents of a file into its map. */
+static int
+fs_map_build (unsigned short inode)
+{
+	SuperBlk *psb = &g_ctx.super_blk.sb;
+	XMap *pmap = &g_ctx.xmaps[inode];
+
+	pmap->len = 0;
+	unsigned offset = 0, blk_id = psb->inodes[inode].indir_id;
+	while (blk_id != BLK_INVALID)
+	{
+		DCEntry  *pentry = dcache_get_block (blk_id, 0);
+		assert (pentry != NULL);
+		IndirBlk *pindir = (IndirBlk *) pentry->data;
+		Extent   *pexts  = (Extent   *) (pindir + 1);
+
+		assert (pindir->len <= psb->extents_in_indir_blk);
+		for (unsigned i = 0; i < pindir->len; i++)
+		{
+			if (!fs_map_push (pmap, offset, &pexts[i]))
+			{
+				DEBUG ("EE Failed to build an extent map\n");
+				dcache_put_block (pentry);
+				fs_map_drop (inode);
+				return 0;
+			}
+			offset += pexts[i].len * BLK_SIZE_REAL;
+		}
+		blk_id = pindir->next_id;
+		dcache_put_block (pentry);
+	}
+
+	pmap->valid = 1;
+	return 1;
+}
+
+/** Find the extent containing an offset in the map. */
+static XMapEntry *
+fs_map_find (XMap *pmap, unsigned offset)
+{
+	int min = 0, max = pmap->len - 1;
+
+	/* Find the last extent that starts at or before the offset. */
+	while (max >= min)
+	{
+		int mid = (min + max) / 2;
+		if (pmap->entries[mid].offset > offset)
+			max = mid - 1;
+		else
+			min = mid + 1;
+	}
+
+	if (max < 0)
+		return NULL;
+
+	XMapEntry *pentry = &pmap->entries[max];
+	if ((offset - pentry->offset) / BLK_SIZE_REAL >= pentry->ext.len)
+		return NULL;
+	return pentry;
+}
+
+/** Like fs_get_extent_try(), only looking into the map of the file.
+ *  The map is built by FileOpen(), as readers may share the i-node. */
+static int
+fs_map_extent (unsigned short inode, unsigned offset, Extent *extent)
+{
+	XMap *pmap = &g_ctx.xmaps[inode];
+	if (!pmap->valid)
+	{
+		GECtx ctx;
+		int found = fs_get_extent_try (&ctx, extent, inode, offset);
+		fs_get_extent_done (&ctx);
+		return found;
+	}
+
+	XMapEntry *pentry = fs_map_find (pmap, offset);
+	if (!pentry)
+		return 0;
+
+	unsigned blk_off = (offset - pentry->offset) / BLK_SIZE_REAL;
+	extent->blk_id = pentry->ext.blk_id + blk_off;
+	extent->len    = pentry->ext.len    - blk_off;
+	return 1;
+}
+
+/** Count how many blocks, up to @a max, can be transferred in a single
+ *  request from the current position of a descriptor.  Extents that follow
+ *  each other on the disk are joined together. */
+static unsigned
+fs_direct_run (FD *pfd, unsigned max)
+{
+	unsigned run = pfd->ext_rem < max ? pfd->ext_rem : max;
+
+	Extent ext;
+	while (run < max && fs_map_extent (pfd->inode,
+		pfd->offset + run * BLK_SIZE_REAL, &ext)
+	 && ext.blk_id == pfd->blk_id + run)
+		run += ext.len < max - run ? ext.len : max - run;
+	return run;
+}
+
+/** Move a descriptor forward by @a run blocks after a direct transfer. */
+static void
+fs_direct_advance (FD *pfd, unsigned run)
+{
+	pfd->offset += run * BLK_SIZE_REAL;
+	if (run < pfd->ext_rem)
+	{
+		pfd->blk_id  += run;
+		pfd->ext_rem -= run;
+	}
+	else
+	{
+		/* We might have gone through more extents, look it up again. */
+		pfd->blk_id  = BLK_INVALID;
+		pfd->ext_rem = 0;
+	}
+}
+
+/** Throw away the extent map of a file. */
+static void
+fs_map_drop (unsigned short inode)
+{
+	XMap *pmap = &g_ctx.xmaps[inode];
+	free (pmap->entries);
+	memset (pmap, 0, sizeof *pmap);
+}
+
 /** Search for an i-node by filename. */
 static inline INode *
 fs_find_inode (const char *filename, unsigned short *inode)
@@ -881,6 +1405,16 @@ fs_find_inode (const char *filename, unsigned short *inode)
 	return &g_ctx.super_blk.sb.inodes[pentry->inode];
 }
 
+/** Get the size of a file, which may be just being written to. */
+static unsigned
+fs_get_size (unsigned short inode)
+{
+	pthread_rwlock_rdlock (&g_ctx.inode_locks[inode]);
+	unsigned size = g_ctx.super_blk.sb.inodes[inode].size;
+	pthread_rwlock_unlock (&g_ctx.inode_locks[inode]);
+	return size;
+}
+
 /** Unreference an i-node and possibly free all of its data. */
 static void
 fs_unref_inode (unsigned short inode)
@@ -902,23 +1436,40 @@ fs_unref_inode (unsigned short inode)
 
 	SuperBlk *psb = &g_ctx.super_blk.sb;
 
+	/* There may still be readers going through the file. */
+	pthread_rwlock_wrlock (&g_ctx.inode_locks[inode]);
+
 	GECtx ctx;
 	Extent e;
-	if (!fs_get_extent_try (&ctx, &e, inode, psb->inodes[inode].size))
-		return;
-
-	/* Skip the last block with data. */
-	if (ctx.offset)
+	if (fs_get_extent_try (&ctx, &e, inode, psb->inodes[inode].size))
 	{
-		e.blk_id++;
-		e.len--;
-	}
+		/* Skip the last block with data. */
+		if (ctx.offset)
+		{
+			e.blk_id++;
+			e.len--;
+		}
 
-	if (e.len)
-	{
-		bmap_release (e.blk_id, e.len);
-		ctx.pext->len -= e.len;
+		if (e.len)
+		{
+			bmap_release (e.blk_id, e.len);
+			ctx.pext->len -= e.len;
+			ctx.pentry->dirty = 1;
+
+			/* The trimmed extent is the last one. */
+			XMap *pmap = &g_ctx.xmaps[inode];
+			XMapEntry *pxentry;
+			if (pmap->valid
+			 && (pxentry = fs_map_find (pmap, psb->inodes[inode].size)))
+			{
+				pxentry->ext.len = ctx.pext->len;
+				pmap->len = pxentry - pmap->entries + 1;
+			}
+		}
 	}
+
+	fs_get_extent_done (&ctx);
+	pthread_rwlock_unlock (&g_ctx.inode_locks[inode]);
 }
 
 /* ----- Public interface --------------------------------------------------- */
@@ -1034,6 +1585,12 @@ FsMount (TBlkDev *dev)
 	g_ctx.dev = *dev;
 	g_ctx.mounted = 1;
 
+	pthread_mutex_init (&g_ctx.dev_lock, NULL);
+	pthread_mutex_init (&g_ctx.bmap_lock, NULL);
+	pthread_mutex_init (&g_ctx.fs_lock, NULL);
+	for (unsigned inode = 0; inode < INODES_MAX; inode++)
+		pthread_rwlock_init (&g_ctx.inode_locks[inode], NULL);
+
 	dcache_init ();
 
 	g_ctx.bmap.size = psb->bmap_size * BLK_SIZE_REAL * 8 / BMAP_UNIT;
@@ -1061,6 +1618,9 @@ FsUmount (void)
 	SuperBlk *psb = &g_ctx.super_blk.sb;
 	dcache_flush ();
 
+	for (unsigned inode = 0; inode < INODES_MAX; inode++)
+		fs_map_drop (inode);
+
 	/* Update the on-disk block bitmap. */
 	if (g_ctx.dev.m_Write (BLK_SCT_SIZEOF (SuperBlk),
 		g_ctx.bmap.bits, psb->bmap_size * BLK_SIZE)
@@ -1079,6 +1639,14 @@ FsUmount (void)
 		return 0;
 	}
 
+	for (unsigned shard = 0; shard < DC_SHARDS; shard++)
+		pthread_mutex_destroy (&g_ctx.cache[shard].lock);
+	for (unsigned inode = 0; inode < INODES_MAX; inode++)
+		pthread_rwlock_destroy (&g_ctx.inode_locks[inode]);
+	pthread_mutex_destroy (&g_ctx.fs_lock);
+	pthread_mutex_destroy (&g_ctx.bmap_lock);
+	pthread_mutex_destroy (&g_ctx.dev_lock);
+
 	free (g_ctx.bmap.bits);
 	memset (&g_ctx, 0, sizeof g_ctx);
 	return 1;
@@ -1091,19 +1659,21 @@ FileOpen (const char *filename, int write_mode)
 	 || strlen (filename) > FILENAME_LEN_MAX)
 		return -1;
 
+	pthread_mutex_lock (&g_ctx.fs_lock);
+
 	/* Find a free file descriptor. */
 	int fd;
 	for (fd = 0; fd < OPEN_FILES_MAX; fd++)
 		if (!g_ctx.fds[fd].open)
 			break;
 	if (fd == OPEN_FILES_MAX)
-		return -1;
+		goto file_open_fail;
 
 	unsigned short inode;
 	if (!fs_find_inode (filename, &inode))
 	{
 		if (!write_mode)
-			return -1;
+			goto file_open_fail;
 
 		/* Find a free i-node. */
 		for (inode = 0; inode < INODES_MAX; inode++)
@@ -1113,7 +1683,7 @@ FileOpen (const char *filename, int write_mode)
 
 		/* Write a directory entry. */
 		if (!fs_add_entry (filename, inode))
-			return -1;
+			goto file_open_fail;
 
 		/* Initialize the i-node. */
 		g_ctx.inode_ref_cnt[inode]++;
@@ -1122,20 +1692,34 @@ FileOpen (const char *filename, int write_mode)
 		pi->indir_id = BLK_INVALID;
 		pi->size = 0;
 	}
-	else if (write_mode)
+
+	/* Readers don't build the extent map themselves, do it right away. */
+	pthread_rwlock_wrlock (&g_ctx.inode_locks[inode]);
+	if (write_mode)
 		fs_truncate (inode);
+	if (!g_ctx.xmaps[inode].valid)
+		fs_map_build (inode);
+	pthread_rwlock_unlock (&g_ctx.inode_locks[inode]);
 
 	/* Initialize the descriptor. */
-	FD *pfd = &g_ctx.fds[fd];
+	FD *pfd;
+	pfd = &g_ctx.fds[fd];
 	pfd->open = 1;
 	pfd->wr_mode = write_mode;
 	pfd->inode = inode;
 	pfd->offset = 0;
 	pfd->blk_id = BLK_INVALID;
 	pfd->ext_rem = 0;
+	pfd->ra_next = 0;
+	pfd->ra_window = DC_READ_UNIT;
 
 	g_ctx.inode_ref_cnt[inode]++;
+	pthread_mutex_unlock (&g_ctx.fs_lock);
 	return fd;
+
+file_open_fail:
+	pthread_mutex_unlock (&g_ctx.fs_lock);
+	return -1;
 }
 
 int
@@ -1149,6 +1733,8 @@ FileRead (int fd, void *buffer, int len)
 	if (!pfd->open || pfd->wr_mode)
 		return 0;
 
+	pthread_rwlock_rdlock (&g_ctx.inode_locks[pfd->inode]);
+
 	/* First compute how much we can actually get. */
 	INode *pinode = &g_ctx.super_blk.sb.inodes[pfd->inode];
 
@@ -1160,16 +1746,22 @@ FileRead (int fd, void *buffer, int len)
 
 	unsigned read = 0;
 	unsigned blk_offset = pfd->offset % BLK_SIZE_REAL;
+	int direct = 0;
+
+	/* Only read ahead when the file is being read sequentially. */
+	if (pfd->offset != pfd->ra_next)
+		pfd->ra_window = 0;
+	else if (!pfd->ra_window)
+		pfd->ra_window = DC_READ_UNIT;
 
 	while (remains)
 	{
 		/* Eventually request ID's of blocks to read from. */
 		if (pfd->blk_id == BLK_INVALID)
 		{
-			GECtx ctx;
 			Extent ext;
 
-			if (!fs_get_extent_try (&ctx, &ext, pfd->inode, pfd->offset))
+			if (!fs_map_extent (pfd->inode, pfd->offset, &ext))
 			{
 				DEBUG ("EE Failed to get extent for file data\n");
 				abort ();
@@ -1179,15 +1771,56 @@ FileRead (int fd, void *buffer, int len)
 			pfd->ext_rem = ext.len;
 		}
 
+		/* Read whole blocks right into the buffer if there are enough. */
+		unsigned blocks = remains / BLK_SIZE_REAL;
+		if (!blk_offset && blocks >= DC_DIRECT_MIN)
+		{
+			unsigned run = fs_direct_run (pfd, blocks);
+			if (!dcache_read_direct (pfd->blk_id, run, (char *) buffer + read))
+				break;
+
+			remains -= run * BLK_SIZE_REAL;
+			read += run * BLK_SIZE_REAL;
+			fs_direct_advance (pfd, run);
+			direct = 1;
+			continue;
+		}
+
 		/* Read as much as we can from the current block. */
 		unsigned to_read = BLK_SIZE_REAL - blk_offset;
 		if (to_read > remains)
 			to_read = remains;
 
-		DCEntry *pentry = dcache_get_block (pfd->blk_id, 0);
+		DCEntry *pentry;
+		if (pfd->ra_window)
+		{
+			/* Read the rest of the extent, but not past the end of file. */
+			unsigned ra_len = BLK_BLK_SIZE (pinode->size
+				- (pfd->offset - blk_offset)), fetched;
+			if (ra_len > pfd->ext_rem)
+				ra_len = pfd->ext_rem;
+			if (ra_len > pfd->ra_window)
+				ra_len = pfd->ra_window;
+
+			/* Calls taking the direct path would only read the blocks
+			 * twice, as it ignores clean copies in the cache. */
+			if ((remains - to_read) / BLK_SIZE_REAL >= DC_DIRECT_MIN)
+				ra_len = 1;
+			else if (direct && ra_len > BLK_BLK_SIZE (blk_offset + remains))
+				ra_len = BLK_BLK_SIZE (blk_offset + remains);
+
+			/* Widen the window every time it gets used. */
+			pentry = dcache_read_ahead (pfd->blk_id, ra_len, &fetched);
+			if (fetched > 1 && pfd->ra_window < DC_READ_MAX)
+				pfd->ra_window <<= 1;
+		}
+		else
+			pentry = dcache_get_block (pfd->blk_id, 0);
+
 		assert (pentry != NULL);
 		memcpy ((char *) buffer + read,
 			pentry->data + blk_offset, to_read);
+		dcache_put_block (pentry);
 
 		remains -= to_read;
 		read += to_read;
@@ -1205,6 +1838,8 @@ FileRead (int fd, void *buffer, int len)
 			pfd->blk_id = BLK_INVALID;
 	}
 
+	pfd->ra_next = pfd->offset;
+	pthread_rwlock_unlock (&g_ctx.inode_locks[pfd->inode]);
 	return read;
 }
 
@@ -1222,6 +1857,10 @@ FileWrite (int fd, const void *buffer, int len)
 		return 0;
 	}
 
+	pthread_rwlock_wrlock (&g_ctx.inode_locks[pfd->inode]);
+
+	INode *pinode = &g_ctx.super_blk.sb.inodes[pfd->inode];
+
 	unsigned remains = len;
 	unsigned written = 0;
 	unsigned blk_offset = pfd->offset % BLK_SIZE_REAL;
@@ -1236,29 +1875,54 @@ FileWrite (int fd, const void *buffer, int len)
 			GECtx ctx;
 			Extent ext;
 
-			if (!fs_get_extent_try (&ctx, &ext, pfd->inode, pfd->offset))
+			if (!fs_map_extent (pfd->inode, pfd->offset, &ext))
 			{
-				/* If this fails, probably no disk space left. */
-				if (!fs_get_extent_finish (&ctx, &ext))
-					break;
-				overwriting = 1;
+				if (!fs_get_extent_try (&ctx, &ext, pfd->inode, pfd->offset))
+				{
+					/* If this fails, probably no disk space left. */
+					if (!fs_get_extent_finish (&ctx, &ext))
+					{
+						fs_get_extent_done (&ctx);
+						break;
+					}
+					overwriting = 1;
+				}
+				fs_get_extent_done (&ctx);
 			}
 
 			pfd->blk_id  = ext.blk_id;
 			pfd->ext_rem = ext.len;
 		}
 
-		/* Write as much as we can to the current block. */
+		/* Write whole blocks right from the buffer if there are enough. */
+		unsigned blocks = remains / BLK_SIZE_REAL;
+		if (!blk_offset && blocks >= DC_DIRECT_MIN)
+		{
+			unsigned run = fs_direct_run (pfd, blocks);
+			if (!dcache_write_direct (pfd->blk_id, run,
+				(const char *) buffer + written))
+				break;
+
+			remains -= run * BLK_SIZE_REAL;
+			written += run * BLK_SIZE_REAL;
+			fs_direct_advance (pfd, run);
+			continue;
+		}
+
+		/* Write as much as we can to the current block.  There's no need
+		 * to read it first if it doesn't hold any data of the file yet. */
 		unsigned to_write = BLK_SIZE_REAL - blk_offset;
 		if (to_write > remains)
 			to_write = remains;
 
 		DCEntry *pentry = dcache_get_block (pfd->blk_id,
-			overwriting | (to_write == BLK_SIZE_REAL));
+			overwriting | (to_write == BLK_SIZE_REAL)
+			| (pfd->offset - blk_offset >= pinode->size));
 		assert (pentry != NULL);
 		memcpy (pentry->data + blk_offset,
 			(const char *) buffer + written, to_write);
 		pentry->dirty = 1;
+		dcache_put_block (pentry);
 
 		remains -= to_write;
 		written += to_write;
@@ -1277,26 +1941,71 @@ FileWrite (int fd, const void *buffer, int len)
 	}
 
 	/* Increase size of the file, if needed. */
-	INode *pinode = &g_ctx.super_blk.sb.inodes[pfd->inode];
 	if (pinode->size < pfd->offset)
 		pinode->size = pfd->offset;
 
+	pthread_rwlock_unlock (&g_ctx.inode_locks[pfd->inode]);
 	return written;
 }
 
+int
+FileSeek (int fd, int offset)
+{
+	if (!g_ctx.mounted || offset < 0
+	 || fd < 0 || fd >= OPEN_FILES_MAX)
+		return 0;
+
+	FD *pfd = &g_ctx.fds[fd];
+	if (!pfd->open)
+		return 0;
+
+	/* Files can't have holes, so don't let anyone seek past the end. */
+	pthread_rwlock_rdlock (&g_ctx.inode_locks[pfd->inode]);
+	if ((unsigned) offset > g_ctx.super_blk.sb.inodes[pfd->inode].size)
+	{
+		pthread_rwlock_unlock (&g_ctx.inode_locks[pfd->inode]);
+		return 0;
+	}
+
+	/* The extent gets looked up in the map on the next access.  FileRead()
+	 * stops reading ahead until it sees sequential reads again. */
+	if ((unsigned) offset != pfd->offset)
+	{
+		pfd->offset = offset;
+		pfd->blk_id = BLK_INVALID;
+		pfd->ext_rem = 0;
+	}
+	pthread_rwlock_unlock (&g_ctx.inode_locks[pfd->inode]);
+	return 1;
+}
+
 int
 FileClose (int fd)
 {
 	if (!g_ctx.mounted || fd < 0 || fd >= OPEN_FILES_MAX)
 		return -1;
 
+	pthread_mutex_lock (&g_ctx.fs_lock);
+
 	FD *pfd = &g_ctx.fds[fd];
 	if (!pfd->open)
+	{
+		pthread_mutex_unlock (&g_ctx.fs_lock);
 		return -1;
+	}
 
 	pfd->open = 0;
 	fs_unref_inode (pfd->inode);
 
+	/* Only keep the extent map while the file is open.  Nobody else
+	 * can be using it once there are no descriptors left. */
+	for (fd = 0; fd < OPEN_FILES_MAX; fd++)
+		if (g_ctx.fds[fd].open && g_ctx.fds[fd].inode == pfd->inode)
+			break;
+	if (fd == OPEN_FILES_MAX)
+		fs_map_drop (pfd->inode);
+
+	pthread_mutex_unlock (&g_ctx.fs_lock);
 	return 0;
 }
 
@@ -1306,29 +2015,39 @@ FileDelete (const char *filename)
 	if (!g_ctx.mounted || !filename)
 		return 0;
 
-	DirEntry *pentry;
-	if (!fs_find_entry (filename, &pentry))
-		return 0;
+	pthread_mutex_lock (&g_ctx.fs_lock);
 
-	fs_unref_inode (pentry->inode);
-	fs_remove_entry (pentry);
+	DirEntry *pentry;
+	int found = fs_find_entry (filename, &pentry);
+	if (found)
+	{
+		fs_unref_inode (pentry->inode);
+		fs_remove_entry (pentry);
+	}
 
-	return 1;
+	pthread_mutex_unlock (&g_ctx.fs_lock);
+	return found;
 }
 
 int
 FileFindFirst (TFile *info)
 {
-	if (!g_ctx.mounted || !g_ctx.super_blk.sb.root_dir_len || !info)
+	if (!g_ctx.mounted || !info)
 		return 0;
 
-	SuperBlk *psb = &g_ctx.super_blk.sb;
-	DirEntry *pentry = &psb->root_dir[0];
+	pthread_mutex_lock (&g_ctx.fs_lock);
 
-	strcpy (info->m_FileName, pentry->name);
-	info->m_FileSize = psb->inodes[pentry->inode].size;
+	SuperBlk *psb = &g_ctx.super_blk.sb;
+	int found = psb->root_dir_len != 0;
+	if (found)
+	{
+		DirEntry *pentry = &psb->root_dir[0];
+		strcpy (info->m_FileName, pentry->name);
+		info->m_FileSize = fs_get_size (pentry->inode);
+	}
 
-	return 1;
+	pthread_mutex_unlock (&g_ctx.fs_lock);
+	return found;
 }
 
 int
@@ -1337,18 +2056,22 @@ FileFindNext (TFile *info)
 	if (!g_ctx.mounted || !info)
 		return 0;
 
+	pthread_mutex_lock (&g_ctx.fs_lock);
+
 	DirEntry *pentry;
 	if (fs_find_entry (info->m_FileName, &pentry))
 		pentry++;
 
 	SuperBlk *psb = &g_ctx.super_blk.sb;
-	if (pentry - psb->root_dir == psb->root_dir_len)
-		return 0;
-
-	strcpy (info->m_FileName, pentry->name);
-	info->m_FileSize = psb->inodes[pentry->inode].size;
+	int found = pentry - psb->root_dir != psb->root_dir_len;
+	if (found)
+	{
+		strcpy (info->m_FileName, pentry->name);
+		info->m_FileSize = fs_get_size (pentry->inode);
+	}
 
-	return 1;
+	pthread_mutex_unlock (&g_ctx.fs_lock);
+	return found;
 }
 
 int
@@ -1357,8 +2080,13 @@ FileSize (const char *filename)
 	if (!g_ctx.mounted || !filename)
 		return -1;
 
-	INode *pi = fs_find_inode (filename, NULL);
-	return pi ? pi->size : -1;
+	pthread_mutex_lock (&g_ctx.fs_lock);
+
+	unsigned short inode;
+	int size = fs_find_inode (filename, &inode) ? fs_get_size (inode) : -1;
+
+	pthread_mutex_unlock (&g_ctx.fs_lock);
+	return size;
 }
 
 
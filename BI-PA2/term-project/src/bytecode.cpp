@@ -0,0 +1,380 @@
+/**
+ * @file bytecode.cpp
+ * Scripts compiled into bytecode.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <stdint.h>
+
+#include <config.h>
+
+#include "matrix.h"
+#include "value.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "environ.h"
+#include "evalnodes.h"
+#include "parseexpr.h"
+#include "matrixio.h"
+#include "bytecode.h"
+#include "profile.h"
+
+#include "gettext.h"
+#define _(String) gettext (String)
+
+using namespace std;
+
+
+/** Unary operations, indexed by Instruction::kind. */
+static Value (Value::*const unary_ops[]) () =
+{
+	&Value::unary_minus,
+	&Value::unary_rank,
+	&Value::unary_det,
+	&Value::unary_transpose,
+	&Value::unary_eliminate
+};
+
+/** Binary operations, indexed by Instruction::kind. */
+static Value (Value::*const binary_ops[]) (const Value &v) =
+{
+	&Value::binary_plus,
+	&Value::binary_minus,
+	&Value::binary_times,
+	&Value::binary_power
+};
+
+#define N_ELEMENTS(a) (sizeof (a) / sizeof *(a))
+
+/** Report an error on a line of the script. */
+static void
+report_error (unsigned line, const char *what)
+{
+	cout << _("Error: ") << _("line ") << line << ": " << what << endl;
+}
+
+Script::Script (Environ &environ)
+	: environ (environ), n_registers (0), cur_register (0), cur_line (0)
+{
+}
+
+unsigned
+Script::push_register ()
+{
+	if (++cur_register > n_registers)
+		n_registers = cur_register;
+	return cur_register - 1;
+}
+
+void
+Script::pop_register ()
+{
+	cur_register--;
+}
+
+unsigned
+Script::add_constant (const Value &value)
+{
+	constants.push_back (value);
+	return constants.size () - 1;
+}
+
+unsigned
+Script::add_string (const string &s)
+{
+	strings.push_back (s);
+	return strings.size () - 1;
+}
+
+void
+Script::emit (Opcode op, unsigned a, unsigned b, unsigned kind)
+{
+	Instruction insn;
+	insn.op = op;
+	insn.kind = kind;
+	insn.a = a;
+	insn.b = b;
+
+	code.push_back (insn);
+	lines.push_back (cur_line);
+}
+
+void
+Script::emit_unary (Value (Value::*delegate) (), unsigned a)
+{
+	for (unsigned i = 0; i < N_ELEMENTS (unary_ops); i++)
+		if (unary_ops[i] == delegate)
+		{
+			emit (OP_UNARY, a, 0, i);
+			return;
+		}
+	throw logic_error ("unknown unary operation");
+}
+
+/** Find the index of a binary operation in binary_ops. */
+static unsigned
+find_binary (Value (Value::*delegate) (const Value &v))
+{
+	for (unsigned i = 0; i < N_ELEMENTS (binary_ops); i++)
+		if (binary_ops[i] == delegate)
+			return i;
+	throw logic_error ("unknown binary operation");
+}
+
+void
+Script::emit_binary (Value (Value::*delegate) (const Value &v),
+	unsigned a, unsigned b)
+{
+	emit (OP_BINARY, a, b, find_binary (delegate));
+}
+
+void
+Script::emit_update (Value (Value::*delegate) (const Value &v),
+	unsigned a, unsigned slot, bool second)
+{
+	emit (second ? OP_UPDATE_SECOND : OP_UPDATE,
+		a, slot, find_binary (delegate));
+}
+
+bool
+Script::compile_command (Parser &parser, const string &line)
+{
+	if (parser.accept (INPUT))
+		throw runtime_error (_("Matrices cannot be entered in scripts"));
+	else if (parser.accept (DELETE))
+	{
+		if (parser.accept (TIMES))
+		{
+			parser.expect (END);
+			emit (OP_UNSET_ALL, 0);
+		}
+		else
+		{
+			parser.expect (IDENT);
+			string var = parser.last ().s;
+			parser.expect (END);
+			emit (OP_UNSET, environ.intern (var));
+		}
+	}
+	else if (parser.accept (LOAD) || parser.accept (SAVE))
+	{
+		Opcode op = parser.last ().type == LOAD ? OP_LOAD_FILE : OP_SAVE_FILE;
+		parser.expect (IDENT);
+		string var = parser.last ().s;
+		parser.expect (STRING);
+		string filename = parser.last ().s;
+		parser.expect (END);
+		emit (op, environ.intern (var), add_string (filename));
+	}
+	else if (parser.accept (TYPEOF))
+	{
+		parser.expect (IDENT);
+		string var = parser.last ().s;
+		parser.expect (END);
+		emit (OP_TYPEOF, environ.intern (var));
+	}
+	else if (parser.accept (SET))
+	{
+		/* Only check the syntax, the host program knows the options. */
+		parser.expect (IDENT);
+		while (parser.accept (INTEGER) || parser.accept (REAL)
+			|| parser.accept (IDENT))
+			;
+		parser.expect (END);
+		emit (OP_COMMAND, add_string (line));
+	}
+	else if (parser.accept (SOLVE))
+	{
+		/* The host solves systems with its own settings. */
+		parser.expect (IDENT);
+		parser.expect (IDENT);
+		parser.accept (IDENT);
+		parser.expect (END);
+		emit (OP_COMMAND, add_string (line));
+	}
+	else if (parser.accept (PROFILE))
+	{
+		parser.expect (IDENT);
+		parser.accept (STRING);
+		parser.expect (END);
+		emit (OP_COMMAND, add_string (line));
+	}
+	else if (parser.accept (EXIT) || parser.accept (HELP))
+	{
+		parser.expect (END);
+		emit (OP_COMMAND, add_string (line));
+	}
+	else
+		return false;
+
+	return true;
+}
+
+void
+Script::compile_line (const string &line)
+{
+	istringstream is (line);
+	Tokenizer scanner (is);
+	Parser parser (scanner);
+
+	/* Ignore empty lines. */
+	if (parser.accept (END))
+		return;
+
+	if (compile_command (parser, line))
+		return;
+
+	bool assigning = false;
+	string ident;
+
+	if (parser.accept (IDENT))
+	{
+		ident = parser.last ().s;
+		if (parser.accept (EQUALS))
+			assigning = true;
+		else
+			parser.go_back ();
+	}
+
+	EvalNode *tree = parse_expression (parser, environ);
+	cur_register = 0;
+	try
+	{
+		if (assigning)
+			tree->compile_assign (*this, environ.intern (ident));
+		else
+			emit (OP_PRINT, tree->compile (*this));
+	}
+	catch (...)
+	{
+		delete tree;
+		throw;
+	}
+	delete tree;
+}
+
+bool
+Script::compile (istream &is)
+{
+	bool ok = true;
+	string line;
+
+	for (cur_line = 1; getline (is, line); cur_line++)
+	{
+		sources.push_back (line);
+		try
+		{
+			compile_line (line);
+		}
+		catch (const exception &e)
+		{
+			report_error (cur_line, e.what ());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+bool
+Script::run (CommandHandler handler) const
+{
+	vector<PartialValue> regs (n_registers);
+
+	unsigned pc = 0;
+	try
+	{
+		while (pc < code.size ())
+		{
+			unsigned line = lines[pc];
+			ProfileScope statement (sources[line - 1].c_str (),
+				PROFILE_STATEMENT);
+
+			for (; pc < code.size () && lines[pc] == line; pc++)
+			{
+				const Instruction &insn = code[pc];
+				switch (insn.op)
+				{
+				case OP_CONST:
+					regs[insn.a].set (constants[insn.b]);
+					break;
+				case OP_LOAD:
+					regs[insn.a].set (environ.get (insn.b));
+					break;
+				case OP_STORE:
+					environ.set (insn.b, regs[insn.a].get ());
+					regs[insn.a].set (Value ());
+					break;
+				case OP_PRINT:
+					cout << regs[insn.a].get () << endl;
+					regs[insn.a].set (Value ());
+					break;
+				case OP_UNARY:
+				{
+					ProfileScope scope (operation_name (unary_ops[insn.kind]),
+						PROFILE_OPERATION);
+					regs[insn.a].apply (unary_ops[insn.kind]);
+					break;
+				}
+				case OP_BINARY:
+				{
+					ProfileScope scope (operation_name (binary_ops[insn.kind]),
+						PROFILE_OPERATION);
+					regs[insn.a].apply (binary_ops[insn.kind], regs[insn.b]);
+					regs[insn.b].set (Value ());
+					break;
+				}
+				case OP_CHECK:
+					environ.get (insn.a);
+					break;
+				case OP_UPDATE:
+				case OP_UPDATE_SECOND:
+					update_value (environ.modify (insn.b), binary_ops[insn.kind],
+						regs[insn.a], insn.op == OP_UPDATE_SECOND);
+					regs[insn.a].set (Value ());
+					break;
+				case OP_LOAD_FILE:
+				{
+					Value value;
+					if (!load_value (value, strings[insn.b]))
+						throw runtime_error (_("Loading failed"));
+					environ.set (insn.a, value);
+					break;
+				}
+				case OP_SAVE_FILE:
+					if (!save_value (environ.get (insn.a), strings[insn.b]))
+						throw runtime_error (_("Saving failed"));
+					break;
+				case OP_UNSET:
+					environ.unset (insn.a);
+					break;
+				case OP_UNSET_ALL:
+					environ.clear ();
+					break;
+				case OP_TYPEOF:
+					cout << environ.get (insn.a).describe_type () << endl;
+					break;
+				case OP_COMMAND:
+					/* The host has already reported the error. */
+					if (!handler (strings[insn.a]))
+						return false;
+					break;
+				}
+			}
+		}
+	}
+	catch (const exception &e)
+	{
+		report_error (lines[pc], e.what ());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file bytecode.h
+ * Scripts compiled into bytecode.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __BYTECODE_H__
+#define __BYTECODE_H__
+
+/** Instructions of the bytecode.  Registers hold PartialValue objects,
+ *  so that element-wise matrix operations stay fused. */
+enum Opcode
+{
+	OP_CONST,       //!< Set register @a a to constant @a b.
+	OP_LOAD,        //!< Set register @a a to the variable in slot @a b.
+	OP_STORE,       //!< Move register @a a into the variable in slot @a b.
+	OP_PRINT,       //!< Print out register @a a and clear it.
+	OP_UNARY,       //!< Apply unary operation @a kind to register @a a.
+	OP_BINARY,      //!< Apply binary operation @a kind to registers
+	                //!< @a a and @a b, leaving the result in @a a.
+	OP_CHECK,       //!< Make sure the variable in slot @a a is defined.
+	OP_UPDATE,      //!< Apply binary operation @a kind to the variable
+	                //!< in slot @a b and register @a a, in place.
+	OP_UPDATE_SECOND, //!< The same with the variable as the second operand.
+	OP_LOAD_FILE,   //!< Load slot @a a from the file in string @a b.
+	OP_SAVE_FILE,   //!< Save slot @a a into the file in string @a b.
+	OP_UNSET,       //!< Unset the variable in slot @a a.
+	OP_UNSET_ALL,   //!< Unset all variables.
+	OP_TYPEOF,      //!< Print out the type of the variable in slot @a a.
+	OP_COMMAND      //!< Pass the command in string @a a to the host.
+};
+
+/** A single instruction. */
+struct Instruction
+{
+	unsigned char op;      //!< The Opcode.
+	unsigned char kind;    //!< The operation of OP_UNARY and OP_BINARY.
+	unsigned a;            //!< First operand.
+	unsigned b;            //!< Second operand.
+};
+
+/** A script compiled for a simple register machine.  Variables are
+ *  resolved to slots of an Environ at compile time, so that running the
+ *  script doesn't involve any lookups by name.  Each line of the script
+ *  is a statement as it would be entered in the interactive mode. */
+class Script
+{
+public:
+	/** Runs a command that the script leaves to the host program,
+	 *  such as `set'.  Returns false on error, which stops the script. */
+	typedef bool (*CommandHandler) (const std::string &command);
+
+private:
+	std::vector<Instruction> code;        //!< The instructions.
+	std::vector<unsigned> lines;          //!< Source lines of instructions.
+	std::vector<Value> constants;         //!< Constant values.
+	std::vector<std::string> strings;     //!< File names and commands.
+	std::vector<std::string> sources;     //!< Source lines, for profiles.
+	Environ &environ;                     //!< Variables of the script.
+
+	unsigned n_registers;                 //!< Number of registers needed.
+	unsigned cur_register;                //!< Registers used in a statement.
+	unsigned cur_line;                    //!< The line being compiled.
+
+	/** Add a string, returning its index. */
+	unsigned add_string (const std::string &s);
+	/** Compile a command found on @a line, or return false
+	 *  if the line doesn't contain one. */
+	bool compile_command (Parser &parser, const std::string &line);
+	/** Compile a single line of the script. */
+	void compile_line (const std::string &line);
+public:
+	/** Initialize a script working with variables in @a environ. */
+	Script (Environ &environ);
+
+	/** Compile a script.  Errors are reported on standard output
+	 *  together with their line numbers.  Returns false on failure. */
+	bool compile (std::istream &is);
+	/** Run the compiled script.  Stops at the first error, reporting it
+	 *  on standard output.  Returns false on failure. */
+	bool run (CommandHandler handler) const;
+
+	/* Used by EvalNode::compile() implementations. */
+
+	/** Reserve a register on top of those already used by the statement. */
+	unsigned push_register ();
+	/** Release the topmost register of the statement. */
+	void pop_register ();
+	/** Add a constant, returning its index. */
+	unsigned add_constant (const Value &value);
+	/** Append an instruction. */
+	void emit (Opcode op, unsigned a, unsigned b = 0, unsigned kind = 0);
+	/** Append an instruction applying a unary operation to register @a a. */
+	void emit_unary (Value (Value::*delegate) (), unsigned a);
+	/** Append an instruction applying a binary operation
+	 *  to registers @a a and @a b. */
+	void emit_binary (Value (Value::*delegate) (const Value &v),
+		unsigned a, unsigned b);
+	/** Append an instruction updating the variable in @a slot by
+	 *  a binary operation with register @a a, see update_value(). */
+	void emit_update (Value (Value::*delegate) (const Value &v),
+		unsigned a, unsigned slot, bool second);
+};
+
+#endif /* ! __BYTECODE_H__ */
@@ -9,6 +9,7 @@
 #include <iostream>
 #include <exception>
 #include <map>
+#include <vector>
 
 #include <config.h>
 
@@ -22,33 +23,81 @@
 using namespace std;
 
 
-EUndefinedVariable::EUndefinedVariable (const std::string &name)
+EUndefinedVariable::EUndefinedVariable (const string &name)
 {
 	message = _("Undefined variable: ") + name;
 }
 
-Value &
-Environ::get (const std::string &name) throw (EUndefinedVariable)
+unsigned
+Environ::intern (const string &name)
+{
+	map<string, unsigned>::iterator iter = slots.find (name);
+	if (iter != slots.end ())
+		return iter->second;
+
+	names.push_back (name);
+	values.push_back (Value ());
+	defined.push_back (false);
+	return slots[name] = names.size () - 1;
+}
+
+const Value &
+Environ::get (unsigned slot) const throw (EUndefinedVariable)
 {
-	if (!vars.count (name))
+	if (!defined[slot])
+		throw EUndefinedVariable (names[slot]);
+	return values[slot];
+}
+
+const Value &
+Environ::get (const string &name) const throw (EUndefinedVariable)
+{
+	map<string, unsigned>::const_iterator iter = slots.find (name);
+	if (iter == slots.end ())
 		throw EUndefinedVariable (name);
-	return vars[name];
+	return get (iter->second);
+}
+
+Value &
+Environ::modify (unsigned slot) throw (EUndefinedVariable)
+{
+	if (!defined[slot])
+		throw EUndefinedVariable (names[slot]);
+	return values[slot];
+}
+
+void
+Environ::set (unsigned slot, const Value &value)
+{
+	values[slot] = value;
+	defined[slot] = true;
 }
 
 void
 Environ::set (const string &name, const Value &value)
 {
-	vars[name] = value;
+	set (intern (name), value);
+}
+
+void
+Environ::unset (unsigned slot)
+{
+	/* The slot itself stays, parsed expressions may still refer to it. */
+	values[slot] = Value ();
+	defined[slot] = false;
 }
 
 void
 Environ::unset (const string &name)
 {
-	vars.erase (name);
+	map<string, unsigned>::iterator iter = slots.find (name);
+	if (iter != slots.end ())
+		unset (iter->second);
 }
 
 void
 Environ::clear ()
 {
-	vars.clear ();
+	values.assign (values.size (), Value ());
+	defined.assign (defined.size (), false);
 }
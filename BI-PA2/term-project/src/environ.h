@@ -21,17 +21,35 @@ public:
 	virtual const char *what () const throw () {return message.c_str ();}
 };
 
-/** Maps Value objects to variable names. */
+/** Maps Value objects to variable names.  Names are interned into slots
+ *  while expressions are being parsed, so that evaluation only has to index
+ *  a flat array of values. */
 class Environ
 {
 protected:
-	/** Internal map of all the variables. */
-	std::map<std::string, Value> vars;
+	std::map<std::string, unsigned> slots;  //!< Slots of variables by name.
+	std::vector<std::string> names;         //!< Names of variables in slots.
+	std::vector<Value> values;              //!< Values in slots.
+	std::vector<bool> defined;              //!< Whether a slot holds a value.
 public:
+	/** Return the slot of a variable, assigning a new one if needed. */
+	unsigned intern (const std::string &name);
+	/** Return the name of the variable in a slot. */
+	const std::string &get_name (unsigned slot) const {return names[slot];}
+
+	/** Retrieve the value in the slot. */
+	const Value &get (unsigned slot) const throw (EUndefinedVariable);
 	/** Retrieve the value assigned to the name. */
-	Value &get (const std::string &name) throw (EUndefinedVariable);
+	const Value &get (const std::string &name) const
+		throw (EUndefinedVariable);
+	/** Retrieve the value in the slot for changing it in place. */
+	Value &modify (unsigned slot) throw (EUndefinedVariable);
+	/** Assign a value to the slot. */
+	void set (unsigned slot, const Value &value);
 	/** Assign a value to the name. */
 	void set (const std::string &name, const Value &value);
+	/** Unset any value in the slot. */
+	void unset (unsigned slot);
 	/** Unset any value assigned to the name. */
 	void unset (const std::string &name);
 	/** Unset all of the variables. */
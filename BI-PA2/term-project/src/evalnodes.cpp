@@ -9,16 +9,225 @@
 #include <iostream>
 #include <exception>
 #include <map>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <stdint.h>
 
 #include <config.h>
 
 #include "matrix.h"
 #include "value.h"
 #include "environ.h"
+#include "tokenizer.h"
+#include "parser.h"
 #include "evalnodes.h"
+#include "bytecode.h"
+#include "profile.h"
 
 using namespace std;
 
+
+bool EvalNode::fused = true;
+
+const char *
+operation_name (Value (Value::*delegate) ())
+{
+	if (delegate == &Value::unary_minus)     return "negate";
+	if (delegate == &Value::unary_rank)      return "rank";
+	if (delegate == &Value::unary_det)       return "det";
+	if (delegate == &Value::unary_transpose) return "transpose";
+	if (delegate == &Value::unary_eliminate) return "eliminate";
+	return "?";
+}
+
+const char *
+operation_name (Value (Value::*delegate) (const Value &v))
+{
+	if (delegate == &Value::binary_plus)     return "+";
+	if (delegate == &Value::binary_minus)    return "-";
+	if (delegate == &Value::binary_times)    return "*";
+	if (delegate == &Value::binary_power)    return "^";
+	return "?";
+}
+
+/** Get the name of an in-place update, as shown in profiles. */
+static const char *
+update_name (Value (Value::*delegate) (const Value &v))
+{
+	if (delegate == &Value::binary_plus)     return "+=";
+	if (delegate == &Value::binary_minus)    return "-=";
+	if (delegate == &Value::binary_times)    return "*=";
+	return operation_name (delegate);
+}
+
+void
+PartialValue::set (const Value &v)
+{
+	if (v.type != Value::MATRIX)
+	{
+		value = v;
+		terms.clear ();
+		return;
+	}
+
+	const MatrixStorage &ms = v.matrix->get_storage ();
+	rows = ms.get_rows ();
+	cols = ms.get_cols ();
+	terms.assign (1, MatrixTerm (*v.matrix));
+	value = Value ();
+}
+
+Value
+PartialValue::get () const
+{
+	if (!is_deferred ())
+		return value;
+
+	ProfileScope scope ("combine", PROFILE_OPERATION);
+	Value v;
+	v.type = Value::MATRIX;
+
+	/* A lone matrix doesn't need to be copied at all. */
+	const MatrixTerm &term = terms[0];
+	if (terms.size () == 1 && term.factor == 1)
+		v.matrix = new Matrix (term.transposed
+			? term.matrix.transpose () : term.matrix);
+	else
+		v.matrix = new Matrix (matrix_combine (terms));
+	return v;
+}
+
+/** Get the scalar value of @a pv, if it has one. */
+static bool
+get_scalar (const PartialValue &pv, double &scalar)
+{
+	if (pv.is_deferred ())
+		return false;
+
+	switch (pv.value.type)
+	{
+	case Value::INTEGER:
+		scalar = pv.value.integer;
+		return true;
+	case Value::REAL:
+		scalar = pv.value.real;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/** Multiply all terms of a deferred matrix by @a factor. */
+static void
+scale_terms (PartialValue &pv, double factor)
+{
+	for (unsigned i = 0; i < pv.terms.size (); i++)
+		pv.terms[i].factor *= factor;
+}
+
+void
+PartialValue::apply (Value (Value::*delegate) ())
+{
+	if (!EvalNode::fused || !is_deferred ())
+		set ((get ().*delegate) ());
+	else if (delegate == &Value::unary_minus)
+		scale_terms (*this, -1);
+	else if (delegate == &Value::unary_transpose)
+	{
+		for (unsigned i = 0; i < terms.size (); i++)
+			terms[i].transposed = !terms[i].transposed;
+		swap (rows, cols);
+	}
+	else
+		set ((get ().*delegate) ());
+}
+
+void
+PartialValue::apply (Value (Value::*delegate) (const Value &v),
+	PartialValue &pv)
+{
+	bool additive = delegate == &Value::binary_plus
+		|| delegate == &Value::binary_minus;
+	bool times = delegate == &Value::binary_times;
+
+	double scalar;
+	if (!EvalNode::fused)
+		set ((get ().*delegate) (pv.get ()));
+	else if (additive && is_deferred () && pv.is_deferred ()
+	 && rows == pv.rows && cols == pv.cols)
+	{
+		if (delegate == &Value::binary_minus)
+			scale_terms (pv, -1);
+		terms.insert (terms.end (), pv.terms.begin (), pv.terms.end ());
+	}
+	else if (times && is_deferred () && get_scalar (pv, scalar))
+		scale_terms (*this, scalar);
+	else if (times && pv.is_deferred () && get_scalar (*this, scalar))
+	{
+		scale_terms (pv, scalar);
+		swap (terms, pv.terms);
+		rows = pv.rows;
+		cols = pv.cols;
+	}
+	else
+		/* Matrix products, scalar arithmetics, and errors. */
+		set ((get ().*delegate) (pv.get ()));
+}
+
+void
+update_value (Value &target, Value (Value::*delegate) (const Value &v),
+	PartialValue &pv, bool second)
+{
+	bool additive = delegate == &Value::binary_plus
+		|| delegate == &Value::binary_minus;
+	bool times = delegate == &Value::binary_times;
+	ProfileScope scope (update_name (delegate), PROFILE_OPERATION);
+
+	Matrix *m = target.type == Value::MATRIX ? target.matrix : NULL;
+	bool fits = m && pv.is_deferred ()
+		&& m->get_storage ().get_rows () == pv.rows
+		&& m->get_storage ().get_cols () == pv.cols;
+
+	double scalar;
+	if (additive && fits && !second)
+	{
+		if (delegate == &Value::binary_minus)
+			scale_terms (pv, -1);
+		*m = m->accumulate (pv.terms).adapt ();
+	}
+	else if (times && m && get_scalar (pv, scalar))
+	{
+		/* Only zeros can make another kind of storage fit better. */
+		*m *= scalar;
+		if (!scalar)
+			*m = m->adapt ();
+	}
+	else if (second)
+		/* Matrix products, scalar arithmetics, and errors. */
+		target = (pv.get ().*delegate) (target);
+	else
+		target = (target.*delegate) (pv.get ());
+}
+
+void
+EvalNode::evaluate_partial (Environ &e, PartialValue &pv) const
+{
+	pv.set (evaluate (e));
+}
+
+void
+EvalNode::assign (Environ &e, unsigned slot) const
+{
+	e.set (slot, evaluate (e));
+}
+
+void
+EvalNode::compile_assign (Script &s, unsigned slot) const
+{
+	s.emit (OP_STORE, compile (s), slot);
+}
+
 Value
 IntegerNode::evaluate (Environ &e) const
 {
@@ -28,6 +237,18 @@ IntegerNode::evaluate (Environ &e) const
 	return v;
 }
 
+unsigned
+IntegerNode::compile (Script &s) const
+{
+	Value v;
+	v.type = Value::INTEGER;
+	v.integer = value;
+
+	unsigned r = s.push_register ();
+	s.emit (OP_CONST, r, s.add_constant (v));
+	return r;
+}
+
 Value
 RealNode::evaluate (Environ &e) const
 {
@@ -37,10 +258,37 @@ RealNode::evaluate (Environ &e) const
 	return v;
 }
 
+unsigned
+RealNode::compile (Script &s) const
+{
+	Value v;
+	v.type = Value::REAL;
+	v.real = value;
+
+	unsigned r = s.push_register ();
+	s.emit (OP_CONST, r, s.add_constant (v));
+	return r;
+}
+
 Value
 VarNode::evaluate (Environ &e) const
 {
-	return e.get (name);
+	return e.get (slot);
+}
+
+void
+VarNode::evaluate_partial (Environ &e, PartialValue &pv) const
+{
+	/* Only share the matrix, without copying the Value first. */
+	pv.set (e.get (slot));
+}
+
+unsigned
+VarNode::compile (Script &s) const
+{
+	unsigned r = s.push_register ();
+	s.emit (OP_LOAD, r, slot);
+	return r;
 }
 
 UnaryNode::~UnaryNode ()
@@ -51,7 +299,38 @@ UnaryNode::~UnaryNode ()
 Value
 UnaryNode::evaluate (Environ &e) const
 {
-	return (op->evaluate (e).*delegate) ();
+	if (!fused)
+	{
+		ProfileScope scope (operation_name (delegate), PROFILE_OPERATION);
+		return (op->evaluate (e).*delegate) ();
+	}
+
+	PartialValue pv;
+	evaluate_partial (e, pv);
+	return pv.get ();
+}
+
+void
+UnaryNode::evaluate_partial (Environ &e, PartialValue &pv) const
+{
+	ProfileScope scope (operation_name (delegate), PROFILE_OPERATION);
+	if (!fused || (delegate != &Value::unary_minus
+		&& delegate != &Value::unary_transpose))
+	{
+		pv.set ((op->evaluate (e).*delegate) ());
+		return;
+	}
+
+	op->evaluate_partial (e, pv);
+	pv.apply (delegate);
+}
+
+unsigned
+UnaryNode::compile (Script &s) const
+{
+	unsigned r = op->compile (s);
+	s.emit_unary (delegate, r);
+	return r;
 }
 
 BinaryNode::~BinaryNode ()
@@ -63,5 +342,109 @@ BinaryNode::~BinaryNode ()
 Value
 BinaryNode::evaluate (Environ &e) const
 {
-	return (op1->evaluate (e).*delegate) (op2->evaluate (e));
+	if (!fused)
+	{
+		ProfileScope scope (operation_name (delegate), PROFILE_OPERATION);
+		return (op1->evaluate (e).*delegate) (op2->evaluate (e));
+	}
+
+	PartialValue pv;
+	evaluate_partial (e, pv);
+	return pv.get ();
+}
+
+void
+BinaryNode::evaluate_partial (Environ &e, PartialValue &pv) const
+{
+	ProfileScope scope (operation_name (delegate), PROFILE_OPERATION);
+	if (!fused || (delegate != &Value::binary_plus
+		&& delegate != &Value::binary_minus
+		&& delegate != &Value::binary_times))
+	{
+		pv.set ((op1->evaluate (e).*delegate) (op2->evaluate (e)));
+		return;
+	}
+
+	PartialValue pv2;
+	op1->evaluate_partial (e, pv);
+	op2->evaluate_partial (e, pv2);
+	pv.apply (delegate, pv2);
+}
+
+unsigned
+BinaryNode::compile (Script &s) const
+{
+	unsigned r = op1->compile (s);
+	unsigned r2 = op2->compile (s);
+	s.emit_binary (delegate, r, r2);
+	s.pop_register ();
+	return r;
+}
+
+bool
+BinaryNode::is_update (unsigned slot,
+	const EvalNode *&other, bool &second) const
+{
+	const VarNode *var1 = dynamic_cast<const VarNode *> (op1);
+	const VarNode *var2 = dynamic_cast<const VarNode *> (op2);
+
+	if (delegate != &Value::binary_plus
+	 && delegate != &Value::binary_minus
+	 && delegate != &Value::binary_times)
+		return false;
+
+	if (var1 && var1->get_slot () == slot)
+	{
+		other = op2;
+		second = false;
+		return true;
+	}
+
+	/* Only multiples of matrices may be computed with the operands
+	 * swapped, and that's left for update_value() to find out. */
+	if (var2 && var2->get_slot () == slot
+	 && delegate == &Value::binary_times)
+	{
+		other = op1;
+		second = true;
+		return true;
+	}
+	return false;
+}
+
+void
+BinaryNode::assign (Environ &e, unsigned slot) const
+{
+	const EvalNode *other;
+	bool second;
+	if (!is_update (slot, other, second))
+	{
+		EvalNode::assign (e, slot);
+		return;
+	}
+
+	/* Fail on an undefined variable before evaluating the other operand,
+	 * just like a regular evaluation would. */
+	if (!second)
+		e.get (slot);
+
+	PartialValue pv;
+	other->evaluate_partial (e, pv);
+	update_value (e.modify (slot), delegate, pv, second);
+}
+
+void
+BinaryNode::compile_assign (Script &s, unsigned slot) const
+{
+	const EvalNode *other;
+	bool second;
+	if (!is_update (slot, other, second))
+	{
+		EvalNode::compile_assign (s, slot);
+		return;
+	}
+
+	if (!second)
+		s.emit (OP_CHECK, slot);
+	s.emit_update (delegate, other->compile (s), slot, second);
 }
@@ -9,13 +9,69 @@
 #ifndef __EVALNODES_H__
 #define __EVALNODES_H__
 
+class Script;
+
+/** Result of fused evaluation.  Matrices coming out of additions,
+ *  subtractions, multiplications by scalars, negations and transpositions
+ *  are kept as linear combinations of their operands, so that a whole chain
+ *  of these operations may be computed in a single pass. */
+struct PartialValue
+{
+	Value value;                     //!< The value, unless it's deferred.
+	std::vector<MatrixTerm> terms;   //!< Terms of a deferred matrix.
+	unsigned rows;                   //!< Number of rows of a deferred matrix.
+	unsigned cols;                   //!< Number of columns of a deferred matrix.
+
+	/** Return whether the computation of a matrix has been deferred. */
+	bool is_deferred () const {return !terms.empty ();}
+
+	/** Set the value, deferring anything done with matrices from now on. */
+	void set (const Value &v);
+	/** Get the value, computing a deferred matrix. */
+	Value get () const;
+
+	/** Apply a unary operation, deferring it if possible. */
+	void apply (Value (Value::*delegate) ());
+	/** Apply a binary operation with @a pv as the second operand,
+	 *  deferring it if possible.  @a pv may be changed in the process. */
+	void apply (Value (Value::*delegate) (const Value &v), PartialValue &pv);
+};
+
+/** Get the name of a unary operation, as shown in profiles. */
+const char *operation_name (Value (Value::*delegate) ());
+/** Get the name of a binary operation, as shown in profiles. */
+const char *operation_name (Value (Value::*delegate) (const Value &v));
+
+/** Replace @a target by the result of a binary operation with @a pv as
+ *  the other operand, which is the first one if @a second is set.  Sums
+ *  of matrices and multiples of matrices by scalars are computed in place,
+ *  so that updates of variables don't have to allocate new matrices. */
+void update_value (Value &target, Value (Value::*delegate) (const Value &v),
+	PartialValue &pv, bool second = false);
+
 /** Base class for all nodes in an evaluation tree. */
 class EvalNode
 {
 public:
 	virtual ~EvalNode () {}
+
+	/** A flag toggling fused evaluation of element-wise matrix operations. */
+	static bool fused;
+
 	/** Evaluate the subtree rooted at this node. */
 	virtual Value evaluate (Environ &e) const = 0;
+	/** Evaluate the subtree, deferring element-wise matrix operations. */
+	virtual void evaluate_partial (Environ &e, PartialValue &pv) const;
+	/** Compile the subtree into a script, returning the register
+	 *  that will hold the result. */
+	virtual unsigned compile (Script &s) const = 0;
+
+	/** Evaluate the subtree, assigning the result to the variable
+	 *  in @a slot. */
+	virtual void assign (Environ &e, unsigned slot) const;
+	/** Compile the subtree followed by an assignment to the variable
+	 *  in @a slot. */
+	virtual void compile_assign (Script &s, unsigned slot) const;
 };
 
 /** Wrapper class for integer values. */
@@ -26,6 +82,7 @@ public:
 	/** Initialize the node with the given integer. */
 	IntegerNode (long i) : value (i) {}
 	virtual Value evaluate (Environ &e) const;
+	virtual unsigned compile (Script &s) const;
 };
 
 /** Wrapper class for real number values. */
@@ -36,16 +93,21 @@ public:
 	/** Initialize the node with the given real number. */
 	RealNode (double n) : value (n) {}
 	virtual Value evaluate (Environ &e) const;
+	virtual unsigned compile (Script &s) const;
 };
 
 /** Wrapper class for references to variables. */
 class VarNode : public EvalNode
 {
-	std::string name;
+	unsigned slot;            //!< Slot of the variable in the Environ.
 public:
-	/** Initialize the node with the given variable name. */
-	VarNode (std::string s) : name (s) {}
+	/** Initialize the node with the given variable slot. */
+	VarNode (unsigned slot) : slot (slot) {}
+	/** Return the slot of the variable. */
+	unsigned get_slot () const {return slot;}
 	virtual Value evaluate (Environ &e) const;
+	virtual void evaluate_partial (Environ &e, PartialValue &pv) const;
+	virtual unsigned compile (Script &s) const;
 };
 
 /** Unary operation. */
@@ -63,6 +125,8 @@ public:
 		: delegate (delegate), op (op) {}
 	virtual ~UnaryNode ();
 	virtual Value evaluate (Environ &e) const;
+	virtual void evaluate_partial (Environ &e, PartialValue &pv) const;
+	virtual unsigned compile (Script &s) const;
 };
 
 /** Binary operation. */
@@ -75,12 +139,22 @@ protected:
 	BinaryEvaluate delegate;  //!< Delegate that performs the operation.
 	EvalNode *op1;            //!< First operand.
 	EvalNode *op2;            //!< Second operand.
+
+	/** Decide whether assigning the result to the variable in @a slot
+	 *  only updates it with the @a other operand.  @a second tells
+	 *  whether the variable is the second operand. */
+	bool is_update (unsigned slot,
+		const EvalNode *&other, bool &second) const;
 public:
 	/** Initialize the node with the given delegate and its operands. */
 	BinaryNode (BinaryEvaluate delegate, EvalNode *op1, EvalNode *op2)
 		: delegate (delegate), op1 (op1), op2 (op2) {}
 	virtual ~BinaryNode ();
 	virtual Value evaluate (Environ &e) const;
+	virtual void evaluate_partial (Environ &e, PartialValue &pv) const;
+	virtual unsigned compile (Script &s) const;
+	virtual void assign (Environ &e, unsigned slot) const;
+	virtual void compile_assign (Script &s, unsigned slot) const;
 };
 
 #endif /* ! __EVALNODES_H__ */
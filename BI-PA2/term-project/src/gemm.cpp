@@ -0,0 +1,327 @@
+/**
+ * @file gemm.cpp
+ * Dense matrix multiplication kernels.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ * The algorithm follows the usual GotoBLAS layering: the right operand is
+ * packed in panels that fit in the last level cache, the left one in blocks
+ * that fit in L2, and a small register-blocked micro-kernel does the actual
+ * multiply-adds over contiguous packed data.
+ *
+ */
+
+#include <cstring>
+
+#include <config.h>
+
+#include "threadpool.h"
+#include "gemm.h"
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+	#define GEMM_HAVE_AVX2
+	#include <immintrin.h>
+#endif /* __GNUC__ && x86 */
+
+
+#define GEMM_MR   6     //!< Rows of C computed by the micro-kernel.
+#define GEMM_NR   8     //!< Columns of C computed by the micro-kernel.
+
+#define GEMM_KC   256   //!< Depth of packed panels.
+#define GEMM_MC   96    //!< Rows of a packed block of A; multiple of MR.
+#define GEMM_NC   2048  //!< Columns of a packed panel of B; multiple of NR.
+
+/** Products with less multiply-adds than this are not worth splitting. */
+#define GEMM_PARALLEL_MIN  (1 << 21)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/** Computes C += A * B for a GEMM_MR by GEMM_NR block of C.
+ *  @a a and @a b point to packed slivers of depth @a kc. */
+typedef void (*MicroKernel) (unsigned kc,
+	const double *a, const double *b, double *c, unsigned ldc);
+
+/** Portable micro-kernel, left for the compiler to vectorize. */
+static void
+micro_kernel_generic (unsigned kc,
+	const double *a, const double *b, double *c, unsigned ldc)
+{
+	double ab[GEMM_MR * GEMM_NR];
+	memset (ab, 0, sizeof ab);
+
+	for (unsigned p = 0; p < kc; p++)
+	{
+		for (unsigned i = 0; i < GEMM_MR; i++)
+		{
+			double ai = a[i];
+			for (unsigned j = 0; j < GEMM_NR; j++)
+				ab[i * GEMM_NR + j] += ai * b[j];
+		}
+
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	for (unsigned i = 0; i < GEMM_MR; i++)
+		for (unsigned j = 0; j < GEMM_NR; j++)
+			c[i * ldc + j] += ab[i * GEMM_NR + j];
+}
+
+#ifdef GEMM_HAVE_AVX2
+
+/** Multiply-add one row of the 6x8 block. */
+#define AVX2_ROW(i) \
+	ai = _mm256_broadcast_sd (a + i); \
+	c##i##0 = _mm256_fmadd_pd (ai, b0, c##i##0); \
+	c##i##1 = _mm256_fmadd_pd (ai, b1, c##i##1);
+
+/** Add one row of the 6x8 block to C. */
+#define AVX2_STORE(i) \
+	_mm256_storeu_pd (c + i * (size_t) ldc, _mm256_add_pd \
+		(_mm256_loadu_pd (c + i * (size_t) ldc), c##i##0)); \
+	_mm256_storeu_pd (c + i * (size_t) ldc + 4, _mm256_add_pd \
+		(_mm256_loadu_pd (c + i * (size_t) ldc + 4), c##i##1));
+
+/** AVX2 and FMA micro-kernel, keeping the whole block of C in registers. */
+__attribute__ ((target ("avx2,fma"))) static void
+micro_kernel_avx2 (unsigned kc,
+	const double *a, const double *b, double *c, unsigned ldc)
+{
+	__m256d c00 = _mm256_setzero_pd (), c01 = _mm256_setzero_pd ();
+	__m256d c10 = _mm256_setzero_pd (), c11 = _mm256_setzero_pd ();
+	__m256d c20 = _mm256_setzero_pd (), c21 = _mm256_setzero_pd ();
+	__m256d c30 = _mm256_setzero_pd (), c31 = _mm256_setzero_pd ();
+	__m256d c40 = _mm256_setzero_pd (), c41 = _mm256_setzero_pd ();
+	__m256d c50 = _mm256_setzero_pd (), c51 = _mm256_setzero_pd ();
+	__m256d ai, b0, b1;
+
+	for (unsigned p = 0; p < kc; p++)
+	{
+		b0 = _mm256_loadu_pd (b);
+		b1 = _mm256_loadu_pd (b + 4);
+
+		AVX2_ROW (0) AVX2_ROW (1) AVX2_ROW (2)
+		AVX2_ROW (3) AVX2_ROW (4) AVX2_ROW (5)
+
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	AVX2_STORE (0) AVX2_STORE (1) AVX2_STORE (2)
+	AVX2_STORE (3) AVX2_STORE (4) AVX2_STORE (5)
+}
+
+#endif /* GEMM_HAVE_AVX2 */
+
+/** Choose the best micro-kernel the processor supports. */
+static MicroKernel
+select_kernel ()
+{
+#ifdef GEMM_HAVE_AVX2
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+		return micro_kernel_avx2;
+#endif /* GEMM_HAVE_AVX2 */
+	return micro_kernel_generic;
+}
+
+/** Strides of an operand: elements are @a rs apart within a column
+ *  and @a cs apart within a row. */
+struct GemmOperand
+{
+	const double *values;           //!< The first element.
+	size_t rs, cs;                  //!< The strides.
+
+	/** Describe an operand stored by rows @a ld apart, maybe transposed. */
+	GemmOperand (const double *values, unsigned ld, bool trans)
+		: values (values), rs (trans ? 1 : ld), cs (trans ? ld : 1) {}
+	/** Get the operand starting at the given element. */
+	GemmOperand at (size_t row, size_t col) const
+		{GemmOperand o (*this); o.values += row * rs + col * cs; return o;}
+};
+
+/** Pack an @a mc by @a kc block of @a alpha * A into slivers of GEMM_MR
+ *  rows, stored by columns and padded with zeros. */
+static void
+pack_a (unsigned mc, unsigned kc, double alpha,
+	const GemmOperand &a, double *buf)
+{
+	for (unsigned i = 0; i < mc; i += GEMM_MR)
+	{
+		unsigned r, mr = MIN (GEMM_MR, mc - i);
+		for (unsigned p = 0; p < kc; p++)
+		{
+			for (r = 0; r < mr; r++)
+				*buf++ = alpha * a.values[(i + r) * a.rs + p * a.cs];
+			for (; r < GEMM_MR; r++)
+				*buf++ = 0;
+		}
+	}
+}
+
+/** Pack a @a kc by @a nc panel of B into slivers of GEMM_NR columns,
+ *  stored by rows and padded with zeros. */
+static void
+pack_b (unsigned kc, unsigned nc, const GemmOperand &b, double *buf)
+{
+	for (unsigned j = 0; j < nc; j += GEMM_NR)
+	{
+		unsigned c, nr = MIN (GEMM_NR, nc - j);
+		for (unsigned p = 0; p < kc; p++)
+		{
+			const double *row = b.values + p * b.rs + j * b.cs;
+			if (b.cs == 1)
+				for (c = 0; c < nr; c++)
+					*buf++ = row[c];
+			else
+				for (c = 0; c < nr; c++)
+					*buf++ = row[c * b.cs];
+			for (; c < GEMM_NR; c++)
+				*buf++ = 0;
+		}
+	}
+}
+
+/** Multiply a packed block of A with a packed panel of B, adding to C. */
+static void
+macro_kernel (MicroKernel kernel, unsigned mc, unsigned nc, unsigned kc,
+	const double *pa, const double *pb, double *c, unsigned ldc)
+{
+	for (unsigned j = 0; j < nc; j += GEMM_NR)
+	{
+		unsigned nr = MIN (GEMM_NR, nc - j);
+		for (unsigned i = 0; i < mc; i += GEMM_MR)
+		{
+			unsigned mr = MIN (GEMM_MR, mc - i);
+			if (mr == GEMM_MR && nr == GEMM_NR)
+			{
+				kernel (kc, pa + i * kc, pb + j * kc,
+					c + (size_t) i * ldc + j, ldc);
+				continue;
+			}
+
+			/* Compute partial blocks at the edges out of place. */
+			double tmp[GEMM_MR * GEMM_NR];
+			memset (tmp, 0, sizeof tmp);
+			kernel (kc, pa + i * kc, pb + j * kc, tmp, GEMM_NR);
+
+			for (unsigned r = 0; r < mr; r++)
+				for (unsigned s = 0; s < nr; s++)
+					c[(size_t) (i + r) * ldc + j + s] += tmp[r * GEMM_NR + s];
+		}
+	}
+}
+
+/** Compute the product in the calling thread. */
+static void
+gemm_serial (MicroKernel kernel, unsigned m, unsigned n, unsigned k,
+	double alpha, const GemmOperand &a, const GemmOperand &b,
+	double beta, double *c, unsigned ldc)
+{
+	for (unsigned r = 0; r < m; r++)
+	{
+		double *row = c + (size_t) r * ldc;
+		if (!beta)
+			memset (row, 0, n * sizeof *c);
+		else if (beta != 1)
+			for (unsigned s = 0; s < n; s++)
+				row[s] *= beta;
+	}
+	if (!m || !n || !k || !alpha)
+		return;
+
+	unsigned nc_max = (MIN (GEMM_NC, n) + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+	unsigned mc_max = (MIN (GEMM_MC, m) + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+	double *pa = new double[mc_max * GEMM_KC];
+	double *pb = new double[nc_max * GEMM_KC];
+
+	for (unsigned jc = 0; jc < n; jc += GEMM_NC)
+	{
+		unsigned nc = MIN (GEMM_NC, n - jc);
+		for (unsigned pc = 0; pc < k; pc += GEMM_KC)
+		{
+			unsigned kc = MIN (GEMM_KC, k - pc);
+			pack_b (kc, nc, b.at (pc, jc), pb);
+
+			for (unsigned ic = 0; ic < m; ic += GEMM_MC)
+			{
+				unsigned mc = MIN (GEMM_MC, m - ic);
+				pack_a (mc, kc, alpha, a.at (ic, pc), pa);
+				macro_kernel (kernel, mc, nc, kc,
+					pa, pb, c + (size_t) ic * ldc + jc, ldc);
+			}
+		}
+	}
+
+	delete [] pa;
+	delete [] pb;
+}
+
+/** Arguments of a product split into a grid of blocks of C. */
+struct GemmJob
+{
+	MicroKernel kernel;             //!< The micro-kernel to use.
+	unsigned m, n, k;               //!< Dimensions.
+	double alpha, beta;             //!< Scaling factors.
+	const GemmOperand *a, *b;       //!< The operands.
+	double *c;                      //!< The result.
+	unsigned ldc;                   //!< Row stride of the result.
+	unsigned grid_cols;             //!< Number of blocks in a row of the grid.
+};
+
+/** Compute a range of blocks of the grid. */
+static void
+gemm_task (void *data, unsigned begin, unsigned end)
+{
+	GemmJob *job = static_cast<GemmJob *> (data);
+	for (unsigned i = begin; i < end; i++)
+	{
+		unsigned ic = i / job->grid_cols * GEMM_MC;
+		unsigned jc = i % job->grid_cols * GEMM_NC;
+
+		gemm_serial (job->kernel,
+			MIN (GEMM_MC, job->m - ic), MIN (GEMM_NC, job->n - jc), job->k,
+			job->alpha, job->a->at (ic, 0), job->b->at (0, jc), job->beta,
+			job->c + (size_t) ic * job->ldc + jc, job->ldc);
+	}
+}
+
+void
+gemm (unsigned m, unsigned n, unsigned k, double alpha,
+	const double *a, unsigned lda,
+	const double *b, unsigned ldb, double beta,
+	double *c, unsigned ldc)
+{
+	gemm (false, false, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+}
+
+void
+gemm (bool trans_a, bool trans_b,
+	unsigned m, unsigned n, unsigned k, double alpha,
+	const double *a_values, unsigned lda,
+	const double *b_values, unsigned ldb, double beta,
+	double *c, unsigned ldc)
+{
+	static MicroKernel kernel = select_kernel ();
+
+	GemmOperand a (a_values, lda, trans_a);
+	GemmOperand b (b_values, ldb, trans_b);
+
+	ThreadPool &pool = ThreadPool::get ();
+	if (pool.get_size () == 1 || (double) m * n * k < GEMM_PARALLEL_MIN)
+	{
+		gemm_serial (kernel, m, n, k, alpha, a, b, beta, c, ldc);
+		return;
+	}
+
+	GemmJob job;
+	job.kernel = kernel;
+	job.m = m;  job.n = n;  job.k = k;
+	job.alpha = alpha;  job.beta = beta;
+	job.a = &a;
+	job.b = &b;
+	job.c = c;  job.ldc = ldc;
+
+	job.grid_cols = (n + GEMM_NC - 1) / GEMM_NC;
+	pool.run (gemm_task, &job, (m + GEMM_MC - 1) / GEMM_MC * job.grid_cols);
+}
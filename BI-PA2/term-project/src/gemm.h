@@ -0,0 +1,30 @@
+/**
+ * @file gemm.h
+ * Dense matrix multiplication kernels.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __GEMM_H__
+#define __GEMM_H__
+
+/** Compute C = @a alpha * A * B + @a beta * C, where A is @a m by @a k,
+ *  B is @a k by @a n and C is @a m by @a n.  All matrices are stored by rows,
+ *  @a lda, @a ldb and @a ldc being the distances between the beginnings
+ *  of two successive rows.  Large products are split across ThreadPool. */
+void gemm (unsigned m, unsigned n, unsigned k, double alpha,
+	const double *a, unsigned lda,
+	const double *b, unsigned ldb, double beta,
+	double *c, unsigned ldc);
+
+/** Like the above, but A is transposed when @a trans_a is set, i.e. it is
+ *  stored as a @a k by @a m matrix, and the same goes for B and @a trans_b.
+ *  The transposition is done while packing, at no extra cost. */
+void gemm (bool trans_a, bool trans_b,
+	unsigned m, unsigned n, unsigned k, double alpha,
+	const double *a, unsigned lda,
+	const double *b, unsigned ldb, double beta,
+	double *c, unsigned ldc);
+
+#endif /* ! __GEMM_H__ */
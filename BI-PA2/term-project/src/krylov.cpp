@@ -0,0 +1,501 @@
+/**
+ * @file krylov.cpp
+ * Iterative solvers of sparse linear systems.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <config.h>
+
+#include "matrix.h"
+#include "threadpool.h"
+#include "krylov.h"
+
+#include "gettext.h"
+#define _(String) gettext (String)
+
+using namespace std;
+
+
+/** Don't split matrix-vector products into chunks of less rows than this. */
+#define SPMV_GRAIN 4096
+
+typedef vector<double> Vector;
+
+/** A square matrix in compressed sparse rows. */
+struct SparseSystem
+{
+	unsigned n;                  //!< Number of rows and columns.
+	const unsigned *row_ptr;     //!< Beginnings of rows, plus the end.
+	const unsigned *col_idx;     //!< Column indexes of values.
+	const double *vals;          //!< The values.
+};
+
+/** Arguments of spmv_task(). */
+struct SpmvJob
+{
+	const SparseSystem *a;       //!< The matrix.
+	const double *x;             //!< The vector to multiply.
+	double *y;                   //!< The result.
+};
+
+/** Multiply rows [@a begin, @a end) by a vector. */
+static void
+spmv_task (void *data, unsigned begin, unsigned end)
+{
+	const SpmvJob *job = static_cast<const SpmvJob *> (data);
+	const SparseSystem &a = *job->a;
+
+	for (unsigned r = begin; r < end; r++)
+	{
+		double sum = 0;
+		for (unsigned i = a.row_ptr[r]; i < a.row_ptr[r + 1]; i++)
+			sum += a.vals[i] * job->x[a.col_idx[i]];
+		job->y[r] = sum;
+	}
+}
+
+/** Compute @a y = A * @a x. */
+static void
+spmv (const SparseSystem &a, const Vector &x, Vector &y)
+{
+	SpmvJob job = {&a, &x[0], &y[0]};
+	ThreadPool::get ().run (spmv_task, &job, a.n, SPMV_GRAIN);
+}
+
+/** Compute the dot product of two vectors. */
+static double
+dot (const Vector &x, const Vector &y)
+{
+	double sum = 0;
+	for (size_t i = 0; i < x.size (); i++)
+		sum += x[i] * y[i];
+	return sum;
+}
+
+/** Compute the Euclidean norm of a vector. */
+static double
+norm (const Vector &x)
+{
+	return sqrt (dot (x, x));
+}
+
+/** Compute @a y += @a alpha * @a x. */
+static void
+axpy (double alpha, const Vector &x, Vector &y)
+{
+	for (size_t i = 0; i < x.size (); i++)
+		y[i] += alpha * x[i];
+}
+
+/** Preconditioner M of the system, approximating A. */
+class Preconditioning
+{
+	const SparseSystem &a;                     //!< The matrix.
+	IterativeSolver::Preconditioner kind;      //!< Kind of preconditioner.
+	Vector inv_diag;                           //!< Jacobi: the inverse
+	                                           //!< of the diagonal.
+	Vector lu;                                 //!< ILU(0): the factors,
+	                                           //!< in the pattern of A.
+	vector<unsigned> diag;                     //!< ILU(0): positions
+	                                           //!< of the diagonal.
+
+	void factorize () throw (ESolverFailed);
+public:
+	/** Prepare the preconditioner for the matrix. */
+	Preconditioning (const SparseSystem &a,
+		IterativeSolver::Preconditioner kind) throw (ESolverFailed);
+	/** Compute @a z = M^-1 * @a r. */
+	void apply (const Vector &r, Vector &z) const;
+};
+
+Preconditioning::Preconditioning (const SparseSystem &a,
+	IterativeSolver::Preconditioner kind) throw (ESolverFailed)
+	: a (a), kind (kind)
+{
+	if (kind == IterativeSolver::NONE)
+		return;
+
+	diag.resize (a.n);
+	for (unsigned r = 0; r < a.n; r++)
+	{
+		const unsigned *begin = a.col_idx + a.row_ptr[r];
+		const unsigned *end   = a.col_idx + a.row_ptr[r + 1];
+		const unsigned *iter  = lower_bound (begin, end, r);
+		if (iter == end || *iter != r || !a.vals[iter - a.col_idx])
+			throw ESolverFailed
+				(_("A zero on the diagonal prevents preconditioning"));
+		diag[r] = iter - a.col_idx;
+	}
+
+	if (kind == IterativeSolver::JACOBI)
+	{
+		inv_diag.resize (a.n);
+		for (unsigned r = 0; r < a.n; r++)
+			inv_diag[r] = 1 / a.vals[diag[r]];
+	}
+	else
+		factorize ();
+}
+
+/** Compute the incomplete factorization, keeping only values
+ *  where A itself has them.  L has an implicit unit diagonal. */
+void
+Preconditioning::factorize () throw (ESolverFailed)
+{
+	lu.assign (a.vals, a.vals + a.row_ptr[a.n]);
+
+	/* Positions of values in the current row by their column. */
+	vector<unsigned> position (a.n, (unsigned) -1);
+	for (unsigned i = 0; i < a.n; i++)
+	{
+		unsigned begin = a.row_ptr[i], end = a.row_ptr[i + 1];
+		for (unsigned p = begin; p < end; p++)
+			position[a.col_idx[p]] = p;
+
+		for (unsigned p = begin; p < diag[i]; p++)
+		{
+			unsigned k = a.col_idx[p];
+			double factor = lu[p] /= lu[diag[k]];
+			for (unsigned q = diag[k] + 1; q < a.row_ptr[k + 1]; q++)
+			{
+				unsigned j = position[a.col_idx[q]];
+				if (j != (unsigned) -1)
+					lu[j] -= factor * lu[q];
+			}
+		}
+
+		if (!lu[diag[i]])
+			throw ESolverFailed
+				(_("A zero on the diagonal prevents preconditioning"));
+		for (unsigned p = begin; p < end; p++)
+			position[a.col_idx[p]] = (unsigned) -1;
+	}
+}
+
+void
+Preconditioning::apply (const Vector &r, Vector &z) const
+{
+	switch (kind)
+	{
+	case IterativeSolver::NONE:
+		z = r;
+		break;
+	case IterativeSolver::JACOBI:
+		for (unsigned i = 0; i < a.n; i++)
+			z[i] = r[i] * inv_diag[i];
+		break;
+	case IterativeSolver::ILU0:
+		for (unsigned i = 0; i < a.n; i++)
+		{
+			double sum = r[i];
+			for (unsigned p = a.row_ptr[i]; p < diag[i]; p++)
+				sum -= lu[p] * z[a.col_idx[p]];
+			z[i] = sum;
+		}
+		for (unsigned i = a.n; i--; )
+		{
+			double sum = z[i];
+			for (unsigned p = diag[i] + 1; p < a.row_ptr[i + 1]; p++)
+				sum -= lu[p] * z[a.col_idx[p]];
+			z[i] = sum / lu[diag[i]];
+		}
+	}
+}
+
+/** State shared by all the methods. */
+struct SolveContext
+{
+	const SparseSystem &a;                     //!< The matrix.
+	const Preconditioning &m;                  //!< The preconditioner.
+	const IterativeSolver &solver;             //!< Settings of the solver.
+	IterativeSolver::ProgressCallback cb;      //!< Progress callback.
+	void *extra;                               //!< Data for the callback.
+
+	double b_norm;                             //!< Norm of the right side.
+	unsigned iterations;                       //!< Iterations done so far.
+	double residual;                           //!< The last relative residual.
+
+	SolveContext (const SparseSystem &a, const Preconditioning &m,
+		const IterativeSolver &solver,
+		IterativeSolver::ProgressCallback cb, void *extra)
+		: a (a), m (m), solver (solver), cb (cb), extra (extra) {}
+
+	/** Finish an iteration with the residual of norm @a r_norm.
+	 *  Returns true when it's time to stop. */
+	bool report (double r_norm)
+	{
+		residual = r_norm / b_norm;
+		if (cb)
+			cb (++iterations, residual, extra);
+		else
+			++iterations;
+		return residual <= solver.tolerance
+			|| iterations >= solver.max_iterations;
+	}
+};
+
+/** Throw an exception telling that the method broke down. */
+static void
+breakdown () throw (ESolverFailed)
+{
+	throw ESolverFailed (_("The method broke down, try another one"));
+}
+
+/** Preconditioned conjugate gradients. */
+static void
+solve_cg (SolveContext &ctx, const Vector &b, Vector &x)
+{
+	unsigned n = ctx.a.n;
+	Vector r (b), z (n), p (n), q (n);
+
+	ctx.m.apply (r, z);
+	p = z;
+	double rz = dot (r, z);
+
+	while (1)
+	{
+		spmv (ctx.a, p, q);
+		double pq = dot (p, q);
+		if (!(pq > 0))
+			throw ESolverFailed
+				(_("The matrix is not positive definite, try another method"));
+
+		double alpha = rz / pq;
+		axpy (alpha, p, x);
+		axpy (-alpha, q, r);
+		if (ctx.report (norm (r)))
+			return;
+
+		ctx.m.apply (r, z);
+		double rz_new = dot (r, z);
+		double beta = rz_new / rz;
+		rz = rz_new;
+
+		for (unsigned i = 0; i < n; i++)
+			p[i] = z[i] + beta * p[i];
+	}
+}
+
+/** Stabilized biconjugate gradients, preconditioned from the right. */
+static void
+solve_bicgstab (SolveContext &ctx, const Vector &b, Vector &x)
+{
+	unsigned n = ctx.a.n;
+	Vector r (b), r0 (b), p (n), v (n), s (n), t (n), p_hat (n), s_hat (n);
+	double rho = 1, alpha = 1, omega = 1;
+
+	while (1)
+	{
+		double rho_new = dot (r0, r);
+		if (!rho_new || !omega)
+			breakdown ();
+
+		double beta = (rho_new / rho) * (alpha / omega);
+		rho = rho_new;
+		for (unsigned i = 0; i < n; i++)
+			p[i] = r[i] + beta * (p[i] - omega * v[i]);
+
+		ctx.m.apply (p, p_hat);
+		spmv (ctx.a, p_hat, v);
+		double r0v = dot (r0, v);
+		if (!r0v)
+			breakdown ();
+		alpha = rho / r0v;
+
+		s = r;
+		axpy (-alpha, v, s);
+		double s_norm = norm (s);
+		if (s_norm / ctx.b_norm <= ctx.solver.tolerance)
+		{
+			axpy (alpha, p_hat, x);
+			ctx.report (s_norm);
+			return;
+		}
+
+		ctx.m.apply (s, s_hat);
+		spmv (ctx.a, s_hat, t);
+		double tt = dot (t, t);
+		omega = tt ? dot (t, s) / tt : 0;
+
+		axpy (alpha, p_hat, x);
+		axpy (omega, s_hat, x);
+		r = s;
+		axpy (-omega, t, r);
+		if (ctx.report (norm (r)))
+			return;
+	}
+}
+
+/** Restarted GMRES, preconditioned from the right.  The Hessenberg matrix
+ *  is kept upper triangular by Givens rotations as it grows, which gives
+ *  the norm of the residual in each iteration for free. */
+static void
+solve_gmres (SolveContext &ctx, const Vector &b, Vector &x)
+{
+	unsigned n = ctx.a.n;
+	unsigned m = max (ctx.solver.restart, 1U);
+
+	vector<Vector> v (m + 1, Vector (n));
+	vector<Vector> h (m + 1, Vector (m));
+	Vector cs (m), sn (m), g (m + 1), y (m), w (n), z (n);
+
+	while (1)
+	{
+		/* r = b - A * x */
+		spmv (ctx.a, x, w);
+		for (unsigned i = 0; i < n; i++)
+			v[0][i] = b[i] - w[i];
+
+		double beta = norm (v[0]);
+		if (beta / ctx.b_norm <= ctx.solver.tolerance)
+		{
+			ctx.residual = beta / ctx.b_norm;
+			return;
+		}
+		for (unsigned i = 0; i < n; i++)
+			v[0][i] /= beta;
+		fill (g.begin (), g.end (), 0.);
+		g[0] = beta;
+
+		unsigned k = 0;
+		bool done = false;
+		while (k < m && !done)
+		{
+			ctx.m.apply (v[k], z);
+			spmv (ctx.a, z, w);
+
+			/* Modified Gram-Schmidt orthogonalization. */
+			for (unsigned i = 0; i <= k; i++)
+			{
+				h[i][k] = dot (w, v[i]);
+				axpy (-h[i][k], v[i], w);
+			}
+			h[k + 1][k] = norm (w);
+			if (h[k + 1][k])
+				for (unsigned i = 0; i < n; i++)
+					v[k + 1][i] = w[i] / h[k + 1][k];
+
+			for (unsigned i = 0; i < k; i++)
+			{
+				double tmp  =  cs[i] * h[i][k] + sn[i] * h[i + 1][k];
+				h[i + 1][k] = -sn[i] * h[i][k] + cs[i] * h[i + 1][k];
+				h[i][k] = tmp;
+			}
+
+			double d = sqrt (h[k][k] * h[k][k] + h[k + 1][k] * h[k + 1][k]);
+			if (!d)
+				breakdown ();
+			cs[k] = h[k][k] / d;
+			sn[k] = h[k + 1][k] / d;
+			h[k][k] = d;
+			h[k + 1][k] = 0;
+			g[k + 1] = -sn[k] * g[k];
+			g[k] = cs[k] * g[k];
+
+			/* When h[k + 1][k] is zero, the Krylov subspace is invariant
+			 * and the residual is zero, so this stops right away. */
+			done = ctx.report (fabs (g[k + 1]));
+			k++;
+		}
+
+		/* Solve the triangular system H * y = g, then x += M^-1 * V * y. */
+		for (unsigned i = k; i--; )
+		{
+			double sum = g[i];
+			for (unsigned j = i + 1; j < k; j++)
+				sum -= h[i][j] * y[j];
+			y[i] = sum / h[i][i];
+		}
+
+		fill (w.begin (), w.end (), 0.);
+		for (unsigned i = 0; i < k; i++)
+			axpy (y[i], v[i], w);
+		ctx.m.apply (w, z);
+		axpy (1, z, x);
+
+		if (done)
+			return;
+	}
+}
+
+IterativeSolver::IterativeSolver ()
+	: method (GMRES), preconditioner (ILU0),
+	  tolerance (1e-10), max_iterations (1000), restart (30)
+{
+}
+
+Matrix
+IterativeSolver::solve (const Matrix &a, const Matrix &b,
+	ProgressCallback cb, void *extra) const
+	throw (EIncompatibleMatrix, ESolverFailed)
+{
+	unsigned n = a.get_storage ().get_rows ();
+	if (n != a.get_storage ().get_cols ())
+		throw EIncompatibleMatrix
+			(_("Only systems with square matrices can be solved"));
+	if (n != b.get_storage ().get_rows ())
+		throw EIncompatibleMatrix
+			(_("The right side has wrong number of rows for the system"));
+
+	Matrix compressed = a.compress ();
+	const MatrixCSRStorage &mcs =
+		static_cast<const MatrixCSRStorage &> (compressed.get_storage ());
+
+	SparseSystem system;
+	system.n = n;
+	system.row_ptr = &mcs.get_row_ptr ()[0];
+	system.col_idx = mcs.get_vals ().empty () ? NULL : &mcs.get_col_idx ()[0];
+	system.vals    = mcs.get_vals ().empty () ? NULL : &mcs.get_vals ()[0];
+
+	Preconditioning m (system, preconditioner);
+
+	unsigned cols = b.get_storage ().get_cols ();
+	MatrixArrayStorage *result = new MatrixArrayStorage (n, cols);
+	Matrix x_matrix (result);
+	double *values = result->get_values ();
+
+	Vector rhs (n), x (n);
+	for (unsigned c = 0; c < cols; c++)
+	{
+		for (unsigned r = 0; r < n; r++)
+			rhs[r] = b.get (r, c);
+		fill (x.begin (), x.end (), 0.);
+
+		SolveContext ctx (system, m, *this, cb, extra);
+		ctx.b_norm = norm (rhs);
+		ctx.iterations = 0;
+		ctx.residual = 0;
+
+		if (ctx.b_norm)
+		{
+			switch (method)
+			{
+			case CG:       solve_cg       (ctx, rhs, x); break;
+			case BICGSTAB: solve_bicgstab (ctx, rhs, x); break;
+			case GMRES:    solve_gmres    (ctx, rhs, x); break;
+			}
+		}
+
+		if (ctx.residual > tolerance || ctx.residual != ctx.residual)
+		{
+			char buff[160];
+			snprintf (buff, sizeof buff, _("No convergence after %u "
+				"iterations, the relative residual is %g"),
+				ctx.iterations, ctx.residual);
+			throw ESolverFailed (buff);
+		}
+
+		for (unsigned r = 0; r < n; r++)
+			values[(size_t) r * cols + c] = x[r];
+	}
+	return x_matrix;
+}
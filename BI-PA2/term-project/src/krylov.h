@@ -0,0 +1,69 @@
+/**
+ * @file krylov.h
+ * Iterative solvers of sparse linear systems.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __KRYLOV_H__
+#define __KRYLOV_H__
+
+/** The iterative solver failed to find a solution. */
+class ESolverFailed : public std::exception
+{
+	std::string message;
+public:
+	/** Initialize the exception with the given message. */
+	ESolverFailed (const std::string &message) : message (message) {}
+	virtual ~ESolverFailed () throw () {}
+	/** Return a description of the event. */
+	virtual const char *what () const throw () {return message.c_str ();}
+};
+
+/** Solves A * X = B using Krylov subspace methods.  The matrix is only ever
+ *  multiplied by vectors in compressed sparse rows, so that systems far too
+ *  large to be inverted or factorized may be solved, as long as they're
+ *  sparse.  Each column of B is solved for separately, starting from zero. */
+class IterativeSolver
+{
+public:
+	/** The Krylov subspace method to use. */
+	enum Method
+	{
+		CG,           //!< Conjugate gradients, for symmetric positive
+		              //!< definite matrices only.
+		BICGSTAB,     //!< Stabilized biconjugate gradients.
+		GMRES         //!< Restarted generalized minimal residual method.
+	};
+
+	/** The preconditioner to use. */
+	enum Preconditioner
+	{
+		NONE,         //!< No preconditioning.
+		JACOBI,       //!< The inverse of the diagonal.
+		ILU0          //!< Incomplete LU factorization without fill-in.
+	};
+
+	/** Callback reporting the relative norm of the residual
+	 *  after each @a iteration. */
+	typedef void (*ProgressCallback) (unsigned iteration,
+		double residual, void *extra);
+
+	Method method;                   //!< The method.
+	Preconditioner preconditioner;   //!< The preconditioner.
+	double tolerance;                //!< Relative norm of the residual
+	                                 //!< that is deemed good enough.
+	unsigned max_iterations;         //!< Give up after so many iterations.
+	unsigned restart;                //!< Restart length of GMRES.
+
+	/** Initialize the solver to use GMRES with ILU(0). */
+	IterativeSolver ();
+
+	/** Solve A * X = @a b for X. */
+	Matrix solve (const Matrix &a, const Matrix &b,
+		ProgressCallback cb = NULL, void *extra = NULL) const
+		throw (EIncompatibleMatrix, ESolverFailed);
+};
+
+#endif /* ! __KRYLOV_H__ */
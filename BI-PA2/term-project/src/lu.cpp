@@ -0,0 +1,390 @@
+/**
+ * @file lu.cpp
+ * LU decomposition.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+#include <config.h>
+
+#include "matrix.h"
+#include "threadpool.h"
+#include "gemm.h"
+#include "lu.h"
+
+#include "gettext.h"
+#define _(String) gettext (String)
+
+using namespace std;
+
+
+/** Width of the panels. */
+#define LU_BLOCK 64
+
+/** Don't split loops into chunks doing less multiply-adds than this. */
+#define LU_GRAIN_WORK 16384
+
+/** Arguments for parallel parts of the factorization. */
+struct LUJob
+{
+	double *a;                  //!< The matrix.
+	unsigned lda;               //!< Row stride.
+	unsigned first;             //!< The first row or column to work on.
+	unsigned pivot;             //!< The current pivot.
+	unsigned end;               //!< End of the current panel.
+};
+
+/** Apply the current pivot to a range of rows below it, within the panel. */
+static void
+lu_panel_task (void *data, unsigned begin, unsigned end)
+{
+	LUJob *job = static_cast<LUJob *> (data);
+	unsigned j = job->pivot;
+	const double *pivot_row = job->a + (size_t) j * job->lda;
+	double pivot = pivot_row[j];
+
+	for (unsigned r = job->first + begin; r < job->first + end; r++)
+	{
+		double *row = job->a + (size_t) r * job->lda;
+		double factor = row[j] /= pivot;
+		if (!factor)
+			continue;
+
+		for (unsigned c = j + 1; c < job->end; c++)
+			row[c] -= factor * pivot_row[c];
+	}
+}
+
+/** Compute a range of columns of U12 = L11^-1 * A12. */
+static void
+lu_solve_task (void *data, unsigned begin, unsigned end)
+{
+	LUJob *job = static_cast<LUJob *> (data);
+	begin += job->first;
+	end   += job->first;
+
+	for (unsigned i = job->pivot + 1; i < job->end; i++)
+	{
+		double *row = job->a + (size_t) i * job->lda;
+		for (unsigned t = job->pivot; t < i; t++)
+		{
+			const double *upper = job->a + (size_t) t * job->lda;
+			double factor = row[t];
+			if (factor)
+				for (unsigned c = begin; c < end; c++)
+					row[c] -= factor * upper[c];
+		}
+	}
+}
+
+double
+lu_tolerance (const double *a, unsigned n, unsigned lda)
+{
+	double value_max = 0;
+	for (unsigned r = 0; r < n; r++)
+		for (unsigned c = 0; c < n; c++)
+			value_max = max (value_max, fabs (a[(size_t) r * lda + c]));
+	return n * DBL_EPSILON * value_max;
+}
+
+bool
+lu_factor (double *a, unsigned n, unsigned lda,
+	unsigned *perm, unsigned *swaps)
+{
+	ThreadPool &pool = ThreadPool::get ();
+	double tiny = lu_tolerance (a, n, lda);
+	bool regular = true;
+
+	for (unsigned i = 0; i < n; i++)
+		perm[i] = i;
+	*swaps = 0;
+
+	LUJob job;
+	job.a = a;
+	job.lda = lda;
+
+	for (unsigned kb = 0; kb < n; kb += LU_BLOCK)
+	{
+		unsigned kend = min (kb + LU_BLOCK, n);
+
+		/* Factorize the panel with the classic algorithm. */
+		for (unsigned j = kb; j < kend; j++)
+		{
+			unsigned pivot = j;
+			double value_max = 0;
+			for (unsigned i = j; i < n; i++)
+			{
+				double value = fabs (a[(size_t) i * lda + j]);
+				if (value > value_max)
+				{
+					value_max = value;
+					pivot = i;
+				}
+			}
+
+			if (pivot != j)
+			{
+				swap_ranges (a + (size_t) j * lda, a + (size_t) j * lda + n,
+					a + (size_t) pivot * lda);
+				swap (perm[j], perm[pivot]);
+				++*swaps;
+			}
+
+			/* Leave singular columns be, nothing to eliminate there. */
+			if (value_max <= tiny)
+			{
+				for (unsigned i = j; i < n; i++)
+					a[(size_t) i * lda + j] = 0;
+				regular = false;
+				continue;
+			}
+
+			job.first = j + 1;
+			job.pivot = j;
+			job.end = kend;
+			pool.run (lu_panel_task, &job, n - j - 1,
+				LU_GRAIN_WORK / (kend - j));
+		}
+
+		if (kend == n)
+			break;
+
+		/* U12 = L11^-1 * A12 */
+		job.first = kend;
+		job.pivot = kb;
+		job.end = kend;
+		pool.run (lu_solve_task, &job, n - kend,
+			LU_GRAIN_WORK / (LU_BLOCK * LU_BLOCK / 2));
+
+		/* A22 -= L21 * U12 */
+		gemm (n - kend, n - kend, kend - kb, -1,
+			a + (size_t) kend * lda + kb, lda,
+			a + (size_t) kb * lda + kend, lda, 1,
+			a + (size_t) kend * lda + kend, lda);
+	}
+
+	return regular;
+}
+
+
+LUFactorization::LUFactorization (const Matrix &m) throw (EIncompatibleMatrix)
+{
+	const MatrixStorage &ms = m.get_storage ();
+	size = ms.get_rows ();
+	if (size != ms.get_cols ())
+		throw EIncompatibleMatrix
+			(_("LU decomposition is only defined for square matrices"));
+
+	lu = new double[(size_t) size * size];
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&ms);
+	if (mas)
+		copy (mas->get_values (),
+			mas->get_values () + (size_t) size * size, lu);
+	else
+		for (unsigned r = 0; r < size; r++)
+			for (unsigned c = 0; c < size; c++)
+				lu[(size_t) r * size + c] = ms.get (r, c);
+
+	perm = new unsigned[size];
+	tolerance = lu_tolerance (lu, size, size);
+	regular = lu_factor (lu, size, size, perm, &swaps);
+	rank_cache = regular ? (int) size : -1;
+}
+
+LUFactorization::~LUFactorization ()
+{
+	delete [] lu;
+	delete [] perm;
+}
+
+double
+LUFactorization::determinant () const
+{
+	if (!regular)
+		return 0;
+
+	double det = swaps % 2 ? -1 : 1;
+	for (unsigned s = 0; s < size; s++)
+		det *= lu[(size_t) s * size + s];
+	return det;
+}
+
+unsigned
+LUFactorization::rank () const
+{
+	if (rank_cache >= 0)
+		return rank_cache;
+
+	/* L has a unit diagonal and is thus regular, so the rank of A
+	 * is the rank of U, which is mostly eliminated already.  Bring it
+	 * to an echelon form, deeming zero what the factorization did. */
+	vector<double> u ((size_t) size * size);
+	for (unsigned r = 0; r < size; r++)
+		copy (lu + (size_t) r * size + r, lu + (size_t) (r + 1) * size,
+			&u[(size_t) r * size + r]);
+
+	unsigned rank = 0;
+	for (unsigned c = 0; c < size && rank < size; c++)
+	{
+		unsigned pivot = rank;
+		double value_max = 0;
+		for (unsigned i = rank; i < size; i++)
+		{
+			double value = fabs (u[(size_t) i * size + c]);
+			if (value > value_max)
+			{
+				value_max = value;
+				pivot = i;
+			}
+		}
+
+		if (value_max <= tolerance)
+			continue;
+
+		double *pivot_row = &u[(size_t) rank * size];
+		if (pivot != rank)
+			swap_ranges (pivot_row + c, pivot_row + size,
+				&u[(size_t) pivot * size + c]);
+
+		for (unsigned i = rank + 1; i < size; i++)
+		{
+			double *row = &u[(size_t) i * size];
+			double factor = row[c] / pivot_row[c];
+			if (!factor)
+				continue;
+
+			for (unsigned k = c; k < size; k++)
+				row[k] -= factor * pivot_row[k];
+		}
+		rank++;
+	}
+
+	rank_cache = rank;
+	return rank;
+}
+
+/** Arguments for substitution. */
+struct LUSubstituteJob
+{
+	const double *lu;           //!< The decomposition.
+	unsigned size;              //!< Size of the decomposed matrix.
+	double *x;                  //!< The right-hand side, to be replaced.
+	unsigned cols;              //!< Number of columns of @a x.
+};
+
+/** Solve L * U * X = X in place for a range of columns of X. */
+static void
+lu_substitute_task (void *data, unsigned begin, unsigned end)
+{
+	LUSubstituteJob *job = static_cast<LUSubstituteJob *> (data);
+	unsigned n = job->size, cols = job->cols;
+
+	/* Forward substitution, L having a unit diagonal. */
+	for (unsigned i = 1; i < n; i++)
+	{
+		const double *l = job->lu + (size_t) i * n;
+		double *xi = job->x + (size_t) i * cols;
+		for (unsigned j = 0; j < i; j++)
+		{
+			double factor = l[j];
+			if (!factor)
+				continue;
+
+			const double *xj = job->x + (size_t) j * cols;
+			for (unsigned c = begin; c < end; c++)
+				xi[c] -= factor * xj[c];
+		}
+	}
+
+	/* Backward substitution. */
+	for (unsigned i = n; i--; )
+	{
+		const double *u = job->lu + (size_t) i * n;
+		double *xi = job->x + (size_t) i * cols;
+		for (unsigned j = i + 1; j < n; j++)
+		{
+			double factor = u[j];
+			if (!factor)
+				continue;
+
+			const double *xj = job->x + (size_t) j * cols;
+			for (unsigned c = begin; c < end; c++)
+				xi[c] -= factor * xj[c];
+		}
+
+		double pivot = u[i];
+		for (unsigned c = begin; c < end; c++)
+			xi[c] /= pivot;
+	}
+}
+
+/** Solve the system for the already permuted right-hand side in @a ms,
+ *  splitting its columns across ThreadPool. */
+static Matrix
+lu_substitute (const double *lu, unsigned size, MatrixArrayStorage *ms)
+{
+	LUSubstituteJob job;
+	job.lu = lu;
+	job.size = size;
+	job.x = ms->get_values ();
+	job.cols = ms->get_cols ();
+
+	ThreadPool::get ().run (lu_substitute_task, &job, job.cols,
+		(unsigned) (LU_GRAIN_WORK / ((double) size * size)) + 1);
+	return Matrix (ms);
+}
+
+Matrix
+LUFactorization::solve (const Matrix &b) const throw (EIncompatibleMatrix)
+{
+	const MatrixStorage &bs = b.get_storage ();
+	if (bs.get_rows () != size)
+		throw EIncompatibleMatrix
+			(_("The right-hand side has a wrong number of rows"));
+	if (!regular)
+		throw EIncompatibleMatrix
+			(_("Only systems with regular matrices can be solved"));
+
+	unsigned cols = bs.get_cols ();
+	MatrixArrayStorage *ms = new MatrixArrayStorage (size, cols, false);
+	double *x = ms->get_values ();
+
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&bs);
+	for (unsigned r = 0; r < size; r++)
+	{
+		double *row = x + (size_t) r * cols;
+		if (mas)
+			copy (mas->get_values () + (size_t) perm[r] * cols,
+				mas->get_values () + (size_t) (perm[r] + 1) * cols, row);
+		else
+			for (unsigned c = 0; c < cols; c++)
+				row[c] = bs.get (perm[r], c);
+	}
+
+	return lu_substitute (lu, size, ms);
+}
+
+Matrix
+LUFactorization::inverse () const throw (EIncompatibleMatrix)
+{
+	if (!regular)
+		throw EIncompatibleMatrix (_("Only regular matrices are invertible"));
+
+	/* Solve the system for a permuted identity matrix. */
+	MatrixArrayStorage *ms = new MatrixArrayStorage (size, size);
+	double *x = ms->get_values ();
+	for (unsigned r = 0; r < size; r++)
+		x[(size_t) r * size + perm[r]] = 1;
+
+	return lu_substitute (lu, size, ms);
+}
@@ -0,0 +1,72 @@
+/**
+ * @file lu.h
+ * LU decomposition.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __LU_H__
+#define __LU_H__
+
+/** Factorize the @a n by @a n matrix @a a, stored by rows with stride @a lda,
+ *  in place into P * A = L * U using partial pivoting.  The strict lower
+ *  triangle then holds L, which has an implicit unit diagonal, the rest holds U.
+ *
+ *  This is the blocked, right-looking variant: columns are factorized
+ *  in narrow panels, and the trailing matrix is updated once per panel
+ *  with a single matrix product, split across ThreadPool.
+ *
+ *  Pivots are deemed zero when they're no larger than lu_tolerance()
+ *  of the original matrix, so that the result doesn't depend on its scale.
+ *
+ *  @param perm   Receives the original index of each row.
+ *  @param swaps  Receives the number of row swaps performed.
+ *  @return false if the matrix is singular, in which case the offending
+ *          diagonal elements of U are zero.
+ */
+bool lu_factor (double *a, unsigned n, unsigned lda,
+	unsigned *perm, unsigned *swaps);
+
+/** Get the magnitude below which values computed from the @a n by @a n
+ *  matrix @a a are indistinguishable from rounding errors, that is
+ *  n * epsilon * max |a_ij|. */
+double lu_tolerance (const double *a, unsigned n, unsigned lda);
+
+/** LU decomposition of a square Matrix, P * A = L * U, using partial
+ *  pivoting.  L and U are packed into a single buffer.  Once computed,
+ *  it answers further questions about the matrix without eliminating it
+ *  all over again, so a Matrix caches it for as long as it stays intact. */
+class LUFactorization
+{
+	unsigned size;          //!< Number of rows and columns.
+	double *lu;             //!< L and U packed together, stored by rows.
+	unsigned *perm;         //!< Original indexes of rows.
+	unsigned swaps;         //!< Number of row swaps performed.
+	bool regular;           //!< Whether the matrix is regular.
+	double tolerance;       //!< Magnitude of rounding errors, see lu_tolerance().
+	mutable int rank_cache; //!< The rank once known, -1 otherwise.
+
+	LUFactorization (const LUFactorization &);
+	LUFactorization &operator= (const LUFactorization &);
+public:
+	/** Factorize a square matrix. */
+	LUFactorization (const Matrix &m) throw (EIncompatibleMatrix);
+	~LUFactorization ();
+
+	/** Get the number of rows and columns of the matrix. */
+	unsigned get_size () const {return size;}
+	/** Return whether the matrix is regular. */
+	bool is_regular () const {return regular;}
+
+	/** Compute the determinant of the matrix. */
+	double determinant () const;
+	/** Compute the rank of the matrix. */
+	unsigned rank () const;
+	/** Solve A * X = @a b for X, @a b may have any number of columns. */
+	Matrix solve (const Matrix &b) const throw (EIncompatibleMatrix);
+	/** Compute the inverse of the matrix. */
+	Matrix inverse () const throw (EIncompatibleMatrix);
+};
+
+#endif /* ! __LU_H__ */
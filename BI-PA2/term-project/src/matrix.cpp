@@ -8,13 +8,22 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <cmath>
+#include <cfloat>
 #include <cstring>
 #include <cstdio>
+#include <stdint.h>
 
 #include <config.h>
 
 #include "matrix.h"
+#include "threadpool.h"
+#include "strassen.h"
+#include "lu.h"
+#include "tiled.h"
+#include "profile.h"
 
 #include "gettext.h"
 #define _(String) gettext (String)
@@ -22,9 +31,8 @@
 using namespace std;
 
 
-/** To hack around some precision errors, values smaller than this
- *  are transformed to zeros in forward Gaussian elimination. */
-#define ELIMINATES_TO_ZERO 1e-10
+/** Don't split row operations into chunks doing less work than this. */
+#define ELIMINATE_GRAIN_WORK 16384
 
 
 const char *
@@ -33,11 +41,31 @@ EDataError::what () const throw ()
 	return _("Invalid matrix data");
 }
 
+MatrixStorage::MatrixStorage () : ref_count (0), lu (NULL)
+{
+	profile_count (PROFILE_ALLOCATIONS);
+}
+
+MatrixStorage::~MatrixStorage ()
+{
+	delete lu;
+}
+
+size_t
+MatrixStorage::count_nonzero () const
+{
+	size_t count = 0;
+	for (unsigned r = 0; r < rows; r++)
+	for (unsigned c = 0; c < cols; c++)
+		if (get (r, c))
+			count++;
+	return count;
+}
+
 MatrixArrayStorage::MatrixArrayStorage (unsigned rows, unsigned cols, bool init)
 {
 	this->rows = rows;
 	this->cols = cols;
-	ref_count = 0;
 	values = new double[rows * cols];
 
 	if (init)
@@ -54,7 +82,6 @@ MatrixArrayStorage::MatrixArrayStorage (std::istream &is) throw (EDataError)
 	 || !rows || !cols)
 		throw EDataError ();
 
-	ref_count = 0;
 	values = new double[rows * cols];
 	if (!is.read ((char *) values, sizeof *values * cols * rows))
 	{
@@ -71,6 +98,7 @@ MatrixArrayStorage::~MatrixArrayStorage ()
 double
 MatrixArrayStorage::get (unsigned row, unsigned col) const
 {
+	profile_count (PROFILE_GETS);
 	if (row >= rows || col >= cols)
 		return NAN;
 
@@ -80,6 +108,7 @@ MatrixArrayStorage::get (unsigned row, unsigned col) const
 void
 MatrixArrayStorage::put (unsigned row, unsigned col, double value)
 {
+	profile_count (PROFILE_PUTS);
 	if (row >= rows || col >= cols)
 		return;
 
@@ -99,6 +128,15 @@ MatrixArrayStorage::swap_rows (unsigned row1, unsigned row2)
 	delete [] tmp;
 }
 
+size_t
+MatrixArrayStorage::count_nonzero () const
+{
+	size_t count = 0, length = (size_t) rows * cols;
+	for (size_t i = 0; i < length; i++)
+		count += values[i] != 0;
+	return count;
+}
+
 bool
 MatrixArrayStorage::serialize (std::ostream &os) const
 {
@@ -112,6 +150,7 @@ MatrixArrayStorage::clone () const
 {
 	MatrixArrayStorage *mas = new MatrixArrayStorage (rows, cols, false);
 	memcpy (mas->values, values, sizeof *values * cols * rows);
+	profile_count (PROFILE_CLONED_BYTES, sizeof *values * cols * rows);
 	return mas;
 }
 
@@ -126,7 +165,6 @@ MatrixMapStorage::MatrixMapStorage (unsigned rows, unsigned cols)
 {
 	this->rows = rows;
 	this->cols = cols;
-	ref_count = 0;
 }
 
 MatrixMapStorage::MatrixMapStorage (std::istream &is) throw (EDataError)
@@ -136,8 +174,6 @@ MatrixMapStorage::MatrixMapStorage (std::istream &is) throw (EDataError)
 	 || !rows || !cols)
 		throw EDataError ();
 
-	ref_count = 0;
-
 	/* #n_rows { row #n_cols { col value }* }* */
 	unsigned n_rows, n_cols, row, col;
 
@@ -167,6 +203,7 @@ MatrixMapStorage::MatrixMapStorage (std::istream &is) throw (EDataError)
 double
 MatrixMapStorage::get (unsigned row, unsigned col) const
 {
+	profile_count (PROFILE_GETS);
 	if (row >= rows || col >= cols)
 		return NAN;
 
@@ -183,6 +220,7 @@ MatrixMapStorage::get (unsigned row, unsigned col) const
 void
 MatrixMapStorage::put (unsigned row, unsigned col, double value)
 {
+	profile_count (PROFILE_PUTS);
 	if (row >= rows || col >= cols)
 		return;
 
@@ -203,6 +241,16 @@ MatrixMapStorage::swap_rows (unsigned row1, unsigned row2)
 	values[row2] = tmp;
 }
 
+size_t
+MatrixMapStorage::count_nonzero () const
+{
+	size_t count = 0;
+	map<unsigned, map<unsigned, double> >::const_iterator iter;
+	for (iter = values.begin (); iter != values.end (); iter++)
+		count += iter->second.size ();
+	return count;
+}
+
 bool
 MatrixMapStorage::serialize (std::ostream &os) const
 {
@@ -245,6 +293,8 @@ MatrixMapStorage::clone () const
 {
 	MatrixMapStorage *mms = new MatrixMapStorage (rows, cols);
 	mms->values = values;
+	profile_count (PROFILE_CLONED_BYTES,
+		count_nonzero () * (sizeof (unsigned) + sizeof (double)));
 	return mms;
 }
 
@@ -255,6 +305,444 @@ MatrixMapStorage::create (unsigned rows, unsigned cols) const
 }
 
 
+/** Never compact the staging buffer of MatrixCSRStorage
+ *  when it contains less values than this. */
+#define CSR_STAGED_MIN 1024
+
+MatrixCSRStorage::MatrixCSRStorage (unsigned rows, unsigned cols)
+	: row_ptr (rows + 1, 0)
+{
+	this->rows = rows;
+	this->cols = cols;
+	n_zeros = 0;
+}
+
+MatrixCSRStorage::MatrixCSRStorage (std::istream &is) throw (EDataError)
+{
+	if (!is.read ((char *) &rows, sizeof rows)
+	 || !is.read ((char *) &cols, sizeof cols)
+	 || !rows || !cols)
+		throw EDataError ();
+
+	n_zeros = 0;
+
+	/* #n_rows { row #n_cols { col value }* }*, see MatrixMapStorage. */
+	unsigned n_rows, n_cols, row, col;
+	vector<unsigned> rows_read, cols_read;
+	vector<double> vals_read;
+
+	if (!is.read ((char *) &n_rows, sizeof n_rows))
+		throw EDataError ();
+	for (unsigned r = 0; r < n_rows; r++)
+	{
+		if (!is.read ((char *) &row,    sizeof row)
+		 || !is.read ((char *) &n_cols, sizeof n_cols)
+		 || row >= rows)
+			throw EDataError ();
+
+		for (unsigned c = 0; c < n_cols; c++)
+		{
+			double value;
+			if (!is.read ((char *) &col,   sizeof col)
+			 || !is.read ((char *) &value, sizeof value)
+			 || col >= cols)
+				throw EDataError ();
+
+			if (!value)
+				continue;
+
+			rows_read.push_back (row);
+			cols_read.push_back (col);
+			vals_read.push_back (value);
+		}
+	}
+
+	/* Sort the values into rows. */
+	row_ptr.assign (rows + 1, 0);
+	for (unsigned i = 0; i < rows_read.size (); i++)
+		row_ptr[rows_read[i] + 1]++;
+	for (unsigned r = 0; r < rows; r++)
+		row_ptr[r + 1] += row_ptr[r];
+
+	vector<unsigned> fill (row_ptr.begin (), row_ptr.end () - 1);
+	col_idx.resize (vals_read.size ());
+	vals.resize (vals_read.size ());
+	for (unsigned i = 0; i < rows_read.size (); i++)
+	{
+		unsigned pos = fill[rows_read[i]]++;
+		col_idx[pos] = cols_read[i];
+		vals[pos] = vals_read[i];
+	}
+
+	/* The columns should already be in order, but we can't trust that. */
+	for (unsigned r = 0; r < rows; r++)
+		for (unsigned i = row_ptr[r] + 1; i < row_ptr[r + 1]; i++)
+		{
+			if (col_idx[i - 1] < col_idx[i])
+				continue;
+			if (col_idx[i - 1] == col_idx[i])
+				throw EDataError ();
+
+			/* Insertion sort the rest of the row, it's a rare case. */
+			for (unsigned k = i; k > row_ptr[r]
+				&& col_idx[k - 1] > col_idx[k]; k--)
+			{
+				swap (col_idx[k - 1], col_idx[k]);
+				swap (vals[k - 1], vals[k]);
+			}
+		}
+}
+
+bool
+MatrixCSRStorage::find (unsigned row, unsigned col, unsigned &pos) const
+{
+	vector<unsigned>::const_iterator
+		begin = col_idx.begin () + row_ptr[row],
+		end   = col_idx.begin () + row_ptr[row + 1],
+		iter  = lower_bound (begin, end, col);
+
+	pos = iter - col_idx.begin ();
+	return iter != end && *iter == col;
+}
+
+void
+MatrixCSRStorage::compact () const
+{
+	if (staged.empty () && !n_zeros)
+		return;
+
+	vector<unsigned> new_row_ptr (rows + 1, 0);
+	vector<unsigned> new_col_idx;
+	vector<double> new_vals;
+
+	new_col_idx.reserve (col_idx.size () - n_zeros + staged.size ());
+	new_vals.reserve (col_idx.size () - n_zeros + staged.size ());
+
+	/* Merge the two sorted sequences row by row, dropping zeros. */
+	map<pair<unsigned, unsigned>, double>::const_iterator si = staged.begin ();
+	for (unsigned r = 0; r < rows; r++)
+	{
+		unsigned i = row_ptr[r], end = row_ptr[r + 1];
+		while (i < end || (si != staged.end () && si->first.first == r))
+		{
+			if (si == staged.end () || si->first.first != r
+			 || (i < end && col_idx[i] < si->first.second))
+			{
+				if (vals[i])
+				{
+					new_col_idx.push_back (col_idx[i]);
+					new_vals.push_back (vals[i]);
+				}
+				i++;
+			}
+			else
+			{
+				new_col_idx.push_back (si->first.second);
+				new_vals.push_back (si->second);
+				si++;
+			}
+		}
+		new_row_ptr[r + 1] = new_vals.size ();
+	}
+
+	row_ptr.swap (new_row_ptr);
+	col_idx.swap (new_col_idx);
+	vals.swap (new_vals);
+
+	staged.clear ();
+	n_zeros = 0;
+}
+
+void
+MatrixCSRStorage::assign (std::vector<unsigned> &row_ptr,
+	std::vector<unsigned> &col_idx, std::vector<double> &vals)
+{
+	this->row_ptr.swap (row_ptr);
+	this->col_idx.swap (col_idx);
+	this->vals.swap (vals);
+
+	staged.clear ();
+	n_zeros = 0;
+	for (unsigned i = this->vals.size (); i--; )
+		if (!this->vals[i])
+			n_zeros++;
+}
+
+double
+MatrixCSRStorage::get (unsigned row, unsigned col) const
+{
+	profile_count (PROFILE_GETS);
+	if (row >= rows || col >= cols)
+		return NAN;
+
+	if (!staged.empty ())
+	{
+		map<pair<unsigned, unsigned>, double>::const_iterator iter
+			= staged.find (make_pair (row, col));
+		if (iter != staged.end ())
+			return iter->second;
+	}
+
+	unsigned pos;
+	if (!find (row, col, pos))
+		return 0;
+	return vals[pos];
+}
+
+void
+MatrixCSRStorage::put (unsigned row, unsigned col, double value)
+{
+	profile_count (PROFILE_PUTS);
+	if (row >= rows || col >= cols)
+		return;
+
+	/* Values already in the structure are simply overwritten. */
+	unsigned pos;
+	if (find (row, col, pos))
+	{
+		if (!vals[pos] && value)
+			n_zeros--;
+		else if (vals[pos] && !value)
+			n_zeros++;
+
+		vals[pos] = value;
+		return;
+	}
+
+	if (!value)
+	{
+		staged.erase (make_pair (row, col));
+		return;
+	}
+
+	staged[make_pair (row, col)] = value;
+	if (staged.size () > CSR_STAGED_MIN && staged.size () > vals.size () / 2)
+		compact ();
+}
+
+void
+MatrixCSRStorage::swap_rows (unsigned row1, unsigned row2)
+{
+	if (row1 >= rows || row2 >= rows || row1 == row2)
+		return;
+	if (row1 > row2)
+		swap (row1, row2);
+
+	compact ();
+
+	/* Rotate the range between the beginnings of the rows so that
+	 * the rows exchange places, then fix up the row pointers. */
+	unsigned begin1 = row_ptr[row1], end1 = row_ptr[row1 + 1];
+	unsigned begin2 = row_ptr[row2], end2 = row_ptr[row2 + 1];
+
+	rotate (col_idx.begin () + begin1,
+		col_idx.begin () + begin2, col_idx.begin () + end2);
+	rotate (vals.begin () + begin1,
+		vals.begin () + begin2, vals.begin () + end2);
+
+	unsigned len1 = end1 - begin1, len2 = end2 - begin2;
+	rotate (col_idx.begin () + begin1 + len2,
+		col_idx.begin () + begin1 + len2 + len1,
+		col_idx.begin () + end2);
+	rotate (vals.begin () + begin1 + len2,
+		vals.begin () + begin1 + len2 + len1,
+		vals.begin () + end2);
+
+	for (unsigned r = row1 + 1; r <= row2; r++)
+		row_ptr[r] += len2 - len1;
+}
+
+size_t
+MatrixCSRStorage::count_nonzero () const
+{
+	/* Only non-zero values are ever staged. */
+	return vals.size () - n_zeros + staged.size ();
+}
+
+bool
+MatrixCSRStorage::serialize (std::ostream &os) const
+{
+	compact ();
+
+	unsigned n_rows = 0, n_cols, row, col;
+	for (row = 0; row < rows; row++)
+		if (row_ptr[row] != row_ptr[row + 1])
+			n_rows++;
+
+	if (!os.write ((char *) &rows,   sizeof rows)
+	 || !os.write ((char *) &cols,   sizeof cols)
+	 || !os.write ((char *) &n_rows, sizeof n_rows))
+		return false;
+
+	for (row = 0; row < rows; row++)
+	{
+		n_cols = row_ptr[row + 1] - row_ptr[row];
+		if (!n_cols)
+			continue;
+
+		if (!os.write ((char *) &row,    sizeof row)
+		 || !os.write ((char *) &n_cols, sizeof n_cols))
+			return false;
+
+		for (unsigned i = row_ptr[row]; i < row_ptr[row + 1]; i++)
+		{
+			col = col_idx[i];
+			if (!os.write ((char *) &col,     sizeof col)
+			 || !os.write ((char *) &vals[i], sizeof vals[i]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+MatrixStorage *
+MatrixCSRStorage::clone () const
+{
+	compact ();
+
+	MatrixCSRStorage *mcs = new MatrixCSRStorage (rows, cols);
+	mcs->row_ptr = row_ptr;
+	mcs->col_idx = col_idx;
+	mcs->vals    = vals;
+	profile_count (PROFILE_CLONED_BYTES, row_ptr.size () * sizeof row_ptr[0]
+		+ col_idx.size () * sizeof col_idx[0] + vals.size () * sizeof vals[0]);
+	return mcs;
+}
+
+MatrixStorage *
+MatrixCSRStorage::create (unsigned rows, unsigned cols) const
+{
+	return new MatrixCSRStorage (rows, cols);
+}
+
+
+MatrixTransposedStorage::MatrixTransposedStorage (const Matrix &source)
+	: source (source)
+{
+	rows = source.get_storage ().get_cols ();
+	cols = source.get_storage ().get_rows ();
+}
+
+double
+MatrixTransposedStorage::get (unsigned row, unsigned col) const
+{
+	return source.get (col, row);
+}
+
+void
+MatrixTransposedStorage::put (unsigned row, unsigned col, double value)
+{
+	source.put (col, row, value);
+}
+
+void
+MatrixTransposedStorage::swap_rows (unsigned row1, unsigned row2)
+{
+	for (unsigned c = 0; c < cols; c++)
+	{
+		double value = source.get (c, row1);
+		source.put (c, row1, source.get (c, row2));
+		source.put (c, row2, value);
+	}
+}
+
+size_t
+MatrixTransposedStorage::count_nonzero () const
+{
+	return source.get_storage ().count_nonzero ();
+}
+
+bool
+MatrixTransposedStorage::serialize (std::ostream &os) const
+{
+	return Matrix (clone ()).get_storage ().serialize (os);
+}
+
+/** Size of square blocks in which dense matrices are transposed. */
+#define TRANSPOSE_BLOCK 32
+
+MatrixStorage *
+MatrixTransposedStorage::clone () const
+{
+	const MatrixStorage &ss = source.get_storage ();
+
+	/* Go through dense matrices in blocks, so that neither the reads
+	 * nor the writes jump around memory too much. */
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&ss);
+	if (mas)
+	{
+		MatrixArrayStorage *result = new MatrixArrayStorage (rows, cols, false);
+		const double *in = mas->get_values ();
+		double *out = result->get_values ();
+
+		for (unsigned r0 = 0; r0 < rows; r0 += TRANSPOSE_BLOCK)
+		for (unsigned c0 = 0; c0 < cols; c0 += TRANSPOSE_BLOCK)
+		{
+			unsigned r1 = min (r0 + TRANSPOSE_BLOCK, rows);
+			unsigned c1 = min (c0 + TRANSPOSE_BLOCK, cols);
+			for (unsigned r = r0; r < r1; r++)
+			for (unsigned c = c0; c < c1; c++)
+				out[(size_t) r * cols + c] = in[(size_t) c * rows + r];
+		}
+		profile_count (PROFILE_CLONED_BYTES, sizeof *out * rows * cols);
+		return result;
+	}
+
+	/* Columns of a compressed sparse row matrix are obtained by counting
+	 * the values in each of them and then distributing the values. */
+	const MatrixCSRStorage *mcs = dynamic_cast<const MatrixCSRStorage *> (&ss);
+	if (mcs)
+	{
+		const vector<unsigned> &s_row_ptr = mcs->get_row_ptr ();
+		const vector<unsigned> &s_col_idx = mcs->get_col_idx ();
+		const vector<double>   &s_vals    = mcs->get_vals ();
+
+		vector<unsigned> row_ptr (rows + 1, 0);
+		vector<unsigned> col_idx (s_vals.size ());
+		vector<double> vals (s_vals.size ());
+
+		for (unsigned i = 0; i < s_col_idx.size (); i++)
+			row_ptr[s_col_idx[i] + 1]++;
+		for (unsigned r = 0; r < rows; r++)
+			row_ptr[r + 1] += row_ptr[r];
+
+		vector<unsigned> next (row_ptr.begin (), row_ptr.end () - 1);
+		for (unsigned c = 0; c < cols; c++)
+			for (unsigned i = s_row_ptr[c]; i < s_row_ptr[c + 1]; i++)
+			{
+				unsigned pos = next[s_col_idx[i]]++;
+				col_idx[pos] = c;
+				vals[pos] = s_vals[i];
+			}
+
+		profile_count (PROFILE_CLONED_BYTES, row_ptr.size () * sizeof row_ptr[0]
+			+ col_idx.size () * sizeof col_idx[0] + vals.size () * sizeof vals[0]);
+
+		MatrixCSRStorage *result = new MatrixCSRStorage (rows, cols);
+		result->assign (row_ptr, col_idx, vals);
+		return result;
+	}
+
+	MatrixStorage *result = ss.create (rows, cols);
+	for (unsigned r = rows; r--; )
+	for (unsigned c = cols; c--; )
+	{
+		double value = ss.get (c, r);
+		if (value)
+			result->put (r, c, value);
+	}
+	return result;
+}
+
+MatrixStorage *
+MatrixTransposedStorage::create (unsigned rows, unsigned cols) const
+{
+	return source.get_storage ().create (rows, cols);
+}
+
+
 Matrix::Matrix (MatrixStorage *storage)
 {
 	this->storage = storage;
@@ -290,7 +778,7 @@ Matrix::get (unsigned row, unsigned col) const
 }
 
 void
-Matrix::put (unsigned row, unsigned col, double value)
+Matrix::detach ()
 {
 	if (storage->ref_count != 1)
 	{
@@ -298,10 +786,27 @@ Matrix::put (unsigned row, unsigned col, double value)
 		storage = storage->clone ();
 		storage->ref_count++;
 	}
+	else if (storage->lu)
+	{
+		delete storage->lu;
+		storage->lu = NULL;
+	}
+}
 
+void
+Matrix::put (unsigned row, unsigned col, double value)
+{
+	detach ();
 	storage->put (row, col, value);
 }
 
+void
+Matrix::swap_rows (unsigned row1, unsigned row2)
+{
+	detach ();
+	storage->swap_rows (row1, row2);
+}
+
 string *
 Matrix::get_rows (unsigned &count) const
 {
@@ -392,42 +897,448 @@ operator<< (ostream &os, const Matrix &m)
 	return os;
 }
 
-Matrix
-Matrix::operator+ (const Matrix &m) const throw (EIncompatibleMatrix)
+/** Decide whether an operation on two matrices with a result of the given
+ *  dimensions should be done out of core.  That is when either operand
+ *  already is, or when dense operands would make for a result too large.
+ *  Views are judged by the matrices they transpose. */
+static bool
+is_out_of_core (const MatrixStorage *a, const MatrixStorage *b,
+	unsigned rows, unsigned cols)
 {
-	unsigned r, rows = storage->get_rows ();
-	unsigned c, cols = storage->get_cols ();
-
-	if (m.storage->get_rows () != rows
-	 || m.storage->get_cols () != cols)
-		throw EIncompatibleMatrix
-			(_("Cannot add matrices of different dimensions"));
+	const MatrixTransposedStorage *mts;
+	if ((mts = dynamic_cast<const MatrixTransposedStorage *> (a)))
+		a = &mts->get_source ().get_storage ();
+	if ((mts = dynamic_cast<const MatrixTransposedStorage *> (b)))
+		b = &mts->get_source ().get_storage ();
+
+	if (dynamic_cast<const MatrixTiledStorage *> (a)
+	 || dynamic_cast<const MatrixTiledStorage *> (b))
+		return true;
+
+	return dynamic_cast<const MatrixArrayStorage *> (a)
+		&& dynamic_cast<const MatrixArrayStorage *> (b)
+		&& tiled_should_use (rows, cols);
+}
 
-	MatrixStorage *ms = storage->create (rows, cols);
-	for (r = rows; r--; )
-	for (c = cols; c--; )
-		ms->put (r, c, storage->get (r, c) + m.get (r, c));
-	return Matrix (ms);
+/** Add @a factor times a sparse matrix to dense @a values. */
+static void
+add_csr_to_dense (const MatrixCSRStorage &mcs, double factor, double *values)
+{
+	unsigned rows = mcs.get_rows ();
+	unsigned cols = mcs.get_cols ();
+
+	const vector<unsigned> &row_ptr = mcs.get_row_ptr ();
+	const vector<unsigned> &col_idx = mcs.get_col_idx ();
+	const vector<double>   &vals    = mcs.get_vals ();
+	for (unsigned r = 0; r < rows; r++)
+		for (unsigned i = row_ptr[r]; i < row_ptr[r + 1]; i++)
+			values[(size_t) r * cols + col_idx[i]] += factor * vals[i];
 }
 
-Matrix
-Matrix::operator- (const Matrix &m) const throw (EIncompatibleMatrix)
+/** Don't split element-wise operations into chunks doing less work
+ *  than this.  They're bound by memory bandwidth rather than arithmetics. */
+#define ELEMENTWISE_GRAIN_WORK 65536
+
+/** Compressed rows of a sparse matrix, read directly by worker threads. */
+struct SparseRows
+{
+	const unsigned *row_ptr;    //!< Beginnings of rows, plus the end.
+	const unsigned *col_idx;    //!< Column indexes of values.
+	const double *vals;         //!< The values.
+};
+
+/** Get compressed rows of @a mcs.  Has to be done before the work
+ *  is split between threads, since it may compact the storage. */
+static SparseRows
+get_sparse_rows (const MatrixCSRStorage *mcs)
 {
-	try
+	SparseRows rows = {NULL, NULL, NULL};
+	if (!mcs)
+		return rows;
+
+	rows.row_ptr = &mcs->get_row_ptr ()[0];
+	if (!mcs->get_vals ().empty ())
 	{
-		return *this + (m * -1);
+		rows.col_idx = &mcs->get_col_idx ()[0];
+		rows.vals    = &mcs->get_vals ()[0];
 	}
-	catch (const EIncompatibleMatrix &)
+	return rows;
+}
+
+/** Arguments for computing a dense sum split by rows.  Each operand
+ *  is either dense, or sparse, but not both. */
+struct AddJob
+{
+	const double *a;            //!< Dense values of the first operand.
+	const double *b;            //!< Dense values of the second operand.
+	SparseRows sa;              //!< Sparse rows of the first operand.
+	SparseRows sb;              //!< Sparse rows of the second operand.
+	double factor;              //!< Factor of the second operand.
+	double *values;             //!< The result, possibly @a a itself.
+	unsigned cols;              //!< Number of columns.
+};
+
+/** Compute a range of rows of a dense sum. */
+static void
+add_dense_task (void *data, unsigned begin, unsigned end)
+{
+	const AddJob *job = static_cast<const AddJob *> (data);
+	unsigned cols = job->cols;
+	double factor = job->factor;
+
+	for (unsigned r = begin; r < end; r++)
 	{
-		throw EIncompatibleMatrix
-			(_("Cannot subtract matrices of different dimensions"));
+		double *out = job->values + (size_t) r * cols;
+		const double *a = job->a ? job->a + (size_t) r * cols : NULL;
+		const double *b = job->b ? job->b + (size_t) r * cols : NULL;
+
+		if (a && b)
+			for (unsigned c = 0; c < cols; c++)
+				out[c] = a[c] + factor * b[c];
+		else if (a && a != out)
+			memcpy (out, a, cols * sizeof *out);
+		else if (!a)
+			for (unsigned c = 0; c < cols; c++)
+				out[c] = factor * b[c];
+
+		const SparseRows &sa = job->sa, &sb = job->sb;
+		if (sa.row_ptr)
+			for (unsigned i = sa.row_ptr[r]; i < sa.row_ptr[r + 1]; i++)
+				out[sa.col_idx[i]] += sa.vals[i];
+		if (sb.row_ptr)
+			for (unsigned i = sb.row_ptr[r]; i < sb.row_ptr[r + 1]; i++)
+				out[sb.col_idx[i]] += factor * sb.vals[i];
 	}
 }
 
-Matrix
-Matrix::operator* (const Matrix &m) const throw (EIncompatibleMatrix)
+/** Arguments for adding two sparse matrices, split by rows. */
+struct MergeJob
 {
-	if (m.storage->get_rows () != storage->get_cols ())
+	SparseRows a;               //!< The first operand.
+	SparseRows b;               //!< The second operand.
+	double factor;              //!< Factor of the second operand.
+	unsigned *row_ptr;          //!< Lengths of rows of the result when
+	                            //!< counting, their beginnings otherwise.
+	unsigned *col_idx;          //!< Column indexes of the result.
+	double *vals;               //!< Values of the result, NULL to count.
+};
+
+/** Merge a range of rows of two sparse matrices.  This is done twice,
+ *  first only to count the values in each row of the result, so that
+ *  all threads may then write into it at once. */
+static void
+merge_task (void *data, unsigned begin, unsigned end)
+{
+	const MergeJob *job = static_cast<const MergeJob *> (data);
+	const SparseRows &a = job->a, &b = job->b;
+
+	for (unsigned r = begin; r < end; r++)
+	{
+		unsigned i = a.row_ptr[r], i_end = a.row_ptr[r + 1];
+		unsigned j = b.row_ptr[r], j_end = b.row_ptr[r + 1];
+		unsigned out = job->vals ? job->row_ptr[r] : 0;
+
+		while (i < i_end || j < j_end)
+		{
+			unsigned col;
+			double value;
+
+			if (j == j_end || (i < i_end && a.col_idx[i] < b.col_idx[j]))
+			{
+				col = a.col_idx[i];
+				value = a.vals[i++];
+			}
+			else if (i == i_end || b.col_idx[j] < a.col_idx[i])
+			{
+				col = b.col_idx[j];
+				value = job->factor * b.vals[j++];
+			}
+			else
+			{
+				col = a.col_idx[i];
+				value = a.vals[i++] + job->factor * b.vals[j++];
+			}
+
+			if (!value)
+				continue;
+			if (job->vals)
+			{
+				job->col_idx[out] = col;
+				job->vals[out] = value;
+			}
+			out++;
+		}
+
+		if (!job->vals)
+			job->row_ptr[r + 1] = out;
+	}
+}
+
+/** Add two sparse matrices, merging their rows into @a out,
+ *  which may be either of them. */
+static void
+add_csr_csr (const MatrixCSRStorage &a, const MatrixCSRStorage &b,
+	double factor, MatrixCSRStorage &out)
+{
+	unsigned rows = a.get_rows ();
+	vector<unsigned> row_ptr (rows + 1, 0), col_idx;
+	vector<double> vals;
+
+	MergeJob job;
+	job.a = get_sparse_rows (&a);
+	job.b = get_sparse_rows (&b);
+	job.factor = factor;
+	job.row_ptr = &row_ptr[0];
+	job.col_idx = NULL;
+	job.vals = NULL;
+
+	/* Both passes go through all values of both operands. */
+	size_t work = a.get_vals ().size () + b.get_vals ().size ();
+	unsigned grain = ELEMENTWISE_GRAIN_WORK / (work / rows + 1) + 1;
+
+	ThreadPool &pool = ThreadPool::get ();
+	pool.run (merge_task, &job, rows, grain);
+	for (unsigned r = 0; r < rows; r++)
+		row_ptr[r + 1] += row_ptr[r];
+
+	if (row_ptr[rows])
+	{
+		col_idx.resize (row_ptr[rows]);
+		vals.resize (row_ptr[rows]);
+		job.col_idx = &col_idx[0];
+		job.vals = &vals[0];
+		pool.run (merge_task, &job, rows, grain);
+	}
+
+	out.assign (row_ptr, col_idx, vals);
+}
+
+/** Compute @a a + @a factor * @a b, which must have the same dimensions,
+ *  using a kernel suited for the kinds of their storage. */
+static Matrix
+add_scaled (const Matrix &a, const Matrix &b, double factor)
+{
+	const MatrixStorage &as = a.get_storage ();
+	const MatrixStorage &bs = b.get_storage ();
+	unsigned r, rows = as.get_rows ();
+	unsigned c, cols = as.get_cols ();
+
+	const MatrixArrayStorage *da = dynamic_cast<const MatrixArrayStorage *> (&as);
+	const MatrixArrayStorage *db = dynamic_cast<const MatrixArrayStorage *> (&bs);
+	const MatrixCSRStorage   *sa = dynamic_cast<const MatrixCSRStorage   *> (&as);
+	const MatrixCSRStorage   *sb = dynamic_cast<const MatrixCSRStorage   *> (&bs);
+
+	/* Whenever one of the operands is dense, so is the result. */
+	if ((da && (db || sb)) || (sa && db))
+	{
+		MatrixArrayStorage *mas = new MatrixArrayStorage (rows, cols, false);
+
+		AddJob job;
+		job.a = da ? da->get_values () : NULL;
+		job.b = db ? db->get_values () : NULL;
+		job.sa = get_sparse_rows (sa);
+		job.sb = get_sparse_rows (sb);
+		job.factor = factor;
+		job.values = mas->get_values ();
+		job.cols = cols;
+
+		ThreadPool::get ().run (add_dense_task, &job, rows,
+			ELEMENTWISE_GRAIN_WORK / cols + 1);
+		return Matrix (mas);
+	}
+	if (sa && sb)
+	{
+		MatrixCSRStorage *mcs = new MatrixCSRStorage (rows, cols);
+		add_csr_csr (*sa, *sb, factor, *mcs);
+		return Matrix (mcs);
+	}
+
+	MatrixStorage *ms = as.create (rows, cols);
+	for (r = rows; r--; )
+	for (c = cols; c--; )
+		ms->put (r, c, as.get (r, c) + factor * bs.get (r, c));
+	return Matrix (ms);
+}
+
+Matrix
+Matrix::operator+ (const Matrix &m) const throw (EIncompatibleMatrix)
+{
+	unsigned rows = storage->get_rows ();
+	unsigned cols = storage->get_cols ();
+
+	if (m.storage->get_rows () != rows
+	 || m.storage->get_cols () != cols)
+		throw EIncompatibleMatrix
+			(_("Cannot add matrices of different dimensions"));
+
+	if (is_out_of_core (storage, m.storage, rows, cols))
+		return tiled_add (*this, m, 1);
+	return add_scaled (*this, m, 1).adapt ();
+}
+
+Matrix
+Matrix::operator- (const Matrix &m) const throw (EIncompatibleMatrix)
+{
+	unsigned rows = storage->get_rows ();
+	unsigned cols = storage->get_cols ();
+
+	if (m.storage->get_rows () != rows
+	 || m.storage->get_cols () != cols)
+		throw EIncompatibleMatrix
+			(_("Cannot subtract matrices of different dimensions"));
+
+	if (is_out_of_core (storage, m.storage, rows, cols))
+		return tiled_add (*this, m, -1);
+	return add_scaled (*this, m, -1).adapt ();
+}
+
+/** Multiply two sparse matrices, only going through their non-zero values.
+ *  Rows of the result are gathered in a dense accumulator. */
+static MatrixStorage *
+multiply_csr_csr (const MatrixCSRStorage &a, const MatrixCSRStorage &b)
+{
+	unsigned rows = a.get_rows ();
+	unsigned cols = b.get_cols ();
+
+	const vector<unsigned> &a_row_ptr = a.get_row_ptr ();
+	const vector<unsigned> &a_col_idx = a.get_col_idx ();
+	const vector<double>   &a_vals    = a.get_vals ();
+	const vector<unsigned> &b_row_ptr = b.get_row_ptr ();
+	const vector<unsigned> &b_col_idx = b.get_col_idx ();
+	const vector<double>   &b_vals    = b.get_vals ();
+
+	vector<unsigned> row_ptr (rows + 1, 0), col_idx;
+	vector<double> vals;
+
+	vector<double> acc (cols);
+	vector<unsigned> mark (cols, rows), touched;
+
+	for (unsigned r = 0; r < rows; r++)
+	{
+		touched.clear ();
+		for (unsigned i = a_row_ptr[r]; i < a_row_ptr[r + 1]; i++)
+		{
+			unsigned k = a_col_idx[i];
+			double value = a_vals[i];
+
+			for (unsigned j = b_row_ptr[k]; j < b_row_ptr[k + 1]; j++)
+			{
+				unsigned c = b_col_idx[j];
+				if (mark[c] != r)
+				{
+					mark[c] = r;
+					acc[c] = 0;
+					touched.push_back (c);
+				}
+				acc[c] += value * b_vals[j];
+			}
+		}
+
+		sort (touched.begin (), touched.end ());
+		for (unsigned i = 0; i < touched.size (); i++)
+			if (acc[touched[i]])
+			{
+				col_idx.push_back (touched[i]);
+				vals.push_back (acc[touched[i]]);
+			}
+		row_ptr[r + 1] = vals.size ();
+	}
+
+	MatrixCSRStorage *ms = new MatrixCSRStorage (rows, cols);
+	ms->assign (row_ptr, col_idx, vals);
+	return ms;
+}
+
+/** Multiply a sparse matrix with a dense one, only going through
+ *  the non-zero values of the former. */
+static MatrixStorage *
+multiply_csr_dense (const MatrixCSRStorage &a, const MatrixArrayStorage &b)
+{
+	unsigned rows = a.get_rows ();
+	unsigned cols = b.get_cols ();
+
+	const vector<unsigned> &a_row_ptr = a.get_row_ptr ();
+	const vector<unsigned> &a_col_idx = a.get_col_idx ();
+	const vector<double>   &a_vals    = a.get_vals ();
+	const double           *b_vals    = b.get_values ();
+
+	vector<unsigned> row_ptr (rows + 1, 0), col_idx;
+	vector<double> vals;
+	vector<double> acc (cols);
+
+	for (unsigned r = 0; r < rows; r++)
+	{
+		fill (acc.begin (), acc.end (), 0.);
+		for (unsigned i = a_row_ptr[r]; i < a_row_ptr[r + 1]; i++)
+		{
+			const double *b_row = b_vals + (size_t) a_col_idx[i] * cols;
+			double value = a_vals[i];
+			for (unsigned c = 0; c < cols; c++)
+				acc[c] += value * b_row[c];
+		}
+
+		for (unsigned c = 0; c < cols; c++)
+			if (acc[c])
+			{
+				col_idx.push_back (c);
+				vals.push_back (acc[c]);
+			}
+		row_ptr[r + 1] = vals.size ();
+	}
+
+	MatrixCSRStorage *ms = new MatrixCSRStorage (rows, cols);
+	ms->assign (row_ptr, col_idx, vals);
+	return ms;
+}
+
+/** Find out whether @a ms is dense, or a view of a dense matrix,
+ *  in which case @a transposed gets set. */
+static const MatrixArrayStorage *
+get_dense_source (const MatrixStorage *ms, bool &transposed)
+{
+	const MatrixTransposedStorage *mts =
+		dynamic_cast<const MatrixTransposedStorage *> (ms);
+	if ((transposed = (mts != NULL)))
+		ms = &mts->get_source ().get_storage ();
+	return dynamic_cast<const MatrixArrayStorage *> (ms);
+}
+
+/** Multiply a dense matrix with a sparse one, adding rows of the latter
+ *  for each non-zero value in a row of the former. */
+static MatrixStorage *
+multiply_dense_csr (const MatrixArrayStorage &a, const MatrixCSRStorage &b)
+{
+	unsigned rows = a.get_rows ();
+	unsigned cols = b.get_cols ();
+	unsigned size = a.get_cols ();
+
+	const double           *a_vals    = a.get_values ();
+	const vector<unsigned> &b_row_ptr = b.get_row_ptr ();
+	const vector<unsigned> &b_col_idx = b.get_col_idx ();
+	const vector<double>   &b_vals    = b.get_vals ();
+
+	MatrixArrayStorage *mas = new MatrixArrayStorage (rows, cols);
+	double *values = mas->get_values ();
+
+	for (unsigned r = 0; r < rows; r++)
+	{
+		const double *a_row = a_vals + (size_t) r * size;
+		double *row = values + (size_t) r * cols;
+		for (unsigned k = 0; k < size; k++)
+		{
+			double value = a_row[k];
+			if (value)
+				for (unsigned i = b_row_ptr[k]; i < b_row_ptr[k + 1]; i++)
+					row[b_col_idx[i]] += value * b_vals[i];
+		}
+	}
+	return mas;
+}
+
+Matrix
+Matrix::operator* (const Matrix &m) const throw (EIncompatibleMatrix)
+{
+	if (m.storage->get_rows () != storage->get_cols ())
 		throw EIncompatibleMatrix
 			(_("The matrix has wrong number of rows for multiplication"));
 
@@ -435,16 +1346,83 @@ Matrix::operator* (const Matrix &m) const throw (EIncompatibleMatrix)
 	unsigned c, cols = m.storage->get_cols ();
 	unsigned s, size =   storage->get_cols ();
 
-	MatrixStorage *ms = storage->create (rows, cols);
+	if (is_out_of_core (storage, m.storage, rows, cols))
+		return tiled_multiply (*this, m);
+
+	/* Dense operands get a specialised kernel working on raw data,
+	 * which can also read them transposed. */
+	bool ta, tb;
+	const MatrixArrayStorage *a = get_dense_source (storage, ta);
+	const MatrixArrayStorage *b = get_dense_source (m.storage, tb);
+	if (a && b)
+	{
+		MatrixArrayStorage *mas = new MatrixArrayStorage (rows, cols, false);
+		strassen (ta, tb, rows, cols, size, a->get_values (), a->get_cols (),
+			b->get_values (), b->get_cols (), mas->get_values (), cols);
+		return Matrix (mas).adapt ();
+	}
+
+	/* Sparse operands only need to go through their non-zero values.
+	 * Views of them are stored by columns and need to be converted first,
+	 * which is still linear in the number of non-zero values.  Everything
+	 * else goes through the generic interface of the converted storage. */
+	Matrix ma = materialize (), mb = m.materialize ();
+	const MatrixCSRStorage *sa =
+		dynamic_cast<const MatrixCSRStorage *> (ma.storage);
+	const MatrixCSRStorage *sb =
+		dynamic_cast<const MatrixCSRStorage *> (mb.storage);
+	const MatrixArrayStorage *da =
+		dynamic_cast<const MatrixArrayStorage *> (ma.storage);
+	const MatrixArrayStorage *db =
+		dynamic_cast<const MatrixArrayStorage *> (mb.storage);
+	if (sa && sb)
+		return Matrix (multiply_csr_csr (*sa, *sb)).adapt ();
+	if (sa && db)
+		return Matrix (multiply_csr_dense (*sa, *db)).adapt ();
+	if (da && sb)
+		return Matrix (multiply_dense_csr (*da, *sb)).adapt ();
+
+	MatrixStorage *ms = ma.storage->create (rows, cols);
 	for (r = rows; r--; )
 	for (c = cols; c--; )
 	{
 		double sum = 0;
 		for (s = size; s--; )
-			sum += storage->get (r, s) * m.get (s, c);
+			sum += ma.storage->get (r, s) * mb.storage->get (s, c);
 		ms->put (r, c, sum);
 	}
-	return Matrix (ms);
+	return Matrix (ms).adapt ();
+}
+
+/** Arguments for multiplying values by a constant, split into ranges. */
+struct ScaleJob
+{
+	const double *source;       //!< The values.
+	double *values;             //!< The result.
+	double factor;              //!< The constant.
+};
+
+/** Multiply a range of values by a constant. */
+static void
+scale_task (void *data, unsigned begin, unsigned end)
+{
+	const ScaleJob *job = static_cast<const ScaleJob *> (data);
+	for (unsigned i = begin; i < end; i++)
+		job->values[i] = job->factor * job->source[i];
+}
+
+/** Multiply @a n values in @a source by @a factor into @a values. */
+static void
+scale_values (const double *source, double *values, size_t n, double factor)
+{
+	/* Tasks can only index so many values, go by large chunks. */
+	static const size_t chunk = 1U << 30;
+	for (size_t offset = 0; offset < n; offset += chunk)
+	{
+		ScaleJob job = {source + offset, values + offset, factor};
+		ThreadPool::get ().run (scale_task, &job,
+			min (chunk, n - offset), ELEMENTWISE_GRAIN_WORK);
+	}
 }
 
 Matrix
@@ -453,6 +1431,35 @@ Matrix::operator* (double n) const
 	unsigned r, rows = storage->get_rows ();
 	unsigned c, cols = storage->get_cols ();
 
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (storage);
+	if (mas)
+	{
+		MatrixArrayStorage *result = new MatrixArrayStorage (rows, cols, false);
+		scale_values (mas->get_values (), result->get_values (),
+			(size_t) rows * cols, n);
+		return Matrix (result);
+	}
+
+	/* The structure stays the same, unless everything becomes zero. */
+	const MatrixCSRStorage *mcs =
+		dynamic_cast<const MatrixCSRStorage *> (storage);
+	if (mcs)
+	{
+		MatrixCSRStorage *result = new MatrixCSRStorage (rows, cols);
+		if (!n)
+			return Matrix (result);
+
+		vector<unsigned> row_ptr (mcs->get_row_ptr ());
+		vector<unsigned> col_idx (mcs->get_col_idx ());
+		vector<double> vals (mcs->get_vals ().size ());
+		if (!vals.empty ())
+			scale_values (&mcs->get_vals ()[0], &vals[0], vals.size (), n);
+
+		result->assign (row_ptr, col_idx, vals);
+		return Matrix (result);
+	}
+
 	MatrixStorage *ms = storage->create (rows, cols);
 	for (r = rows; r--; )
 	for (c = cols; c--; )
@@ -460,24 +1467,669 @@ Matrix::operator* (double n) const
 	return Matrix (ms);
 }
 
+Matrix &
+Matrix::operator*= (double n)
+{
+	MatrixArrayStorage *mas = dynamic_cast<MatrixArrayStorage *> (storage);
+	MatrixCSRStorage   *mcs = dynamic_cast<MatrixCSRStorage   *> (storage);
+	if (storage->ref_count != 1 || (!mas && !mcs))
+		return *this = *this * n;
+
+	detach ();
+	if (mas)
+	{
+		scale_values (mas->get_values (), mas->get_values (),
+			(size_t) storage->get_rows () * storage->get_cols (), n);
+		return *this;
+	}
+
+	/* Take the compressed structure out and put it back, so that
+	 * the storage gets to count zeros that have appeared. */
+	vector<unsigned> row_ptr, col_idx;
+	vector<double> vals;
+	mcs->compact ();
+	mcs->assign (row_ptr, col_idx, vals);
+
+	if (!n)
+	{
+		row_ptr.assign (row_ptr.size (), 0);
+		col_idx.clear ();
+		vals.clear ();
+	}
+	else if (!vals.empty ())
+		scale_values (&vals[0], &vals[0], vals.size (), n);
+
+	mcs->assign (row_ptr, col_idx, vals);
+	return *this;
+}
+
+/** Raise a dense square matrix to a positive power by repeated squaring.
+ *  All the intermediate results share three preallocated buffers. */
+static Matrix
+power_dense (const MatrixArrayStorage &mas, unsigned long exponent)
+{
+	unsigned size = mas.get_rows ();
+	size_t length = (size_t) size * size;
+
+	MatrixArrayStorage *result = new MatrixArrayStorage (size, size, false);
+	double *r = result->get_values ();
+	double *b = new double[length];
+	double *t = new double[length];
+	copy (mas.get_values (), mas.get_values () + length, b);
+
+	bool first = true;
+	while (1)
+	{
+		if (exponent & 1)
+		{
+			if (first)
+				copy (b, b + length, r);
+			else
+			{
+				strassen (false, false, size, size, size,
+					r, size, b, size, t, size);
+				copy (t, t + length, r);
+			}
+			first = false;
+		}
+		if (!(exponent >>= 1))
+			break;
+
+		strassen (false, false, size, size, size, b, size, b, size, t, size);
+		swap (b, t);
+	}
+
+	delete [] b;
+	delete [] t;
+	return Matrix (result);
+}
+
+Matrix
+Matrix::power (unsigned long exponent) const throw (EIncompatibleMatrix)
+{
+	unsigned size = storage->get_rows ();
+	if (exponent == 1)
+		return *this;
+	if (size != storage->get_cols ())
+		throw EIncompatibleMatrix
+			(_("Only square matrices can be raised to a power"));
+
+	if (!exponent)
+	{
+		MatrixStorage *ms = storage->create (size, size);
+		for (unsigned s = 0; s < size; s++)
+			ms->put (s, s, 1);
+		return Matrix (ms);
+	}
+
+	const MatrixTransposedStorage *mts =
+		dynamic_cast<const MatrixTransposedStorage *> (storage);
+	if (mts)
+		return mts->get_source ().power (exponent).transpose ();
+
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (storage);
+	if (mas)
+		return power_dense (*mas, exponent);
+
+	Matrix base (*this);
+	while (!(exponent & 1))
+	{
+		base = base * base;
+		exponent >>= 1;
+	}
+
+	Matrix result (base);
+	while (exponent >>= 1)
+	{
+		base = base * base;
+		if (exponent & 1)
+			result = result * base;
+	}
+	return result;
+}
+
 Matrix
 Matrix::transpose () const
 {
-	unsigned r, rows = storage->get_rows ();
-	unsigned c, cols = storage->get_cols ();
+	const MatrixTransposedStorage *mts =
+		dynamic_cast<const MatrixTransposedStorage *> (storage);
+	if (mts)
+		return mts->get_source ();
+	return Matrix (new MatrixTransposedStorage (*this));
+}
 
-	MatrixStorage *ms = storage->create (cols, rows);
-	for (r = rows; r--; )
-	for (c = cols; c--; )
-		ms->put (c, r, storage->get (r, c));
-	return Matrix (ms);
+Matrix
+Matrix::materialize () const
+{
+	if (dynamic_cast<const MatrixTransposedStorage *> (storage))
+		return Matrix (storage->clone ());
+	return *this;
+}
+
+/** Matrices with less values than this are never converted by adapt(). */
+#define ADAPT_MIN_VALUES 4096
+
+bool Matrix::adaptive = true;
+double Matrix::sparse_density = 0.1;
+double Matrix::dense_density = 0.3;
+
+/** Copy values from any kind of storage into compressed sparse rows. */
+static MatrixStorage *
+convert_to_csr (const MatrixStorage &ms)
+{
+	unsigned rows = ms.get_rows ();
+	unsigned cols = ms.get_cols ();
+
+	vector<unsigned> row_ptr (rows + 1, 0), col_idx;
+	vector<double> vals;
+	size_t count = ms.count_nonzero ();
+	col_idx.reserve (count);
+	vals.reserve (count);
+
+	/* Maps only have to be walked through, there may be lots of rows. */
+	const MatrixMapStorage *mms = dynamic_cast<const MatrixMapStorage *> (&ms);
+	if (mms)
+	{
+		typedef map<unsigned, map<unsigned, double> > RowMap;
+		const RowMap &values = mms->get_values ();
+		for (RowMap::const_iterator row = values.begin ();
+			row != values.end (); row++)
+		{
+			for (map<unsigned, double>::const_iterator iter =
+				row->second.begin (); iter != row->second.end (); iter++)
+				if (iter->second)
+				{
+					col_idx.push_back (iter->first);
+					vals.push_back (iter->second);
+				}
+			row_ptr[row->first + 1] = vals.size ();
+		}
+		for (unsigned r = 0; r < rows; r++)
+			row_ptr[r + 1] = max (row_ptr[r + 1], row_ptr[r]);
+	}
+
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&ms);
+	for (unsigned r = 0; !mms && r < rows; r++)
+	{
+		const double *row = mas ? mas->get_values () + (size_t) r * cols : 0;
+		for (unsigned c = 0; c < cols; c++)
+		{
+			double value = row ? row[c] : ms.get (r, c);
+			if (value)
+			{
+				col_idx.push_back (c);
+				vals.push_back (value);
+			}
+		}
+		row_ptr[r + 1] = vals.size ();
+	}
+
+	MatrixCSRStorage *result = new MatrixCSRStorage (rows, cols);
+	result->assign (row_ptr, col_idx, vals);
+	return result;
+}
+
+/** Copy values from any kind of storage into an array. */
+static MatrixStorage *
+convert_to_dense (const MatrixStorage &ms)
+{
+	unsigned rows = ms.get_rows ();
+	unsigned cols = ms.get_cols ();
+
+	MatrixArrayStorage *result = new MatrixArrayStorage (rows, cols);
+	double *values = result->get_values ();
+
+	const MatrixCSRStorage *mcs = dynamic_cast<const MatrixCSRStorage *> (&ms);
+	if (mcs)
+		add_csr_to_dense (*mcs, 1, values);
+	else
+		for (unsigned r = 0; r < rows; r++)
+		for (unsigned c = 0; c < cols; c++)
+			values[(size_t) r * cols + c] = ms.get (r, c);
+	return result;
+}
+
+Matrix
+Matrix::adapt () const
+{
+	size_t size = (size_t) storage->get_rows () * storage->get_cols ();
+	if (!adaptive || size < ADAPT_MIN_VALUES)
+		return *this;
+
+	/* Views and matrices kept out of core are left alone. */
+	bool dense = dynamic_cast<const MatrixArrayStorage *> (storage);
+	bool csr   = dynamic_cast<const MatrixCSRStorage   *> (storage);
+	bool map   = dynamic_cast<const MatrixMapStorage   *> (storage);
+	if (!dense && !csr && !map)
+		return *this;
+
+	double density = (double) storage->count_nonzero () / size;
+	if (dense && density < sparse_density)
+		return Matrix (convert_to_csr (*storage));
+	if (!dense && density > dense_density)
+		return Matrix (convert_to_dense (*storage));
+
+	/* Compressed rows are always cheaper than maps. */
+	if (map)
+		return Matrix (convert_to_csr (*storage));
+	return *this;
+}
+
+Matrix
+Matrix::compress () const
+{
+	Matrix m = materialize ();
+	if (dynamic_cast<const MatrixCSRStorage *> (m.storage))
+		return m;
+	return Matrix (convert_to_csr (*m.storage));
+}
+
+/** Size of square tiles of the result computed by matrix_combine(). */
+#define COMBINE_TILE 64
+
+/** Don't split linear combinations into chunks doing less work than this. */
+#define COMBINE_GRAIN_WORK 65536
+
+/** Arguments for computing a linear combination of dense matrices. */
+struct CombineJob
+{
+	const vector<MatrixTerm> *terms;  //!< The terms.
+	double *values;             //!< The result.
+	unsigned rows;              //!< Number of rows of the result.
+	unsigned cols;              //!< Number of columns of the result.
+	unsigned tile_cols;         //!< Number of tiles in a row.
+	bool accumulate;            //!< Add to the result instead of
+	                            //!< overwriting it.
+};
+
+/** Compute a range of tiles of a linear combination.  Each tile stays
+ *  in the cache while all the terms are being added into it. */
+static void
+combine_task (void *data, unsigned begin, unsigned end)
+{
+	CombineJob *job = static_cast<CombineJob *> (data);
+	for (unsigned t = begin; t < end; t++)
+	{
+		unsigned r0 = t / job->tile_cols * COMBINE_TILE;
+		unsigned c0 = t % job->tile_cols * COMBINE_TILE;
+		unsigned r1 = min (r0 + COMBINE_TILE, job->rows);
+		unsigned c1 = min (c0 + COMBINE_TILE, job->cols);
+
+		for (unsigned k = 0; k < job->terms->size (); k++)
+		{
+			const MatrixTerm &term = (*job->terms)[k];
+			const double *source = static_cast<const MatrixArrayStorage &>
+				(term.matrix.get_storage ()).get_values ();
+			double factor = term.factor;
+
+			if (!term.transposed)
+			{
+				for (unsigned r = r0; r < r1; r++)
+				{
+					double *row = job->values + (size_t) r * job->cols;
+					const double *in = source + (size_t) r * job->cols;
+					if (!k && !job->accumulate)
+						for (unsigned c = c0; c < c1; c++)
+							row[c] = factor * in[c];
+					else
+						for (unsigned c = c0; c < c1; c++)
+							row[c] += factor * in[c];
+				}
+				continue;
+			}
+
+			/* The source is stored with its rows being our columns. */
+			for (unsigned c = c0; c < c1; c++)
+			{
+				const double *in = source + (size_t) c * job->rows;
+				for (unsigned r = r0; r < r1; r++)
+				{
+					double *out = job->values + (size_t) r * job->cols + c;
+					if (!k && !job->accumulate)
+						*out = factor * in[r];
+					else
+						*out += factor * in[r];
+				}
+			}
+		}
+	}
+}
+
+Matrix
+matrix_combine (const vector<MatrixTerm> &terms)
+{
+	/* Views are replaced by the matrices they transpose, so that dense
+	 * ones can be read directly. */
+	for (unsigned k = 0; k < terms.size (); k++)
+	{
+		const MatrixTransposedStorage *mts =
+			dynamic_cast<const MatrixTransposedStorage *>
+			(&terms[k].matrix.get_storage ());
+		if (!mts)
+			continue;
+
+		vector<MatrixTerm> unwrapped (terms);
+		unwrapped[k].matrix = mts->get_source ();
+		unwrapped[k].transposed = !terms[k].transposed;
+		return matrix_combine (unwrapped);
+	}
+
+	const MatrixTerm &first = terms[0];
+	const MatrixStorage &fs = first.matrix.get_storage ();
+	unsigned rows = first.transposed ? fs.get_cols () : fs.get_rows ();
+	unsigned cols = first.transposed ? fs.get_rows () : fs.get_cols ();
+
+	bool dense = !tiled_should_use (rows, cols);
+	for (unsigned k = 0; k < terms.size (); k++)
+		if (!dynamic_cast<const MatrixArrayStorage *>
+			(&terms[k].matrix.get_storage ()))
+			dense = false;
+
+	/* Other kinds of storage, and results that should be kept out of core,
+	 * go through the usual operations, the first term deciding about
+	 * the kind of the result. */
+	if (!dense)
+	{
+		Matrix result = first.transposed
+			? first.matrix.transpose () : first.matrix;
+		if (first.factor != 1)
+			result = result * first.factor;
+
+		for (unsigned k = 1; k < terms.size (); k++)
+		{
+			const MatrixTerm &term = terms[k];
+			Matrix m = term.transposed ? term.matrix.transpose () : term.matrix;
+			if (term.factor == -1)
+				result = result - m;
+			else if (term.factor == 1)
+				result = result + m;
+			else
+				result = result + m * term.factor;
+		}
+		return result;
+	}
+
+	MatrixArrayStorage *mas = new MatrixArrayStorage (rows, cols, false);
+
+	CombineJob job;
+	job.terms = &terms;
+	job.values = mas->get_values ();
+	job.rows = rows;
+	job.cols = cols;
+	job.tile_cols = (cols + COMBINE_TILE - 1) / COMBINE_TILE;
+	job.accumulate = false;
+
+	unsigned tiles = (rows + COMBINE_TILE - 1) / COMBINE_TILE * job.tile_cols;
+	ThreadPool::get ().run (combine_task, &job, tiles, COMBINE_GRAIN_WORK
+		/ (COMBINE_TILE * COMBINE_TILE * terms.size ()) + 1);
+	return Matrix (mas).adapt ();
+}
+
+/** Add a linear combination of @a terms to dense @a values in place.
+ *  Views must have been replaced by the matrices they transpose, and only
+ *  dense matrices may be transposed.  Runs of dense terms are added
+ *  in a single pass, sparse terms one by one. */
+static void
+accumulate_dense (double *values, unsigned rows, unsigned cols,
+	const vector<MatrixTerm> &terms)
+{
+	ThreadPool &pool = ThreadPool::get ();
+	for (unsigned k = 0; k < terms.size (); )
+	{
+		const MatrixCSRStorage *mcs = dynamic_cast<const MatrixCSRStorage *>
+			(&terms[k].matrix.get_storage ());
+		if (mcs)
+		{
+			AddJob job;
+			job.a = values;
+			job.b = NULL;
+			job.sa = get_sparse_rows (NULL);
+			job.sb = get_sparse_rows (mcs);
+			job.factor = terms[k++].factor;
+			job.values = values;
+			job.cols = cols;
+
+			pool.run (add_dense_task, &job, rows,
+				ELEMENTWISE_GRAIN_WORK / cols + 1);
+			continue;
+		}
+
+		vector<MatrixTerm> run;
+		while (k < terms.size () && !dynamic_cast<const MatrixCSRStorage *>
+			(&terms[k].matrix.get_storage ()))
+			run.push_back (terms[k++]);
+
+		CombineJob job;
+		job.terms = &run;
+		job.values = values;
+		job.rows = rows;
+		job.cols = cols;
+		job.tile_cols = (cols + COMBINE_TILE - 1) / COMBINE_TILE;
+		job.accumulate = true;
+
+		unsigned tiles = (rows + COMBINE_TILE - 1) / COMBINE_TILE * job.tile_cols;
+		pool.run (combine_task, &job, tiles, COMBINE_GRAIN_WORK
+			/ (COMBINE_TILE * COMBINE_TILE * run.size ()) + 1);
+	}
+}
+
+Matrix &
+Matrix::accumulate (const vector<MatrixTerm> &terms) throw (EIncompatibleMatrix)
+{
+	unsigned rows = storage->get_rows ();
+	unsigned cols = storage->get_cols ();
+
+	for (unsigned k = 0; k < terms.size (); k++)
+	{
+		const MatrixStorage &ms = terms[k].matrix.get_storage ();
+		bool transposed = terms[k].transposed;
+		if ((transposed ? ms.get_cols () : ms.get_rows ()) != rows
+		 || (transposed ? ms.get_rows () : ms.get_cols ()) != cols)
+			throw EIncompatibleMatrix
+				(_("Cannot add matrices of different dimensions"));
+	}
+
+	/* Terms referring to this matrix, views included, make the storage
+	 * shared, so that it's never changed while still being read. */
+	bool shared = storage->ref_count != 1;
+
+	/* Views are replaced by the matrices they transpose, so that the storage
+	 * can be read directly.  Dense matrices may take any dense terms,
+	 * and sparse terms as long as they don't need to be transposed,
+	 * sparse matrices only the latter. */
+	vector<MatrixTerm> unwrapped (terms);
+	bool to_dense = true, to_sparse = true;
+	for (unsigned k = 0; k < unwrapped.size (); k++)
+	{
+		MatrixTerm &term = unwrapped[k];
+		const MatrixTransposedStorage *mts =
+			dynamic_cast<const MatrixTransposedStorage *>
+			(&term.matrix.get_storage ());
+		if (mts)
+		{
+			term.matrix = mts->get_source ();
+			term.transposed = !term.transposed;
+		}
+
+		const MatrixStorage *ms = &term.matrix.get_storage ();
+		bool csr = !term.transposed
+			&& dynamic_cast<const MatrixCSRStorage *> (ms);
+		if (!csr && !dynamic_cast<const MatrixArrayStorage *> (ms))
+			to_dense = false;
+		if (!csr)
+			to_sparse = false;
+	}
+
+	MatrixArrayStorage *mas = dynamic_cast<MatrixArrayStorage *> (storage);
+	MatrixCSRStorage   *mcs = dynamic_cast<MatrixCSRStorage   *> (storage);
+	if (!shared && mas && to_dense)
+	{
+		detach ();
+		accumulate_dense (mas->get_values (), rows, cols, unwrapped);
+	}
+	else if (!shared && mcs && to_sparse)
+	{
+		detach ();
+		for (unsigned k = 0; k < unwrapped.size (); k++)
+		{
+			const MatrixTerm &term = unwrapped[k];
+			add_csr_csr (*mcs, static_cast<const MatrixCSRStorage &>
+				(term.matrix.get_storage ()), term.factor, *mcs);
+		}
+	}
+	else
+	{
+		unwrapped.insert (unwrapped.begin (), MatrixTerm (*this));
+		*this = matrix_combine (unwrapped);
+	}
+	return *this;
+}
+
+/** Arguments for parallel row operations on dense matrices. */
+struct RowJob
+{
+	double *values;             //!< The matrix.
+	unsigned cols;              //!< Number of columns.
+	unsigned pivot;             //!< Row to subtract from others.
+	unsigned col;               //!< Column of the pivot.
+	unsigned first;             //!< The first row to work on.
+	unsigned from;              //!< The first column to subtract.
+	double tiny;                //!< Results this small become zeros.
+};
+
+/** Subtract the pivot from a range of rows, zeroing the pivot's column. */
+static void
+eliminate_rows_task (void *data, unsigned begin, unsigned end)
+{
+	RowJob *job = static_cast<RowJob *> (data);
+	const double *pivot_row = job->values + (size_t) job->pivot * job->cols;
+	double pivot = pivot_row[job->col];
+
+	for (unsigned r = job->first + begin; r < job->first + end; r++)
+	{
+		double *row = job->values + (size_t) r * job->cols;
+		double factor = row[job->col] / pivot;
+		if (!factor)
+			continue;
+
+		row[job->col] = 0;
+		for (unsigned c = job->from; c < job->cols; c++)
+		{
+			double value = row[c] - pivot_row[c] * factor;
+			row[c] = fabs (value) <= job->tiny ? 0 : value;
+		}
+	}
+}
+
+/** Get the magnitude below which values computed in eliminating @a ms
+ *  are indistinguishable from rounding errors, the same way lu_tolerance()
+ *  does, so that the rank doesn't depend on the scale of the matrix. */
+static double
+eliminate_tolerance (const MatrixStorage &ms)
+{
+	unsigned rows = ms.get_rows (), cols = ms.get_cols ();
+	double value_max = 0;
+
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&ms);
+	const MatrixCSRStorage *mcs =
+		dynamic_cast<const MatrixCSRStorage *> (&ms);
+	if (mas)
+	{
+		const double *values = mas->get_values ();
+		for (size_t i = 0; i < (size_t) rows * cols; i++)
+			value_max = max (value_max, fabs (values[i]));
+	}
+	else if (mcs)
+	{
+		const vector<double> &vals = mcs->get_vals ();
+		for (size_t i = 0; i < vals.size (); i++)
+			value_max = max (value_max, fabs (vals[i]));
+	}
+	else
+		for (unsigned r = 0; r < rows; r++)
+			for (unsigned c = 0; c < cols; c++)
+				value_max = max (value_max, fabs (ms.get (r, c)));
+
+	return max (rows, cols) * DBL_EPSILON * value_max;
+}
+
+/** Forward Gaussian elimination on a dense matrix, splitting updates
+ *  of rows below each pivot across ThreadPool.  Pivots and results
+ *  no larger than @a tiny are deemed zero.  Returns the rank. */
+static unsigned
+eliminate_dense (double *values, unsigned rows, unsigned cols, double tiny)
+{
+	ThreadPool &pool = ThreadPool::get ();
+
+	RowJob job;
+	job.values = values;
+	job.cols = cols;
+	job.tiny = tiny;
+
+	unsigned cur_row = 0;
+	for (unsigned k = 0; k < cols && cur_row < rows; k++)
+	{
+		/* Find the pivot for this column. */
+		double value_max = 0;
+		unsigned pivot = 0;
+
+		for (unsigned i = cur_row; i < rows; i++)
+		{
+			double value = fabs (values[(size_t) i * cols + k]);
+			if (value > value_max)
+			{
+				value_max = value;
+				pivot = i;
+			}
+		}
+
+		/* Nothing to do here. */
+		if (value_max <= tiny)
+			continue;
+
+		if (pivot != cur_row)
+			swap_ranges (values + (size_t) cur_row * cols,
+				values + (size_t) (cur_row + 1) * cols,
+				values + (size_t) pivot * cols);
+
+		job.pivot = cur_row;
+		job.col = k;
+		job.first = cur_row + 1;
+		job.from = k + 1;
+		pool.run (eliminate_rows_task, &job, rows - cur_row - 1,
+			ELIMINATE_GRAIN_WORK / (cols - k));
+
+		cur_row++;
+	}
+	return cur_row;
 }
 
 Matrix
 Matrix::eliminate (unsigned *rank, EliminateCallback cb, void *extra) const
 {
+	if (dynamic_cast<const MatrixTransposedStorage *> (storage))
+		return materialize ().eliminate (rank, cb, extra);
+
 	unsigned rows = storage->get_rows ();
 	unsigned cols = storage->get_cols ();
+	double tiny = eliminate_tolerance (*storage);
+
+	/* Without a callback, dense matrices can be processed in parallel. */
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (storage);
+	if (mas && !cb)
+	{
+		MatrixArrayStorage *result =
+			static_cast<MatrixArrayStorage *> (mas->clone ());
+		unsigned result_rank =
+			eliminate_dense (result->get_values (), rows, cols, tiny);
+		if (rank)
+			*rank = result_rank;
+		return Matrix (result);
+	}
 
 	MatrixStorage *ms = storage->clone ();
 
@@ -509,7 +2161,7 @@ Matrix::eliminate (unsigned *rank, EliminateCallback cb, void *extra) const
 		}
 
 		/* Nothing to do here. */
-		if (!value_max)
+		if (value_max <= tiny)
 			continue;
 
 		bool done_anything = false;
@@ -541,7 +2193,7 @@ Matrix::eliminate (unsigned *rank, EliminateCallback cb, void *extra) const
 			for (unsigned c = k + 1; c < cols; c++)
 			{
 				double value = ms->get (r, c) - ms->get (cur_row, c) * factor;
-				ms->put (r, c, fabs (value) < ELIMINATES_TO_ZERO ? 0 : value);
+				ms->put (r, c, fabs (value) <= tiny ? 0 : value);
 			}
 
 			if (cb)
@@ -578,6 +2230,17 @@ Matrix::inverse (EliminateCallback cb, void *extra)
 		throw EIncompatibleMatrix
 			(_("Inverse matrix is only defined for rectangular matrices"));
 
+	/* The inverse of a transposed matrix is the transposed inverse. */
+	const MatrixTransposedStorage *mts =
+		dynamic_cast<const MatrixTransposedStorage *> (storage);
+	if (mts)
+		return cb ? materialize ().inverse (cb, extra)
+			: mts->get_source ().inverse ().transpose ();
+
+	/* Dense matrices use the LU decomposition. */
+	if (!cb && dynamic_cast<const MatrixArrayStorage *> (storage))
+		return get_lu ().inverse ();
+
 	/* Create a matrix of form (M | E). */
 	MatrixStorage *tmp = storage->create (size, 2 * size);
 	for (unsigned r = 0; r < size; r++)
@@ -658,6 +2321,14 @@ Matrix::inverse (EliminateCallback cb, void *extra)
 	return Matrix (ms);
 }
 
+const LUFactorization &
+Matrix::get_lu () const throw (EIncompatibleMatrix)
+{
+	if (!storage->lu)
+		storage->lu = new LUFactorization (*this);
+	return *storage->lu;
+}
+
 /** Adjust the determinant value if needed. */
 static void
 matrix_determinant_eliminate_cb (Matrix::EliminateStep &step)
@@ -674,6 +2345,16 @@ Matrix::get_determinant () const throw (EIncompatibleMatrix)
 		throw EIncompatibleMatrix
 			(_("Determinant is only defined for rectangular matrices"));
 
+	/* Transposition doesn't change the determinant. */
+	const MatrixTransposedStorage *mts =
+		dynamic_cast<const MatrixTransposedStorage *> (storage);
+	if (mts)
+		return mts->get_source ().get_determinant ();
+
+	/* Dense matrices use the LU decomposition. */
+	if (dynamic_cast<const MatrixArrayStorage *> (storage))
+		return get_lu ().determinant ();
+
 	double factor = 1;
 	Matrix m = eliminate (NULL, matrix_determinant_eliminate_cb, &factor);
 	for (unsigned s = 0; s < size; s++)
@@ -681,3 +2362,22 @@ Matrix::get_determinant () const throw (EIncompatibleMatrix)
 
 	return factor;
 }
+
+unsigned
+Matrix::get_rank () const
+{
+	/* Transposition doesn't change the rank. */
+	const MatrixTransposedStorage *mts =
+		dynamic_cast<const MatrixTransposedStorage *> (storage);
+	if (mts)
+		return mts->get_source ().get_rank ();
+
+	/* Dense square matrices may reuse their LU decomposition. */
+	if (storage->get_rows () == storage->get_cols ()
+	 && dynamic_cast<const MatrixArrayStorage *> (storage))
+		return get_lu ().rank ();
+
+	unsigned rank;
+	eliminate (&rank);
+	return rank;
+}
@@ -16,15 +16,24 @@ class EDataError : public std::exception
 	virtual const char *what () const throw ();
 };
 
-/** Storage for values in a Matrix. */
+class LUFactorization;
+struct MatrixTerm;
+
+/** Storage for values in a Matrix.  Any number of Matrix objects may share
+ *  a single storage, which they then consider read-only.  The first one
+ *  to change its values gets a private copy first. */
 class MatrixStorage
 {
+	friend class Matrix;
+
+	unsigned ref_count;       //!< Number of Matrix objects sharing this.
+	mutable LUFactorization *lu;  //!< Cached LU decomposition of the values.
 protected:
 	unsigned rows;       //!< Number of rows.
 	unsigned cols;       //!< Number of columns.
 public:
-	virtual ~MatrixStorage () {}
-	unsigned ref_count;  //!< Reference count.  Not used internally.
+	MatrixStorage ();
+	virtual ~MatrixStorage ();
 
 	unsigned get_rows () const {return rows;}  //!< Get number of rows.
 	unsigned get_cols () const {return cols;}  //!< Get number of columns.
@@ -35,6 +44,9 @@ public:
 	virtual void put (unsigned row, unsigned col, double value) = 0;
 	/** Swap two rows. */
 	virtual void swap_rows (unsigned row1, unsigned row2) = 0;
+	/** Count the values that aren't zero.  By default all values
+	 *  are retrieved one by one, sparse kinds know it right away. */
+	virtual size_t count_nonzero () const;
 
 	/** Serialize the storage into an output stream. */
 	virtual bool serialize (std::ostream &os) const = 0;
@@ -48,7 +60,13 @@ public:
 /** Array-based storage for dense matrices. */
 class MatrixArrayStorage : public MatrixStorage
 {
-	double *values;
+protected:
+	double *values;      //!< The values, stored by rows.
+
+	/** Initialize the storage to use existing memory.  Subclasses
+	 *  must reset @a values before it gets deleted by this class. */
+	MatrixArrayStorage (unsigned rows, unsigned cols, double *values)
+		: values (values) {this->rows = rows; this->cols = cols;}
 public:
 	/** Initialize the storage. */
 	MatrixArrayStorage (unsigned rows, unsigned cols, bool init = true);
@@ -56,9 +74,15 @@ public:
 	MatrixArrayStorage (std::istream &is) throw (EDataError);
 	virtual ~MatrixArrayStorage ();
 
+	/** Direct access to the values, stored by rows. */
+	double *get_values () {return values;}
+	/** Direct read-only access to the values, stored by rows. */
+	const double *get_values () const {return values;}
+
 	virtual double get (unsigned row, unsigned col) const;
 	virtual void put (unsigned row, unsigned col, double value);
 	virtual void swap_rows (unsigned row1, unsigned row2);
+	virtual size_t count_nonzero () const;
 
 	virtual bool serialize (std::ostream &os) const;
 
@@ -76,9 +100,69 @@ public:
 	/** Initialize the storage using binary values from a stream. */
 	MatrixMapStorage (std::istream &is) throw (EDataError);
 
+	/** Direct read-only access to the rows that contain any values. */
+	const std::map<unsigned, std::map<unsigned, double> > &get_values () const
+		{return values;}
+
+	virtual double get (unsigned row, unsigned col) const;
+	virtual void put (unsigned row, unsigned col, double value);
+	virtual void swap_rows (unsigned row1, unsigned row2);
+	virtual size_t count_nonzero () const;
+
+	virtual bool serialize (std::ostream &os) const;
+
+	virtual MatrixStorage *clone () const;
+	virtual MatrixStorage *create (unsigned rows, unsigned cols) const;
+};
+
+/** Compressed sparse row storage for sparse matrices.
+ *  Values that don't fit into the compressed structure are first placed
+ *  in a staging buffer, and only merged in by compact() every once in a while,
+ *  or when the compressed form is requested. */
+class MatrixCSRStorage : public MatrixStorage
+{
+	/** Beginnings of rows within @a col_idx and @a vals, plus the end. */
+	mutable std::vector<unsigned> row_ptr;
+	/** Column indexes of values, ascending within each row. */
+	mutable std::vector<unsigned> col_idx;
+	/** The values themselves. */
+	mutable std::vector<double> vals;
+	/** Count of zeros in @a vals, left there by put(). */
+	mutable unsigned n_zeros;
+
+	/** Values waiting to be merged into the compressed structure. */
+	mutable std::map<std::pair<unsigned, unsigned>, double> staged;
+
+	/** Find the position of a value in the compressed structure. */
+	bool find (unsigned row, unsigned col, unsigned &pos) const;
+public:
+	/** Initialize the storage. */
+	MatrixCSRStorage (unsigned rows, unsigned cols);
+	/** Initialize the storage using binary values from a stream.
+	 *  The format is shared with MatrixMapStorage. */
+	MatrixCSRStorage (std::istream &is) throw (EDataError);
+
+	/** Merge the staging buffer into the compressed structure. */
+	void compact () const;
+	/** Replace the contents with already compressed data.
+	 *  The arguments are swapped with the internal vectors. */
+	void assign (std::vector<unsigned> &row_ptr,
+		std::vector<unsigned> &col_idx, std::vector<double> &vals);
+
+	/** Get row pointers, @a rows + 1 items.  Compacts the storage. */
+	const std::vector<unsigned> &get_row_ptr () const
+		{compact (); return row_ptr;}
+	/** Get column indexes of values.  Compacts the storage. */
+	const std::vector<unsigned> &get_col_idx () const
+		{compact (); return col_idx;}
+	/** Get the non-zero values.  Compacts the storage. */
+	const std::vector<double> &get_vals () const
+		{compact (); return vals;}
+
 	virtual double get (unsigned row, unsigned col) const;
 	virtual void put (unsigned row, unsigned col, double value);
 	virtual void swap_rows (unsigned row1, unsigned row2);
+	virtual size_t count_nonzero () const;
 
 	virtual bool serialize (std::ostream &os) const;
 
@@ -103,6 +187,9 @@ class Matrix
 {
 	MatrixStorage *storage;  //!< Underlying storage.
 
+	/** Make sure the storage isn't shared before changing its values. */
+	void detach ();
+
 	/** Get number-aligned string representation of rows. */
 	std::string *get_rows (unsigned &count) const;
 public:
@@ -113,13 +200,16 @@ public:
 	Matrix (const Matrix &m);
 	~Matrix ();
 
-	/** Returns the storage object used by this matrix. */
-	MatrixStorage &get_storage () const {return *storage;}
+	/** Returns the storage object used by this matrix.  It may be shared
+	 *  with other matrices and therefore must not be changed directly. */
+	const MatrixStorage &get_storage () const {return *storage;}
 
 	/** Retrieve the (@a row, @a col)-th value. */
 	double get (unsigned row, unsigned col) const;
 	/** Set the (@a row, @a col)-th value to @a value. */
 	void put (unsigned row, unsigned col, double value);
+	/** Swap two rows. */
+	void swap_rows (unsigned row1, unsigned row2);
 
 	/** Print the matrix out into an output stream. */
 	friend std::ostream &operator<< (std::ostream &os, const Matrix &m);
@@ -135,8 +225,38 @@ public:
 
 	/** Multiply all values by a constant. */
 	Matrix operator* (double n) const;
-	/** Tranpose the matrix. */
+
+	/** Add a linear combination of matrices to this one.  The values are
+	 *  changed in place, unless the storage is shared or of a kind that
+	 *  doesn't allow for it, and the kind of storage is kept as it is. */
+	Matrix &accumulate (const std::vector<MatrixTerm> &terms)
+		throw (EIncompatibleMatrix);
+	/** Multiply all values by a constant, in place when possible. */
+	Matrix &operator*= (double n);
+	/** Raise the matrix to the power of @a exponent by repeated squaring. */
+	Matrix power (unsigned long exponent) const throw (EIncompatibleMatrix);
+	/** Tranpose the matrix.  The result is only a view of this matrix. */
 	Matrix transpose () const;
+	/** Get the same matrix without going through views of other matrices,
+	 *  for operations that need to work with the actual storage. */
+	Matrix materialize () const;
+
+	/** Whether results of operations should change their kind of storage
+	 *  according to how many of their values are zero. */
+	static bool adaptive;
+	/** Dense results with a smaller share of non-zero values than this
+	 *  are converted to sparse storage. */
+	static double sparse_density;
+	/** Sparse results with a larger share of non-zero values than this
+	 *  are converted to dense storage. */
+	static double dense_density;
+
+	/** Get the same matrix in the cheaper kind of storage, as decided
+	 *  by the share of non-zero values and the thresholds above. */
+	Matrix adapt () const;
+	/** Get the same matrix stored as compressed sparse rows,
+	 *  for operations that work directly with them. */
+	Matrix compress () const;
 
 	/** Describes the elimination step. */
 	struct EliminateStep
@@ -154,7 +274,7 @@ public:
 		step;
 
 		void *extra;        //!< Caller-specific data.
-		MatrixStorage *ms;  //!< Current matrix data (after the step).
+		const MatrixStorage *ms;  //!< Current matrix data (after the step).
 		unsigned par1;      //!< First integer parameter.
 		unsigned par2;      //!< Second integer parameter.
 		double factor;      //!< Row multiplication factor.
@@ -170,9 +290,55 @@ public:
 	Matrix inverse (EliminateCallback cb = NULL,
 		void *extra = NULL) const throw (EIncompatibleMatrix);
 
+	/** Get the LU decomposition of this matrix.  It is computed only once
+	 *  and kept with the storage for as long as the values don't change. */
+	const LUFactorization &get_lu () const throw (EIncompatibleMatrix);
 	/** Compute the determinant of this matrix. */
 	double get_determinant () const throw (EIncompatibleMatrix);
+	/** Compute the rank of this matrix. */
+	unsigned get_rank () const;
+};
+
+/** A transposed view of another matrix.  Values are read from the source
+ *  with their indexes swapped, so that nothing has to be copied.  A view
+ *  of a sparse matrix stored by rows is effectively stored by columns.
+ *  Changing the values makes the source matrix get its own storage first. */
+class MatrixTransposedStorage : public MatrixStorage
+{
+	Matrix source;       //!< The matrix being transposed.
+public:
+	/** Initialize the view. */
+	MatrixTransposedStorage (const Matrix &source);
+
+	/** Get the matrix being transposed. */
+	const Matrix &get_source () const {return source;}
+
+	virtual double get (unsigned row, unsigned col) const;
+	virtual void put (unsigned row, unsigned col, double value);
+	virtual void swap_rows (unsigned row1, unsigned row2);
+	virtual size_t count_nonzero () const;
+
+	virtual bool serialize (std::ostream &os) const;
+
+	virtual MatrixStorage *clone () const;
+	virtual MatrixStorage *create (unsigned rows, unsigned cols) const;
+};
+
+/** A single term of a linear combination of matrices. */
+struct MatrixTerm
+{
+	Matrix matrix;       //!< The matrix.
+	double factor;       //!< Scalar multiple of the matrix.
+	bool transposed;     //!< Whether the matrix is to be transposed.
+
+	/** Initialize the term. */
+	MatrixTerm (const Matrix &matrix, double factor = 1, bool transposed = false)
+		: matrix (matrix), factor (factor), transposed (transposed) {}
 };
 
+/** Compute the sum of all @a terms, which must have matching dimensions.
+ *  Dense matrices are combined in a single pass over the result. */
+Matrix matrix_combine (const std::vector<MatrixTerm> &terms);
+
 #endif /* ! __MATRIX_H__ */
 
@@ -0,0 +1,508 @@
+/**
+ * @file matrixbench.cpp
+ * Micro-benchmarks of matrix operations.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ * Runs the basic operations on synthetic matrices of various kinds, sizes
+ * and densities, and prints the results as JSON.  A previous output may be
+ * given as a baseline, in which case the results are compared against it
+ * and the program fails when any of the operations got slower.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <string>
+#include <exception>
+#include <stdexcept>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <config.h>
+
+#include "matrix.h"
+#include "value.h"
+#include "matrixio.h"
+#include "threadpool.h"
+
+using namespace std;
+
+/** Minimum number of runs of each benchmark. */
+#define BENCH_MIN_RUNS 3
+/** Maximum number of runs of each benchmark. */
+#define BENCH_MAX_RUNS 50
+/** Keep running a benchmark until it has taken at least this many seconds. */
+#define BENCH_MIN_TIME 0.2
+
+/** Kinds of storage that are benchmarked. */
+enum StorageKind {DENSE, CSR, MAP};
+
+/** Names of kinds of storage, as they appear in the output. */
+static const char *g_kind_names[] = {"dense", "csr", "map"};
+
+/** Input data of a benchmark. */
+struct Operands
+{
+	Matrix a;            //!< The left operand.
+	Matrix b;            //!< The right operand.
+	string filename;     //!< A temporary file for input and output.
+
+	/** Initialize the operands. */
+	Operands (const Matrix &a, const Matrix &b, const string &filename)
+		: a (a), b (b), filename (filename) {}
+};
+
+/** Keeps the results of benchmarks from being optimized out. */
+static volatile double g_sink;
+
+static void
+bench_add (const Operands &o)
+{
+	g_sink = (o.a + o.b).get (0, 0);
+}
+
+static void
+bench_multiply (const Operands &o)
+{
+	g_sink = (o.a * o.b).get (0, 0);
+}
+
+static void
+bench_transpose (const Operands &o)
+{
+	g_sink = o.a.transpose ().materialize ().get (0, 0);
+}
+
+static void
+bench_eliminate (const Operands &o)
+{
+	g_sink = o.a.eliminate ().get (0, 0);
+}
+
+static void
+bench_inverse (const Operands &o)
+{
+	/* The storage caches the decomposition, a copy of it doesn't. */
+	Matrix copy (o.a.get_storage ().clone ());
+	g_sink = copy.inverse ().get (0, 0);
+}
+
+static void
+bench_determinant (const Operands &o)
+{
+	Matrix copy (o.a.get_storage ().clone ());
+	g_sink = copy.get_determinant ();
+}
+
+static void
+bench_save (const Operands &o)
+{
+	Value value;
+	value.type = Value::MATRIX;
+	value.matrix = new Matrix (o.a);
+	if (!save_value (value, o.filename))
+		throw runtime_error ("saving failed");
+}
+
+static void
+bench_load (const Operands &o)
+{
+	Value value;
+	if (!load_value (value, o.filename) || value.type != Value::MATRIX)
+		throw runtime_error ("loading failed");
+
+	/* Mapped files are only read as the values get accessed. */
+	g_sink = value.matrix->get_storage ().count_nonzero ();
+}
+
+/** Describes an operation to benchmark. */
+struct Operation
+{
+	const char *name;                    //!< Name of the operation.
+	void (*run) (const Operands &o);     //!< Runs the operation.
+	double flops_coeff;                  //!< Coefficient of n^flops_exp.
+	int flops_exp;                       //!< Exponent of floating-point ops.
+	bool needs_file;                     //!< Needs a previously saved file.
+};
+
+/** Table of all operations.  Floating-point operations are counted
+ *  the usual way for dense algorithms, whatever the storage. */
+static const Operation g_operations[] =
+{
+	{"add",         bench_add,         1,     2, false},
+	{"multiply",    bench_multiply,    2,     3, false},
+	{"transpose",   bench_transpose,   0,     0, false},
+	{"eliminate",   bench_eliminate,   2./3,  3, false},
+	{"inverse",     bench_inverse,     2,     3, false},
+	{"determinant", bench_determinant, 2./3,  3, false},
+	{"save",        bench_save,        0,     0, false},
+	{"load",        bench_load,        0,     0, true}
+};
+
+static const unsigned g_n_operations =
+	sizeof g_operations / sizeof *g_operations;
+
+/** Get the current time in seconds. */
+static double
+get_time ()
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/** Get the peak resident set size of the process in kilobytes. */
+static long
+get_peak_rss ()
+{
+	struct rusage usage;
+	if (getrusage (RUSAGE_SELF, &usage))
+		return -1;
+	return usage.ru_maxrss;
+}
+
+/** A simple xorshift generator, so that matrices are the same everywhere. */
+static unsigned
+next_random (unsigned &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/** Generate a random @a n by @a n matrix with the given share of non-zero
+ *  values.  The diagonal is always filled with large enough values
+ *  for the matrix to be regular. */
+static Matrix
+generate (StorageKind kind, unsigned n, double density, unsigned seed)
+{
+	MatrixStorage *ms;
+	switch (kind)
+	{
+	case DENSE:  ms = new MatrixArrayStorage (n, n);  break;
+	case CSR:    ms = new MatrixCSRStorage (n, n);    break;
+	default:     ms = new MatrixMapStorage (n, n);
+	}
+
+	unsigned state = seed * 2654435761U + 1;
+	unsigned threshold = density >= 1 ? ~0U : (unsigned) (density * ~0U);
+	for (unsigned r = 0; r < n; r++)
+	for (unsigned c = 0; c < n; c++)
+	{
+		double value = next_random (state) / (double) ~0U * 2 - 1;
+		if (r == c)
+			ms->put (r, c, n + value);
+		else if (next_random (state) <= threshold)
+			ms->put (r, c, value);
+	}
+	return Matrix (ms);
+}
+
+/** Estimate the memory used by a storage in bytes.  Nodes of maps are
+ *  assumed to carry three pointers and a colour besides the value. */
+static double
+get_storage_bytes (const MatrixStorage &ms, StorageKind kind)
+{
+	double nonzero = ms.count_nonzero ();
+	switch (kind)
+	{
+	case DENSE:
+		return (double) ms.get_rows () * ms.get_cols () * sizeof (double);
+	case CSR:
+		return (ms.get_rows () + 1.) * sizeof (unsigned)
+			+ nonzero * (sizeof (unsigned) + sizeof (double));
+	default:
+		return (ms.get_rows () + nonzero)
+			* (4 * sizeof (void *) + sizeof (unsigned) + sizeof (double));
+	}
+}
+
+/** Get the size of a file in bytes. */
+static double
+get_file_bytes (const string &filename)
+{
+	ifstream ifs (filename.c_str (), ios::binary | ios::ate);
+	return ifs ? (double) ifs.tellg () : 0.;
+}
+
+/** The result of a single benchmark. */
+struct Result
+{
+	string name;                 //!< Unique name of the benchmark.
+	const Operation *operation;  //!< The operation.
+	StorageKind kind;            //!< Kind of storage.
+	unsigned size;               //!< Number of rows and columns.
+	double density;              //!< Share of non-zero values.
+	unsigned runs;               //!< Number of runs.
+	double seconds;              //!< The best time of a run.
+	double gflops;               //!< Floating-point performance.
+	double bytes_per_element;    //!< Memory or file size per matrix value.
+	long peak_rss;               //!< Peak RSS of the process after the run.
+	double baseline;             //!< Time in the baseline, or zero.
+};
+
+/** Run a benchmark until it has taken long enough, keeping the best time. */
+static void
+measure (const Operation &op, const Operands &o, Result &result)
+{
+	double total = 0;
+	result.seconds = HUGE_VAL;
+	for (result.runs = 0; result.runs < BENCH_MAX_RUNS
+		&& (result.runs < BENCH_MIN_RUNS || total < BENCH_MIN_TIME);
+		result.runs++)
+	{
+		double start = get_time ();
+		op.run (o);
+		double elapsed = get_time () - start;
+
+		total += elapsed;
+		if (elapsed < result.seconds)
+			result.seconds = elapsed;
+	}
+
+	double flops = op.flops_coeff * pow ((double) result.size, op.flops_exp);
+	result.gflops = op.flops_exp && result.seconds > 0
+		? flops / result.seconds / 1e9 : 0;
+	result.peak_rss = get_peak_rss ();
+}
+
+/** Read the times of benchmarks from previous output of the program.
+ *  Only the format written by print_results() is understood. */
+static bool
+read_baseline (const string &filename, map<string, double> &baseline)
+{
+	ifstream ifs (filename.c_str ());
+	if (!ifs)
+		return false;
+
+	stringstream ss;
+	ss << ifs.rdbuf ();
+	string json = ss.str ();
+
+	static const char name_key[] = "\"name\": \"";
+	static const char seconds_key[] = "\"seconds\": ";
+
+	size_t pos = 0;
+	while ((pos = json.find (name_key, pos)) != string::npos)
+	{
+		pos += sizeof name_key - 1;
+		size_t end = json.find ('"', pos);
+		size_t seconds = json.find (seconds_key, end);
+		if (end == string::npos || seconds == string::npos)
+			return false;
+
+		baseline[json.substr (pos, end - pos)] =
+			strtod (json.c_str () + seconds + sizeof seconds_key - 1, NULL);
+		pos = seconds;
+	}
+	return true;
+}
+
+/** Print a number in a way that is valid JSON. */
+static void
+print_number (ostream &os, double number)
+{
+	if (number == number && fabs (number) != HUGE_VAL)
+		os << number;
+	else
+		os << "null";
+}
+
+/** Print all results as a JSON document. */
+static void
+print_results (ostream &os, const vector<Result> &results)
+{
+	os << "{\n";
+	os << "  \"program\": \"" << PACKAGE_STRING << "\",\n";
+	os << "  \"threads\": " << ThreadPool::get ().get_size () << ",\n";
+	os << "  \"benchmarks\": [";
+
+	for (unsigned i = 0; i < results.size (); i++)
+	{
+		const Result &r = results[i];
+		os << (i ? ",\n" : "\n") << "    {\n";
+		os << "      \"name\": \"" << r.name << "\",\n";
+		os << "      \"operation\": \"" << r.operation->name << "\",\n";
+		os << "      \"storage\": \"" << g_kind_names[r.kind] << "\",\n";
+		os << "      \"size\": " << r.size << ",\n";
+		os << "      \"density\": " << r.density << ",\n";
+		os << "      \"runs\": " << r.runs << ",\n";
+		os << "      \"seconds\": ";            print_number (os, r.seconds);
+		os << ",\n      \"gflops\": ";          print_number (os, r.gflops);
+		os << ",\n      \"bytes_per_element\": ";
+		print_number (os, r.bytes_per_element);
+		os << ",\n      \"peak_rss_kb\": " << r.peak_rss;
+		if (r.baseline)
+		{
+			os << ",\n      \"baseline_seconds\": ";
+			print_number (os, r.baseline);
+			os << ",\n      \"speedup\": ";
+			print_number (os, r.baseline / r.seconds);
+		}
+		os << "\n    }";
+	}
+	os << "\n  ]\n}\n";
+}
+
+/** Describes a set of matrices to benchmark with. */
+struct Configuration
+{
+	StorageKind kind;            //!< Kind of storage.
+	unsigned sizes[3];           //!< Numbers of rows and columns.
+	double densities[3];         //!< Shares of non-zero values.
+};
+
+/** All the configurations.  Sparse kinds are only given smaller matrices,
+ *  since elimination accesses them through lookups, maps even multiply
+ *  that way. */
+static const Configuration g_configurations[] =
+{
+	{DENSE, {64, 256, 512}, {1,    0.1,  0.01}},
+	{CSR,   {64, 128, 256}, {0.1,  0.01, 0.001}},
+	{MAP,   {32,  64, 128}, {0.1,  0.01, 0.001}}
+};
+
+static const unsigned g_n_configurations =
+	sizeof g_configurations / sizeof *g_configurations;
+
+/** Show command line usage. */
+static void
+show_usage (const char *program)
+{
+	cerr << "Usage: " << program << " [OPTION]..." << endl << endl
+		<< "  --quick                Only use the smallest matrices\n"
+		   "  --filter TEXT          Only run benchmarks whose names contain TEXT\n"
+		   "  --adaptive             Let results change their kind of storage\n"
+		   "  --baseline FILE        Compare with previous output of the program\n"
+		   "  --tolerance PERCENT    Allowed slowdown against the baseline,\n"
+		   "                         10 by default" << endl;
+}
+
+/** Program entry point. */
+int
+main (int argc, char *argv[])
+{
+	bool quick = false;
+	string filter, baseline_file;
+	double tolerance = 10;
+
+	Matrix::adaptive = false;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--quick")
+			quick = true;
+		else if (arg == "--adaptive")
+			Matrix::adaptive = true;
+		else if (arg == "--filter" && i + 1 < argc)
+			filter = argv[++i];
+		else if (arg == "--baseline" && i + 1 < argc)
+			baseline_file = argv[++i];
+		else if (arg == "--tolerance" && i + 1 < argc)
+			tolerance = strtod (argv[++i], NULL);
+		else
+		{
+			show_usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	map<string, double> baseline;
+	if (!baseline_file.empty () && !read_baseline (baseline_file, baseline))
+	{
+		cerr << "Cannot read the baseline: " << baseline_file << endl;
+		return EXIT_FAILURE;
+	}
+
+	const char *tmpdir = getenv ("TMPDIR");
+	ostringstream filename;
+	filename << (tmpdir ? tmpdir : "/tmp") << "/matrixbench-" << getpid ();
+
+	vector<Result> results;
+	unsigned regressions = 0;
+	for (unsigned c = 0; c < g_n_configurations; c++)
+	{
+		const Configuration &conf = g_configurations[c];
+		for (unsigned s = 0; s < (quick ? 1 : 3); s++)
+		for (unsigned d = 0; d < 3; d++)
+		{
+			unsigned size = conf.sizes[s];
+			double density = conf.densities[d];
+			Operands operands (generate (conf.kind, size, density, 1),
+				generate (conf.kind, size, density, 2), filename.str ());
+
+			for (unsigned o = 0; o < g_n_operations; o++)
+			{
+				const Operation &op = g_operations[o];
+
+				ostringstream name;
+				name << op.name << "/" << g_kind_names[conf.kind]
+					<< "/" << size << "/" << density;
+				if (name.str ().find (filter) == string::npos)
+					continue;
+
+				Result result;
+				result.name = name.str ();
+				result.operation = &op;
+				result.kind = conf.kind;
+				result.size = size;
+				result.density = density;
+
+				try
+				{
+					if (op.needs_file)
+						bench_save (operands);
+					measure (op, operands, result);
+				}
+				catch (const exception &e)
+				{
+					cerr << result.name << ": " << e.what () << endl;
+					continue;
+				}
+
+				double elements = (double) size * size;
+				if (op.run == bench_save || op.run == bench_load)
+					result.bytes_per_element =
+						get_file_bytes (operands.filename) / elements;
+				else
+					result.bytes_per_element = get_storage_bytes
+						(operands.a.get_storage (), conf.kind) / elements;
+
+				map<string, double>::const_iterator iter =
+					baseline.find (result.name);
+				result.baseline = iter != baseline.end () ? iter->second : 0;
+				if (result.baseline
+				 && result.seconds > result.baseline * (1 + tolerance / 100))
+				{
+					cerr << result.name << ": " << result.seconds
+						<< " s, was " << result.baseline << " s" << endl;
+					regressions++;
+				}
+
+				results.push_back (result);
+			}
+		}
+	}
+
+	unlink (filename.str ().c_str ());
+	print_results (cout, results);
+
+	if (regressions)
+	{
+		cerr << regressions << " benchmark(s) got slower" << endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
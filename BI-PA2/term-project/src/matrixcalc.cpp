@@ -16,12 +16,16 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <vector>
 #include <stack>
 #include <exception>
 
 #include <clocale>
+#include <cctype>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <stdint.h>
 
 #include <config.h>
 
@@ -32,6 +36,11 @@
 #include "environ.h"
 #include "evalnodes.h"
 #include "parseexpr.h"
+#include "matrixio.h"
+#include "tiled.h"
+#include "bytecode.h"
+#include "krylov.h"
+#include "profile.h"
 
 #include "gettext.h"
 #define _(String) gettext (String)
@@ -74,6 +83,18 @@ using namespace std;
 Environ g_environ;
 /** Creating sparse matrices. */
 bool g_create_sparse;
+/** Settings of the iterative solver used by `solve'. */
+IterativeSolver g_solver;
+
+/** Read a number, either an integer or a real one. */
+static double
+expect_number (Parser &parser) throw (EParserUnexpected)
+{
+	if (parser.accept (INTEGER))
+		return parser.last ().i;
+	parser.expect (REAL);
+	return parser.last ().n;
+}
 
 /** Show program help. */
 static void
@@ -85,8 +106,15 @@ show_help ()
 	"  delete NAME | *          Delete the named variable, or everything\n"
 	"  load NAME FILENAME       Load variable from a file\n"
 	"  save NAME FILENAME       Save variable to a file\n"
+	"                           Files ending with .csv or .mtx are\n"
+	"                           comma-separated values or Matrix Market\n"
 	"  typeof NAME              Print out the type of the variable\n"
+	"  solve A B [X]            Solve A * X = B iteratively, assigning\n"
+	"                           the result to X or displaying it\n"
 	"  set OPTION               Set program options\n"
+	"  profile on | off [FILENAME]\n"
+	"                           Measure statements until turned off,\n"
+	"                           then show a summary or save a trace\n"
 	"  help                     Show this help\n"
 	"  exit                     Exit the program\n"
 	"\n"
@@ -98,6 +126,19 @@ show_help ()
 	"Options:\n"
 	"  sparse  | dense          Use sparse or dense storage for new matrices\n"
 	"  verbose | quiet          Be verbose when performing computations\n"
+	"  fused   | unfused        Compute chains of element-wise operations\n"
+	"                           on matrices in a single pass\n"
+	"  adaptive | fixed         Convert results between sparse and dense\n"
+	"                           storage depending on their density\n"
+	"  density LOW HIGH         Convert dense results with less than LOW\n"
+	"                           and sparse ones with more than HIGH share\n"
+	"                           of non-zero values\n"
+	"  solver cg | bicgstab | gmres\n"
+	"                           Choose the method used by `solve'\n"
+	"  preconditioner none | jacobi | ilu\n"
+	"                           Choose the preconditioner used by `solve'\n"
+	"  tolerance EPSILON        Stop solving at this relative residual\n"
+	"  iterations COUNT         Stop solving after this many iterations\n"
 	"\n"
 	"Operators in <expression>:\n"
 	"  +, -, *, ^               Their usual meaning\n"
@@ -156,7 +197,7 @@ static void
 enter_matrix (const string &var, int rows, int cols)
 {
 	MatrixStorage *ms = g_create_sparse
-		? static_cast<MatrixStorage *> (new MatrixMapStorage   (rows, cols))
+		? static_cast<MatrixStorage *> (new MatrixCSRStorage   (rows, cols))
 		: static_cast<MatrixStorage *> (new MatrixArrayStorage (rows, cols));
 
 	printf (_("Enter a %dx%d matrix:\n"), rows, cols);
@@ -179,46 +220,10 @@ enter_matrix (const string &var, int rows, int cols)
 static bool
 load_var (const string &var, const string &filename)
 {
-	ifstream ifs (filename.c_str (), ios::binary);
 	Value value;
-
-	/* Load type of variable. */
-	if (!ifs || !ifs.read ((char *) &value.type, sizeof value.type))
-		return false;
-
-	/* Read in the actual value. */
-	switch (value.type)
-	{
-	case Value::INTEGER:
-		if (!ifs.read ((char *) &value.integer, sizeof value.integer))
-			return false;
-		break;
-	case Value::REAL:
-		if (!ifs.read ((char *) &value.real,    sizeof value.real))
-			return false;
-		break;
-	case Value::MATRIX:
-		/* So far we only distinguish two kinds of matrix storage. */
-		bool sparse;
-		if (!ifs.read ((char *) &sparse, sizeof sparse))
-			return false;
-
-		try
-		{
-			value.matrix = new Matrix (sparse
-				? static_cast<MatrixStorage *> (new MatrixMapStorage   (ifs))
-				: static_cast<MatrixStorage *> (new MatrixArrayStorage (ifs)));
-		}
-		catch (const EDataError &)
-		{
-			return false;
-		}
-		break;
-	default:
+	if (!load_value (value, filename))
 		return false;
-	}
 
-	/* And assign it to the variable name. */
 	g_environ.set (var, value);
 	return true;
 }
@@ -227,42 +232,47 @@ load_var (const string &var, const string &filename)
 static bool
 save_var (const string &var, const string &filename)
 {
-	ofstream ofs (filename.c_str (), ios::binary);
-	Value value;
-
 	try
 	{
-		value = g_environ.get (var);
+		return save_value (g_environ.get (var), filename);
 	}
 	catch (const EUndefinedVariable &)
 	{
 		return false;
 	}
+}
 
-	/* First write the type of variable. */
-	if (!ofs || !ofs.write ((char *) &value.type, sizeof value.type))
-		return false;
+/** Report progress of the iterative solver. */
+static void
+describe_progress_cb (unsigned iteration, double residual, void *extra)
+{
+	printf (_("Iteration %u: relative residual %g\n"), iteration, residual);
+}
 
-	/* Then the actual value. */
-	MatrixStorage *storage;
-	bool sparse;
+/** Solve the system given by variables, assigning the result to @a x,
+ *  or printing it out when @a x is empty. */
+static void
+solve_system (const string &a, const string &b, const string &x)
+{
+	const Value &va = g_environ.get (a);
+	const Value &vb = g_environ.get (b);
+	if (va.type != Value::MATRIX || vb.type != Value::MATRIX)
+		throw EInvalidOperand ("solve");
 
-	switch (value.type)
-	{
-	case Value::INTEGER:
-		return ofs.write ((char *) &value.integer, sizeof value.integer);
-	case Value::REAL:
-		return ofs.write ((char *) &value.real,    sizeof value.real);
-	case Value::MATRIX:
-		storage = &value.matrix->get_storage ();
-		sparse = !!dynamic_cast<MatrixMapStorage *> (storage);
-		if (!ofs.write ((char *) &sparse, sizeof sparse))
-			return false;
+	if (Value::describe)
+		cout << _("# VERBOSE ITERATIVE SOLUTION") << endl;
 
-		return storage->serialize (ofs);
-	default:
-		return false;
-	}
+	Value value;
+	value.type = Value::MATRIX;
+	value.matrix = new Matrix (g_solver.solve (*va.matrix, *vb.matrix,
+		Value::describe ? describe_progress_cb : NULL));
+
+	if (Value::describe)
+		cout << endl;
+	if (x.empty ())
+		cout << value << endl;
+	else
+		g_environ.set (x, value);
 }
 
 /** Try to read a command from the input. */
@@ -330,29 +340,40 @@ parse_command (Parser &parser)
 		string var = parser.last ().s;
 		parser.expect (END);
 
-		Value value;
-		value = g_environ.get (var);
+		cout << g_environ.get (var).describe_type () << endl;
+	}
+	else if (parser.accept (SOLVE))
+	{
+		parser.expect (IDENT);
+		string a = parser.last ().s;
+		parser.expect (IDENT);
+		string b = parser.last ().s;
+		string x;
+		if (parser.accept (IDENT))
+			x = parser.last ().s;
+		parser.expect (END);
 
-		switch (value.type)
-		{
-		case Value::INTEGER:
-			cout << _("Integer") << endl;
-			break;
-		case Value::REAL:
-			cout << _("Real number") << endl;
-			break;
-		case Value::MATRIX:
-			MatrixStorage *ms = &value.matrix->get_storage ();
-			if (dynamic_cast<MatrixMapStorage *> (ms))
-				cout << _("Sparse matrix") << endl;
-			else
-				cout << _("Dense matrix") << endl;
-		}
+		solve_system (a, b, x);
 	}
 	else if (parser.accept (SET))
 	{
 		parser.expect (IDENT);
 		string option = parser.last ().s;
+
+		double low = 0, high = 0;
+		string name;
+		if (option == "density")
+		{
+			low = expect_number (parser);
+			high = expect_number (parser);
+		}
+		else if (option == "tolerance" || option == "iterations")
+			low = expect_number (parser);
+		else if (option == "solver" || option == "preconditioner")
+		{
+			parser.expect (IDENT);
+			name = parser.last ().s;
+		}
 		parser.expect (END);
 
 		if (option == "sparse")
@@ -375,9 +396,119 @@ parse_command (Parser &parser)
 			cout << _("Verbose mode set to off") << endl;
 			Value::describe = false;
 		}
+		else if (option == "fused")
+		{
+			cout << _("Fused evaluation set to on") << endl;
+			EvalNode::fused = true;
+		}
+		else if (option == "unfused")
+		{
+			cout << _("Fused evaluation set to off") << endl;
+			EvalNode::fused = false;
+		}
+		else if (option == "adaptive")
+		{
+			cout << _("Adaptive storage set to on") << endl;
+			Matrix::adaptive = true;
+		}
+		else if (option == "fixed")
+		{
+			cout << _("Adaptive storage set to off") << endl;
+			Matrix::adaptive = false;
+		}
+		else if (option == "density")
+		{
+			if (low < 0 || low > high || high > 1)
+				cout << _("Invalid density thresholds") << endl;
+			else
+			{
+				cout << _("Density thresholds set") << endl;
+				Matrix::sparse_density = low;
+				Matrix::dense_density = high;
+			}
+		}
+		else if (option == "solver")
+		{
+			if (name == "cg")
+				g_solver.method = IterativeSolver::CG;
+			else if (name == "bicgstab")
+				g_solver.method = IterativeSolver::BICGSTAB;
+			else if (name == "gmres")
+				g_solver.method = IterativeSolver::GMRES;
+			else
+			{
+				cout << _("Unsupported solver: ") << name << endl;
+				return true;
+			}
+			cout << _("Solver set") << endl;
+		}
+		else if (option == "preconditioner")
+		{
+			if (name == "none")
+				g_solver.preconditioner = IterativeSolver::NONE;
+			else if (name == "jacobi")
+				g_solver.preconditioner = IterativeSolver::JACOBI;
+			else if (name == "ilu")
+				g_solver.preconditioner = IterativeSolver::ILU0;
+			else
+			{
+				cout << _("Unsupported preconditioner: ") << name << endl;
+				return true;
+			}
+			cout << _("Preconditioner set") << endl;
+		}
+		else if (option == "tolerance")
+		{
+			if (!(low > 0 && low < 1))
+				cout << _("Invalid tolerance") << endl;
+			else
+			{
+				cout << _("Tolerance set") << endl;
+				g_solver.tolerance = low;
+			}
+		}
+		else if (option == "iterations")
+		{
+			if (low < 1 || low != (unsigned) low)
+				cout << _("Invalid iteration limit") << endl;
+			else
+			{
+				cout << _("Iteration limit set") << endl;
+				g_solver.max_iterations = low;
+			}
+		}
 		else
 			cout << _("Unsupported option: ") << option << endl;
 	}
+	else if (parser.accept (PROFILE))
+	{
+		parser.expect (IDENT);
+		string mode = parser.last ().s;
+		string filename;
+		if (mode == "off" && parser.accept (STRING))
+			filename = parser.last ().s;
+		parser.expect (END);
+
+		if (mode == "on")
+		{
+			cout << _("Profiling set to on") << endl;
+			profile_start ();
+		}
+		else if (mode == "off" && !g_profiling)
+			cout << _("Profiling is not on") << endl;
+		else if (mode == "off")
+		{
+			profile_stop ();
+			if (filename.empty ())
+				profile_summary (cout);
+			else if (!profile_trace (filename))
+				cout << _("Saving failed") << endl;
+			else
+				cout << _("Trace saved") << endl;
+		}
+		else
+			cout << _("Unsupported mode: ") << mode << endl;
+	}
 	else if (parser.accept (EXIT))
 	{
 		parser.expect (END);
@@ -395,8 +526,8 @@ parse_command (Parser &parser)
 	return true;
 }
 
-/** Process a single line of input. */
-static void
+/** Process a single line of input.  Returns false on error. */
+static bool
 process_input (const char *s)
 {
 	istringstream is (s);
@@ -407,13 +538,13 @@ process_input (const char *s)
 
 	/* Ignore empty lines. */
 	if (parser.accept (END))
-		return;
+		return true;
 
 	try
 	{
 		/* First try parsing as a command. */
 		if (parse_command (parser))
-			return;
+			return true;
 
 		/* Or as an expression,
 		 * possibly assigned to a variable. */
@@ -429,20 +560,124 @@ process_input (const char *s)
 				parser.go_back ();
 		}
 
-		tree = parse_expression (parser);
-		Value val = tree->evaluate (g_environ);
+		{
+			ProfileScope scope ("parse", PROFILE_PHASE);
+			tree = parse_expression (parser, g_environ);
+		}
 		if (assigning)
-			g_environ.set (ident, val);
+			tree->assign (g_environ, g_environ.intern (ident));
 		else
-			cout << val << endl;
+			cout << tree->evaluate (g_environ) << endl;
 
 		delete tree;
+		return true;
 	}
 	catch (const exception &e)
 	{
 		cout << _("Error: ") << e.what () << endl;
 		delete tree;
+		return false;
+	}
+}
+
+/** Parse a size in bytes, possibly followed by one of K, M, G, T. */
+static bool
+parse_size (const char *s, size_t &size)
+{
+	char *end;
+	errno = 0;
+	unsigned long value = strtoul (s, &end, 10);
+	if (errno || end == s || *s == '-')
+		return false;
+
+	static const char units[] = "KMGT";
+	const char *unit = *end ? strchr (units, toupper (*end)) : NULL;
+	for (long i = unit ? unit - units + 1 : 0; i--; )
+	{
+		if (value > (size_t) -1 / 1024)
+			return false;
+		value *= 1024;
+	}
+
+	size = value;
+	return !*(unit ? end + 1 : end);
+}
+
+/** Show command line usage. */
+static void
+show_usage (const char *program)
+{
+	cerr << _("Usage:") << " " << program << " "
+		<< _("[--memory-limit SIZE] [--script FILE]") << endl << endl
+		<< _("  --memory-limit SIZE  Keep dense results larger than SIZE bytes\n"
+		     "                       in temporary files; the K, M, G and T\n"
+		     "                       suffixes may be used\n"
+		     "  --script FILE        Compile FILE and run it non-interactively;\n"
+		     "                       `-' stands for standard input") << endl;
+}
+
+/** Return the value of @a option if it's the argument at @a i. */
+static const char *
+option_value (const char *option, int argc, char *argv[], int &i)
+{
+	size_t len = strlen (option);
+	if (!strcmp (argv[i], option) && i + 1 < argc)
+		return argv[++i];
+	if (!strncmp (argv[i], option, len) && argv[i][len] == '=')
+		return argv[i] + len + 1;
+	return NULL;
+}
+
+/** Value of MATRIXCALC_PROFILE, if profiling has been turned on by it. */
+static const char *g_profile_env;
+
+/** Report what has been profiled since the program has started. */
+static void
+finish_profile ()
+{
+	if (!g_profiling)
+		return;
+
+	profile_stop ();
+	if (atoi (g_profile_env))
+		profile_summary (cerr);
+	else if (!profile_trace (g_profile_env))
+		cerr << _("Cannot save the trace: ") << g_profile_env << endl;
+}
+
+/** Pass a command from a script on to the interpreter. */
+static bool
+run_command (const string &command)
+{
+	return process_input (command.c_str ());
+}
+
+/** Compile and run the script in @a path. */
+static int
+run_script (const char *path)
+{
+	ifstream file;
+	istream *is = &cin;
+	if (strcmp (path, "-"))
+	{
+		file.open (path);
+		if (!file)
+		{
+			cerr << _("Cannot open the script: ") << path << endl;
+			return EXIT_FAILURE;
+		}
+		is = &file;
 	}
+
+	Script script (g_environ);
+	bool compiled;
+	{
+		ProfileScope scope ("compile", PROFILE_PHASE);
+		compiled = script.compile (*is);
+	}
+	if (!compiled || !script.run (run_command))
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
 }
 
 /** Program entry point. */
@@ -456,6 +691,35 @@ main (int argc, char *argv[])
 	textdomain (PACKAGE);
 #endif /* ENABLE_NLS */
 
+	const char *script = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		const char *value;
+		if ((value = option_value ("--memory-limit", argc, argv, i)))
+		{
+			if (!parse_size (value, MatrixTiledStorage::memory_limit))
+				value = NULL;
+		}
+		else if ((value = option_value ("--script", argc, argv, i)))
+			script = value;
+
+		if (!value)
+		{
+			show_usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	g_profile_env = getenv ("MATRIXCALC_PROFILE");
+	if (g_profile_env && *g_profile_env && strcmp (g_profile_env, "0"))
+	{
+		profile_start ();
+		atexit (finish_profile);
+	}
+
+	if (script)
+		return run_script (script);
+
 	printf (_("Welcome to %s\n"), PACKAGE_STRING);
 	cout <<   "Copyright Přemysl Janouch 2012" << endl << endl;
 	cout << _("Type `help' to get started")    << endl;
@@ -470,6 +734,7 @@ main (int argc, char *argv[])
 	{
 		if (strlen (s))
 		{
+			ProfileScope scope (s, PROFILE_STATEMENT);
 			process_input (s);
 
 #ifdef HAVE_READLINE_HISTORY
@@ -487,6 +752,8 @@ main (int argc, char *argv[])
 	{
 		if (!strlen (buff))
 			continue;
+
+		ProfileScope scope (buff, PROFILE_STATEMENT);
 		process_input (buff);
 
 		cout << prompt;
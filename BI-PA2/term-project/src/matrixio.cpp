@@ -0,0 +1,496 @@
+/**
+ * @file matrixio.cpp
+ * Loading and saving values in files.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <exception>
+#include <algorithm>
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#include <config.h>
+
+#ifdef HAVE_MMAP
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif /* HAVE_MMAP */
+
+#include "matrix.h"
+#include "value.h"
+#include "tiled.h"
+#include "textio.h"
+#include "matrixio.h"
+
+using namespace std;
+
+
+/** Files in the binary format start with this.  It can't be mistaken
+ *  for the type of the value, which older versions started files with. */
+static const char g_magic[8] = {'\x89', 'M', 'C', 'A', 'L', 'C', '\r', '\n'};
+
+#define MATRIXIO_VERSION     1           //!< Current version of the format.
+#define MATRIXIO_BYTE_ORDER  0x01020304  //!< Reveals the byte order used.
+
+/** What the file contains. */
+enum MatrixFileKind
+{
+	KIND_INTEGER = 1,    //!< An integer, stored as int64_t.
+	KIND_REAL,           //!< A real number, stored as a double.
+	KIND_DENSE,          //!< A dense matrix, its values stored by rows.
+	KIND_CSR             //!< A sparse matrix: values, row pointers, columns.
+};
+
+/** The header of the binary format, which is followed by the data.
+ *  Numbers are stored in the native byte order.  The header is 64 bytes long,
+ *  so that the data following it are aligned within the file. */
+struct MatrixFileHeader
+{
+	char magic[8];             //!< Always @a g_magic.
+	uint32_t byte_order;       //!< MATRIXIO_BYTE_ORDER as written.
+	uint32_t version;          //!< MATRIXIO_VERSION.
+	uint32_t kind;             //!< What is stored, see MatrixFileKind.
+	uint32_t rows;             //!< Number of rows of a matrix.
+	uint32_t cols;             //!< Number of columns of a matrix.
+	uint32_t reserved;         //!< Always zero.
+	uint64_t nnz;              //!< Number of values of a sparse matrix.
+	uint64_t data_length;      //!< Length of the data following the header.
+	uint64_t data_checksum;    //!< Checksum of the data.
+	uint64_t header_checksum;  //!< Checksum of the header up to this field.
+};
+
+#define CHECKSUM_BASIS  0xcbf29ce484222325ULL  //!< Initial checksum value.
+#define CHECKSUM_PRIME  0x100000001b3ULL       //!< Multiplier for checksums.
+
+/** Update a 64-bit FNV-1a checksum, taking whole words at a time
+ *  to keep up with the disk. */
+static uint64_t
+checksum (uint64_t hash, const void *data, size_t length)
+{
+	const char *p = static_cast<const char *> (data);
+	for (; length >= sizeof (uint64_t); length -= sizeof (uint64_t))
+	{
+		uint64_t word;
+		memcpy (&word, p, sizeof word);
+		hash = (hash ^ word) * CHECKSUM_PRIME;
+		p += sizeof word;
+	}
+	while (length--)
+		hash = (hash ^ (unsigned char) *p++) * CHECKSUM_PRIME;
+	return hash;
+}
+
+/** Compute the checksum of a header. */
+static uint64_t
+header_checksum (const MatrixFileHeader &header)
+{
+	return checksum (CHECKSUM_BASIS,
+		&header, offsetof (MatrixFileHeader, header_checksum));
+}
+
+/** A contiguous piece of data to be written after the header. */
+typedef pair<const void *, size_t> Section;
+
+/** Make a section out of the contents of a vector. */
+template<class T> static Section
+vector_section (const vector<T> &v)
+{
+	return Section (v.empty () ? NULL : &v[0], v.size () * sizeof (T));
+}
+
+/** Fill in the rest of the header and write it out, followed by the data. */
+static bool
+write_file (ofstream &ofs, MatrixFileHeader &header,
+	const Section *sections, unsigned n_sections)
+{
+	header.data_length = 0;
+	header.data_checksum = CHECKSUM_BASIS;
+	for (unsigned i = 0; i < n_sections; i++)
+	{
+		header.data_length += sections[i].second;
+		header.data_checksum = checksum (header.data_checksum,
+			sections[i].first, sections[i].second);
+	}
+	header.header_checksum = header_checksum (header);
+
+	if (!ofs.write ((const char *) &header, sizeof header))
+		return false;
+	for (unsigned i = 0; i < n_sections; i++)
+		if (!ofs.write ((const char *) sections[i].first, sections[i].second))
+			return false;
+	return ofs.flush ().good ();
+}
+
+/** Save a dense matrix kept out of core, one row of tiles at a time.
+ *  The header is only completed when all the data have been written. */
+static bool
+save_tiled (ofstream &ofs, MatrixFileHeader &header,
+	const MatrixTiledStorage &mts)
+{
+	header.kind = KIND_DENSE;
+	if (!ofs.write ((const char *) &header, sizeof header))
+		return false;
+
+	header.data_length = 0;
+	header.data_checksum = CHECKSUM_BASIS;
+
+	double *panel = new double[(size_t) TILED_SIZE * header.cols];
+	for (unsigned ti = 0; ti < mts.get_tile_rows (); ti++)
+	{
+		mts.read_rows (ti, panel);
+
+		unsigned rows = min (TILED_SIZE, header.rows - ti * TILED_SIZE);
+		size_t length = (size_t) rows * header.cols * sizeof *panel;
+		header.data_length += length;
+		header.data_checksum =
+			checksum (header.data_checksum, panel, length);
+		if (!ofs.write ((const char *) panel, length))
+			break;
+	}
+	delete [] panel;
+
+	header.header_checksum = header_checksum (header);
+	return ofs.seekp (0)
+		&& ofs.write ((const char *) &header, sizeof header)
+		&& ofs.flush ().good ();
+}
+
+/** Save a sparse matrix in the compressed sparse row format. */
+static bool
+save_sparse (ofstream &ofs, MatrixFileHeader &header, const Matrix &m)
+{
+	/* Other kinds of storage have to be compressed first. */
+	Matrix compressed = m.compress ();
+	const MatrixCSRStorage &csr =
+		static_cast<const MatrixCSRStorage &> (compressed.get_storage ());
+	header.kind = KIND_CSR;
+	header.nnz = csr.get_vals ().size ();
+
+	/* The values go first, to keep them aligned. */
+	Section sections[] =
+	{
+		vector_section (csr.get_vals ()),
+		vector_section (csr.get_row_ptr ()),
+		vector_section (csr.get_col_idx ())
+	};
+	return write_file (ofs, header, sections, 3);
+}
+
+bool
+save_value (const Value &value, const std::string &filename)
+{
+	TextFormat format = text_format (filename);
+	if (format != TEXT_NONE)
+		return text_export (value, filename, format);
+
+	ofstream ofs (filename.c_str (), ios::binary);
+	if (!ofs)
+		return false;
+
+	MatrixFileHeader header;
+	memset (&header, 0, sizeof header);
+	memcpy (header.magic, g_magic, sizeof header.magic);
+	header.byte_order = MATRIXIO_BYTE_ORDER;
+	header.version = MATRIXIO_VERSION;
+
+	int64_t integer;
+	switch (value.type)
+	{
+	case Value::INTEGER:
+	{
+		integer = value.integer;
+		header.kind = KIND_INTEGER;
+		Section section (&integer, sizeof integer);
+		return write_file (ofs, header, &section, 1);
+	}
+	case Value::REAL:
+	{
+		header.kind = KIND_REAL;
+		Section section (&value.real, sizeof value.real);
+		return write_file (ofs, header, &section, 1);
+	}
+	case Value::MATRIX:
+	{
+		/* Views of other matrices are saved with their own values. */
+		Matrix m = value.matrix->materialize ();
+		const MatrixStorage *ms = &m.get_storage ();
+		header.rows = ms->get_rows ();
+		header.cols = ms->get_cols ();
+
+		const MatrixArrayStorage *mas =
+			dynamic_cast<const MatrixArrayStorage *> (ms);
+		if (mas)
+		{
+			header.kind = KIND_DENSE;
+			Section section (mas->get_values (),
+				(size_t) header.rows * header.cols * sizeof (double));
+			return write_file (ofs, header, &section, 1);
+		}
+		const MatrixTiledStorage *mts =
+			dynamic_cast<const MatrixTiledStorage *> (ms);
+		if (mts)
+			return save_tiled (ofs, header, *mts);
+		return save_sparse (ofs, header, m);
+	}
+	default:
+		return false;
+	}
+}
+
+
+MatrixMappedStorage::MatrixMappedStorage (unsigned rows, unsigned cols,
+	void *mapping, size_t length, size_t offset)
+	: MatrixArrayStorage (rows, cols,
+		(double *) (static_cast<char *> (mapping) + offset)),
+	  mapping (mapping), length (length)
+{
+}
+
+MatrixMappedStorage::~MatrixMappedStorage ()
+{
+#ifdef HAVE_MMAP
+	munmap (mapping, length);
+#endif /* HAVE_MMAP */
+	values = NULL;
+}
+
+#ifdef HAVE_MMAP
+
+/** Map a dense matrix described by @a header into memory. */
+static MatrixStorage *
+load_dense_mapped (const string &filename, const MatrixFileHeader &header)
+{
+	int fd = open (filename.c_str (), O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	size_t length = sizeof header + header.data_length;
+	if (fstat (fd, &st) || (uint64_t) st.st_size < length)
+	{
+		close (fd);
+		return NULL;
+	}
+
+	/* A private mapping lets the values be changed in memory. */
+	void *mapping = mmap (NULL, length,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	/* Make sure it's still the same file. */
+	if (memcmp (mapping, &header, sizeof header))
+	{
+		munmap (mapping, length);
+		return NULL;
+	}
+
+	return new MatrixMappedStorage (header.rows, header.cols,
+		mapping, length, sizeof header);
+}
+
+#endif /* HAVE_MMAP */
+
+/** Read a dense matrix described by @a header into memory. */
+static MatrixStorage *
+load_dense (ifstream &ifs, const MatrixFileHeader &header)
+{
+	MatrixArrayStorage *mas =
+		new MatrixArrayStorage (header.rows, header.cols, false);
+	if (!ifs.read ((char *) mas->get_values (), header.data_length)
+	 || checksum (CHECKSUM_BASIS, mas->get_values (), header.data_length)
+		!= header.data_checksum)
+	{
+		delete mas;
+		return NULL;
+	}
+	return mas;
+}
+
+/** Read a sparse matrix described by @a header into memory. */
+static MatrixStorage *
+load_sparse (ifstream &ifs, const MatrixFileHeader &header)
+{
+	vector<unsigned> row_ptr (header.rows + 1), col_idx (header.nnz);
+	vector<double> vals (header.nnz);
+
+	Section sections[] =
+	{
+		vector_section (vals),
+		vector_section (row_ptr),
+		vector_section (col_idx)
+	};
+
+	uint64_t hash = CHECKSUM_BASIS;
+	for (unsigned i = 0; i < 3; i++)
+	{
+		if (!ifs.read ((char *) sections[i].first, sections[i].second))
+			return NULL;
+		hash = checksum (hash, sections[i].first, sections[i].second);
+	}
+	if (hash != header.data_checksum)
+		return NULL;
+
+	/* Don't let anything unexpected into the storage. */
+	if (row_ptr[0] || row_ptr[header.rows] != header.nnz)
+		return NULL;
+	for (unsigned r = 0; r < header.rows; r++)
+	{
+		if (row_ptr[r] > row_ptr[r + 1])
+			return NULL;
+		for (unsigned i = row_ptr[r]; i < row_ptr[r + 1]; i++)
+			if (col_idx[i] >= header.cols
+			 || (i > row_ptr[r] && col_idx[i - 1] >= col_idx[i]))
+				return NULL;
+	}
+
+	MatrixCSRStorage *csr = new MatrixCSRStorage (header.rows, header.cols);
+	csr->assign (row_ptr, col_idx, vals);
+	return csr;
+}
+
+/** Load a value in the format used by older versions of the program. */
+static bool
+load_legacy (Value &value, ifstream &ifs)
+{
+	int type;
+	if (!ifs.read ((char *) &type, sizeof value.type))
+		return false;
+
+	Value loaded;
+	switch (type)
+	{
+	case Value::INTEGER:
+		if (!ifs.read ((char *) &loaded.integer, sizeof loaded.integer))
+			return false;
+		break;
+	case Value::REAL:
+		if (!ifs.read ((char *) &loaded.real,    sizeof loaded.real))
+			return false;
+		loaded.type = Value::REAL;
+		break;
+	case Value::MATRIX:
+		/* So far we only distinguish two kinds of matrix storage. */
+		bool sparse;
+		if (!ifs.read ((char *) &sparse, sizeof sparse))
+			return false;
+
+		try
+		{
+			loaded.matrix = new Matrix (sparse
+				? static_cast<MatrixStorage *> (new MatrixCSRStorage   (ifs))
+				: static_cast<MatrixStorage *> (new MatrixArrayStorage (ifs)));
+			loaded.type = Value::MATRIX;
+		}
+		catch (const EDataError &)
+		{
+			return false;
+		}
+		break;
+	default:
+		return false;
+	}
+
+	value = loaded;
+	return true;
+}
+
+bool
+load_value (Value &value, const std::string &filename)
+{
+	TextFormat format = text_format (filename);
+	if (format != TEXT_NONE)
+		return text_import (value, filename, format);
+
+	ifstream ifs (filename.c_str (), ios::binary);
+	MatrixFileHeader header;
+
+	if (!ifs || !ifs.read (header.magic, sizeof header.magic))
+		return false;
+	if (memcmp (header.magic, g_magic, sizeof header.magic))
+	{
+		ifs.seekg (0);
+		return load_legacy (value, ifs);
+	}
+
+	if (!ifs.read ((char *) &header + sizeof header.magic,
+		sizeof header - sizeof header.magic)
+	 || header.byte_order != MATRIXIO_BYTE_ORDER
+	 || header.version != MATRIXIO_VERSION
+	 || header.header_checksum != header_checksum (header))
+		return false;
+
+	Value loaded;
+	MatrixStorage *ms = NULL;
+	uint64_t cells = (uint64_t) header.rows * header.cols;
+
+	switch (header.kind)
+	{
+	case KIND_INTEGER:
+		int64_t integer;
+		if (header.data_length != sizeof integer
+		 || !ifs.read ((char *) &integer, sizeof integer)
+		 || checksum (CHECKSUM_BASIS, &integer, sizeof integer)
+			!= header.data_checksum)
+			return false;
+
+		loaded.type = Value::INTEGER;
+		loaded.integer = integer;
+		break;
+	case KIND_REAL:
+		if (header.data_length != sizeof loaded.real
+		 || !ifs.read ((char *) &loaded.real, sizeof loaded.real)
+		 || checksum (CHECKSUM_BASIS, &loaded.real, sizeof loaded.real)
+			!= header.data_checksum)
+			return false;
+
+		loaded.type = Value::REAL;
+		break;
+	case KIND_DENSE:
+		if (!cells || header.data_length != cells * sizeof (double))
+			return false;
+
+		/* Mapped values are only paged in as they're needed,
+		 * so they can't be verified against the checksum. */
+#ifdef HAVE_MMAP
+		ms = load_dense_mapped (filename, header);
+#endif /* HAVE_MMAP */
+		if (!ms)
+			ms = load_dense (ifs, header);
+		break;
+	case KIND_CSR:
+		if (!cells || header.nnz > cells || header.data_length != header.nnz
+			* (sizeof (double) + sizeof (unsigned))
+			+ (header.rows + 1ULL) * sizeof (unsigned))
+			return false;
+
+		ms = load_sparse (ifs, header);
+		break;
+	default:
+		return false;
+	}
+
+	if (header.kind == KIND_DENSE || header.kind == KIND_CSR)
+	{
+		if (!ms)
+			return false;
+
+		loaded.type = Value::MATRIX;
+		loaded.matrix = new Matrix (ms);
+	}
+
+	value = loaded;
+	return true;
+}
@@ -0,0 +1,38 @@
+/**
+ * @file matrixio.h
+ * Loading and saving values in files.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __MATRIXIO_H__
+#define __MATRIXIO_H__
+
+/** Dense storage backed by a private mapping of a file.  Pages are only
+ *  read in as they're accessed, and changed ones are copied by the system,
+ *  so the file itself never gets modified. */
+class MatrixMappedStorage : public MatrixArrayStorage
+{
+	void *mapping;       //!< Address of the mapping.
+	size_t length;       //!< Length of the mapping.
+public:
+	/** Take over a mapping, the values being at @a offset within it. */
+	MatrixMappedStorage (unsigned rows, unsigned cols,
+		void *mapping, size_t length, size_t offset);
+	virtual ~MatrixMappedStorage ();
+};
+
+/** Save a value into a file.  Matrices are stored in a versioned binary
+ *  format with the values aligned in the file, so that dense matrices
+ *  can be mapped into memory when loading them, and sparse ones are
+ *  read in as contiguous compressed sparse row arrays.  Files with
+ *  an extension of a text format are written by text_export() instead. */
+bool save_value (const Value &value, const std::string &filename);
+
+/** Load a value from a file.  Files written by older versions of the program,
+ *  which only used a plain dump of all the structures, are accepted as well.
+ *  Files with an extension of a text format are read by text_import(). */
+bool load_value (Value &value, const std::string &filename);
+
+#endif /* ! __MATRIXIO_H__ */
@@ -0,0 +1,23 @@
+/**
+ * @file numlocale.h
+ * Locale-independent formatting of numbers.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __NUMLOCALE_H__
+#define __NUMLOCALE_H__
+
+/** Switches the locale of numbers to "C" for as long as it exists,
+ *  so that printf() and strtod() use dots for decimal points. */
+class NumericLocale
+{
+	std::string saved;   //!< The locale to switch back to.
+public:
+	NumericLocale () : saved (setlocale (LC_NUMERIC, NULL))
+		{setlocale (LC_NUMERIC, "C");}
+	~NumericLocale () {setlocale (LC_NUMERIC, saved.c_str ());}
+};
+
+#endif /* ! __NUMLOCALE_H__ */
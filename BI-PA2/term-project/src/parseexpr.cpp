@@ -9,6 +9,7 @@
 #include <iostream>
 #include <stack>
 #include <map>
+#include <vector>
 
 #include <config.h>
 
@@ -122,7 +123,7 @@ apply (stack<EvalNode *> &output, stack<const Operator *> &op_stack)
 }
 
 static void
-process_tokens (Parser &p,
+process_tokens (Parser &p, Environ &e,
 	stack<EvalNode *> &output, stack<const Operator *> &op_stack)
 {
 	int expect = UNARY;
@@ -135,7 +136,7 @@ process_tokens (Parser &p,
 		else if (p.accept (INTEGER))
 			output.push (new IntegerNode (p.last ().i));
 		else if (p.accept (IDENT))
-			output.push (new     VarNode (p.last ().s));
+			output.push (new     VarNode (e.intern (p.last ().s)));
 		else if (p.accept (LPAREN))
 		{
 			op_stack.push (translate (p.last (), SPECIAL));
@@ -176,14 +177,15 @@ process_tokens (Parser &p,
 }
 
 EvalNode *
-parse_expression (Parser &p) throw (EInvalidExpression, EParserUnexpected)
+parse_expression (Parser &p, Environ &e)
+	throw (EInvalidExpression, EParserUnexpected)
 {
 	stack<EvalNode *> output;
 	stack<const Operator *> op_stack;
 
 	try
 	{
-		process_tokens (p, output, op_stack);
+		process_tokens (p, e, output, op_stack);
 
 		while (!op_stack.empty ())
 		{
@@ -21,8 +21,8 @@ public:
 	virtual const char *what () const throw () {return message.c_str ();}
 };
 
-/** Parse an expression. */
-EvalNode *parse_expression (Parser &p)
+/** Parse an expression, interning variable names in @a e. */
+EvalNode *parse_expression (Parser &p, Environ &e)
 	throw (EInvalidExpression, EParserUnexpected);
 
 #endif /* ! __PARSEEXPR_H__ */
@@ -0,0 +1,303 @@
+/**
+ * @file profile.cpp
+ * Profiling of statements and operations.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ * Every scope that gets opened while profiling is on is recorded as an event
+ * with its wall time and with how much the counters have grown in the
+ * meantime.  The summary merges events of the same name, the trace keeps
+ * all of them as they came.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <cstdio>
+#include <clocale>
+#include <stdint.h>
+
+#include <sys/time.h>
+
+#include <config.h>
+
+#include "profile.h"
+#include "numlocale.h"
+
+#include "gettext.h"
+#define _(String) gettext (String)
+
+using namespace std;
+
+
+/** Names of scopes are cut to this many bytes in the summary. */
+#define PROFILE_NAME_WIDTH 32
+
+bool g_profiling;
+
+/** A recorded scope. */
+struct ProfileEvent
+{
+	string name;                      //!< Name of the scope.
+	ProfileCategory category;         //!< Kind of the scope.
+	double start;                     //!< Seconds since profiling started.
+	double duration;                  //!< Wall time spent in the scope.
+	double nested;                    //!< Time spent in nested scopes.
+	uint64_t counts[PROFILE_COUNTERS];  //!< Growth of the counters.
+};
+
+/** Totals of events of the same name. */
+struct ProfileTotals
+{
+	ProfileCategory category;         //!< Kind of the scopes.
+	string name;                      //!< Name of the scopes.
+	unsigned calls;                   //!< Number of events.
+	double duration;                  //!< Total wall time.
+	double self;                      //!< Time not spent in nested scopes.
+	uint64_t counts[PROFILE_COUNTERS];  //!< Total growth of the counters.
+
+	/** Order by the kind of scopes first, then by time spent, longest
+	 *  first, and by name, so that the output is stable. */
+	bool operator< (const ProfileTotals &o) const
+	{
+		if (category != o.category)
+			return category < o.category;
+		if (duration != o.duration)
+			return duration > o.duration;
+		return name < o.name;
+	}
+};
+
+static volatile uint64_t g_counters[PROFILE_COUNTERS];
+static vector<ProfileEvent> g_events;   //!< Recorded scopes, by start.
+static vector<unsigned> g_open;         //!< Indexes of open scopes.
+static double g_epoch;                  //!< When profiling has started.
+
+static const char *const g_category_names[] =
+	{"statement", "phase", "operation"};
+static const char *const g_counter_names[PROFILE_COUNTERS] =
+	{"allocations", "cloned_bytes", "gets", "puts"};
+
+/** Get the current time in seconds. */
+static double
+get_time ()
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void
+profile_start ()
+{
+	g_events.clear ();
+	g_open.clear ();
+	for (unsigned i = 0; i < PROFILE_COUNTERS; i++)
+		g_counters[i] = 0;
+
+	g_epoch = get_time ();
+	g_profiling = true;
+}
+
+void
+profile_stop ()
+{
+	while (!g_open.empty ())
+		profile_end ();
+	g_profiling = false;
+}
+
+void
+profile_add (ProfileCounter counter, uint64_t n)
+{
+#ifdef __GNUC__
+	__sync_fetch_and_add (&g_counters[counter], n);
+#else /* ! __GNUC__ */
+	g_counters[counter] += n;
+#endif /* ! __GNUC__ */
+}
+
+void
+profile_begin (const char *name, ProfileCategory category)
+{
+	ProfileEvent event;
+	event.name = name;
+	event.category = category;
+	event.nested = event.duration = 0;
+
+	/* The counters are kept here until the scope is closed. */
+	for (unsigned i = 0; i < PROFILE_COUNTERS; i++)
+		event.counts[i] = g_counters[i];
+
+	g_open.push_back (g_events.size ());
+	g_events.push_back (event);
+	g_events.back ().start = get_time () - g_epoch;
+}
+
+void
+profile_end ()
+{
+	/* Scopes opened before profiling has been stopped. */
+	if (g_open.empty ())
+		return;
+
+	ProfileEvent &event = g_events[g_open.back ()];
+	event.duration = get_time () - g_epoch - event.start;
+	for (unsigned i = 0; i < PROFILE_COUNTERS; i++)
+		event.counts[i] = g_counters[i] - event.counts[i];
+
+	g_open.pop_back ();
+	if (!g_open.empty ())
+		g_events[g_open.back ()].nested += event.duration;
+}
+
+/** Print out a row of the summary. */
+static void
+print_row (ostream &os, const string &name, const char *calls,
+	const char *duration, const char *self, const char *counts[])
+{
+	char buff[160];
+	string cut = name;
+	if (cut.length () > PROFILE_NAME_WIDTH)
+		cut = cut.substr (0, PROFILE_NAME_WIDTH - 3) + "...";
+
+	snprintf (buff, sizeof buff, "%-*s %7s %11s %11s %8s %12s %10s %10s",
+		PROFILE_NAME_WIDTH, cut.c_str (), calls, duration, self,
+		counts[0], counts[1], counts[2], counts[3]);
+	os << buff << endl;
+}
+
+void
+profile_summary (ostream &os)
+{
+	map<pair<int, string>, ProfileTotals> merged;
+	double total = 0;
+	unsigned statements = 0;
+
+	for (unsigned i = 0; i < g_events.size (); i++)
+	{
+		const ProfileEvent &event = g_events[i];
+		pair<int, string> key (event.category, event.name);
+
+		map<pair<int, string>, ProfileTotals>::iterator iter
+			= merged.find (key);
+		if (iter == merged.end ())
+		{
+			ProfileTotals &t = merged[key];
+			t.category = event.category;
+			t.name = event.name;
+			t.calls = 0;
+			t.duration = t.self = 0;
+			for (unsigned k = 0; k < PROFILE_COUNTERS; k++)
+				t.counts[k] = 0;
+			iter = merged.find (key);
+		}
+
+		ProfileTotals &t = iter->second;
+		t.calls++;
+		t.duration += event.duration;
+		t.self += event.duration - event.nested;
+		for (unsigned k = 0; k < PROFILE_COUNTERS; k++)
+			t.counts[k] += event.counts[k];
+
+		if (event.category == PROFILE_STATEMENT)
+		{
+			statements++;
+			total += event.duration;
+		}
+	}
+
+	vector<ProfileTotals> rows;
+	map<pair<int, string>, ProfileTotals>::const_iterator iter;
+	for (iter = merged.begin (); iter != merged.end (); iter++)
+		rows.push_back (iter->second);
+	sort (rows.begin (), rows.end ());
+
+	char buff[80];
+	snprintf (buff, sizeof buff, _("Statements: %u, taking %.3f ms"),
+		statements, total * 1e3);
+	os << buff << endl << endl;
+
+	const char *headings[PROFILE_COUNTERS] =
+		{_("Allocs"), _("Copied B"), _("Gets"), _("Puts")};
+	print_row (os, _("Scope"), _("Calls"), _("Time ms"), _("Self ms"),
+		headings);
+
+	for (unsigned i = 0; i < rows.size (); i++)
+	{
+		const ProfileTotals &t = rows[i];
+		if (!i || t.category != rows[i - 1].category)
+			os << "[" << g_category_names[t.category] << "]" << endl;
+
+		char calls[16], duration[32], self[32], numbers[PROFILE_COUNTERS][24];
+		const char *counts[PROFILE_COUNTERS];
+		snprintf (calls, sizeof calls, "%u", t.calls);
+		snprintf (duration, sizeof duration, "%.3f", t.duration * 1e3);
+		snprintf (self, sizeof self, "%.3f", t.self * 1e3);
+		for (unsigned k = 0; k < PROFILE_COUNTERS; k++)
+		{
+			snprintf (numbers[k], sizeof numbers[k], "%llu",
+				(unsigned long long) t.counts[k]);
+			counts[k] = numbers[k];
+		}
+		print_row (os, t.name, calls, duration, self, counts);
+	}
+}
+
+/** Write out @a s as a JSON string. */
+static void
+write_json_string (ostream &os, const string &s)
+{
+	os << '"';
+	for (unsigned i = 0; i < s.length (); i++)
+	{
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			os << '\\' << c;
+		else if (c < 0x20)
+		{
+			char buff[8];
+			snprintf (buff, sizeof buff, "\\u%04x", c);
+			os << buff;
+		}
+		else
+			os << c;
+	}
+	os << '"';
+}
+
+bool
+profile_trace (const string &filename)
+{
+	ofstream os (filename.c_str ());
+	if (!os)
+		return false;
+
+	/* JSON wants dots for decimal points, whatever the locale says. */
+	NumericLocale locale;
+	os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	for (unsigned i = 0; i < g_events.size (); i++)
+	{
+		const ProfileEvent &event = g_events[i];
+		char buff[80];
+
+		os << (i ? ",\n" : "\n") << "{\"name\":";
+		write_json_string (os, event.name);
+		snprintf (buff, sizeof buff,
+			",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f",
+			event.start * 1e6, event.duration * 1e6);
+		os << ",\"cat\":\"" << g_category_names[event.category] << "\""
+			<< buff << ",\"args\":{";
+		for (unsigned k = 0; k < PROFILE_COUNTERS; k++)
+			os << (k ? "," : "") << "\"" << g_counter_names[k] << "\":"
+				<< (unsigned long long) event.counts[k];
+		os << "}}";
+	}
+	os << "\n]}" << endl;
+	return os;
+}
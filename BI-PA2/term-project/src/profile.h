@@ -0,0 +1,73 @@
+/**
+ * @file profile.h
+ * Profiling of statements and operations.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+/** Events that are counted while profiling. */
+enum ProfileCounter
+{
+	PROFILE_ALLOCATIONS,   //!< MatrixStorage objects created.
+	PROFILE_CLONED_BYTES,  //!< Bytes copied by MatrixStorage::clone().
+	PROFILE_GETS,          //!< Calls to MatrixStorage::get().
+	PROFILE_PUTS,          //!< Calls to MatrixStorage::put().
+	PROFILE_COUNTERS       //!< The number of counters.
+};
+
+/** Kinds of profiled scopes. */
+enum ProfileCategory
+{
+	PROFILE_STATEMENT,     //!< A statement, either entered or in a script.
+	PROFILE_PHASE,         //!< Parsing or compiling.
+	PROFILE_OPERATION      //!< An operation of the evaluation tree.
+};
+
+/** Whether profiling is on.  Only checked by inline functions,
+ *  so that it doesn't cost more than a branch while it's off. */
+extern bool g_profiling;
+
+/** Start profiling, discarding anything recorded before. */
+void profile_start ();
+/** Stop profiling, ending all scopes that are still open. */
+void profile_stop ();
+
+/** Add @a n to a counter.  May be called from any thread. */
+void profile_add (ProfileCounter counter, uint64_t n);
+/** Count an event if profiling is on. */
+inline void profile_count (ProfileCounter counter, uint64_t n = 1)
+{
+	if (g_profiling)
+		profile_add (counter, n);
+}
+
+/** Open a scope nested in the current one.  Only to be called
+ *  from the main thread. */
+void profile_begin (const char *name, ProfileCategory category);
+/** Close the innermost scope. */
+void profile_end ();
+
+/** Print out a table of the time spent in scopes of the same name,
+ *  along with the counters, for everything recorded so far. */
+void profile_summary (std::ostream &os);
+/** Save everything recorded so far as a JSON file in the trace event
+ *  format, to be viewed in chrome://tracing and similar tools. */
+bool profile_trace (const std::string &filename);
+
+/** Profiles the lifetime of the object, if profiling is on. */
+class ProfileScope
+{
+	bool active;         //!< Whether a scope has been opened.
+public:
+	/** Open a scope, see profile_begin(). */
+	ProfileScope (const char *name, ProfileCategory category)
+		: active (g_profiling) {if (active) profile_begin (name, category);}
+	/** Close the scope. */
+	~ProfileScope () {if (active) profile_end ();}
+};
+
+#endif /* ! __PROFILE_H__ */
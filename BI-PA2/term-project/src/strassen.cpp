@@ -0,0 +1,240 @@
+/**
+ * @file strassen.cpp
+ * Strassen-Winograd matrix multiplication.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ * On each level, the operands are split into quadrants, and the product
+ * is assembled from 7 products of sums of quadrants, using Winograd's
+ * variant with 15 additions.  The operands are padded with zeros in advance,
+ * so that they can be split evenly all the way down to the cutoff.
+ *
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <config.h>
+
+#include "gemm.h"
+#include "strassen.h"
+
+using namespace std;
+
+
+/** The default size below which gemm() is faster.  It's relatively high,
+ *  since gemm() itself runs close to the peak of the processor. */
+#define STRASSEN_CUTOFF 1024
+
+/** Products of matrices of too different dimensions are left alone. */
+#define STRASSEN_MAX_RATIO 2
+
+/** Read the cutoff from the environment, zero meaning it's disabled. */
+static unsigned
+strassen_get_cutoff ()
+{
+	const char *env = getenv ("MATRIXCALC_STRASSEN");
+	if (!env || !atoi (env))
+		return 0;
+
+	env = getenv ("MATRIXCALC_STRASSEN_CUTOFF");
+	if (env && atoi (env) >= 16)
+		return atoi (env);
+	return STRASSEN_CUTOFF;
+}
+
+/** Compute C = A + B for @a m by @a n matrices.  C may be either of them. */
+static void
+add (unsigned m, unsigned n, const double *a, unsigned lda,
+	const double *b, unsigned ldb, double *c, unsigned ldc)
+{
+	for (unsigned r = 0; r < m; r++)
+	{
+		const double *ar = a + (size_t) r * lda;
+		const double *br = b + (size_t) r * ldb;
+		double *cr = c + (size_t) r * ldc;
+		for (unsigned i = 0; i < n; i++)
+			cr[i] = ar[i] + br[i];
+	}
+}
+
+/** Compute C = A - B for @a m by @a n matrices.  C may be either of them. */
+static void
+sub (unsigned m, unsigned n, const double *a, unsigned lda,
+	const double *b, unsigned ldb, double *c, unsigned ldc)
+{
+	for (unsigned r = 0; r < m; r++)
+	{
+		const double *ar = a + (size_t) r * lda;
+		const double *br = b + (size_t) r * ldb;
+		double *cr = c + (size_t) r * ldc;
+		for (unsigned i = 0; i < n; i++)
+			cr[i] = ar[i] - br[i];
+	}
+}
+
+/** Return the size of the workspace needed by strassen_level(). */
+static size_t
+strassen_workspace (unsigned levels, unsigned m, unsigned n, unsigned k)
+{
+	size_t size = 0;
+	for (; levels--; m /= 2, n /= 2, k /= 2)
+		size += (size_t) m / 2 * (k / 2) + (size_t) k / 2 * (n / 2)
+			+ (size_t) m / 2 * (n / 2);
+	return size;
+}
+
+/** Compute C = A * B with @a levels levels of recursion.  The dimensions
+ *  have to be divisible by 2 ^ @a levels.  Temporaries of each level
+ *  are taken from the beginning of @a ws, the rest is left to the next one.
+ *
+ *  Besides C itself, only three temporaries are needed: X for sums
+ *  of quadrants of A, Y for sums of quadrants of B and Z for one
+ *  of the products, the others being kept in quadrants of C.
+ */
+static void
+strassen_level (unsigned levels, unsigned m, unsigned n, unsigned k,
+	const double *a, unsigned lda, const double *b, unsigned ldb,
+	double *c, unsigned ldc, double *ws)
+{
+	if (!levels)
+	{
+		gemm (m, n, k, 1, a, lda, b, ldb, 0, c, ldc);
+		return;
+	}
+
+	unsigned m2 = m / 2, n2 = n / 2, k2 = k / 2;
+	const double *a11 = a, *a12 = a + k2;
+	const double *a21 = a + (size_t) m2 * lda, *a22 = a21 + k2;
+	const double *b11 = b, *b12 = b + n2;
+	const double *b21 = b + (size_t) k2 * ldb, *b22 = b21 + n2;
+	double *c11 = c, *c12 = c + n2;
+	double *c21 = c + (size_t) m2 * ldc, *c22 = c21 + n2;
+
+	double *x = ws;
+	double *y = x + (size_t) m2 * k2;
+	double *z = y + (size_t) k2 * n2;
+	double *next = z + (size_t) m2 * n2;
+	levels--;
+
+	/* C21 = P7 = (A11 - A21) * (B22 - B12) */
+	sub (m2, k2, a11, lda, a21, lda, x, k2);
+	sub (k2, n2, b22, ldb, b12, ldb, y, n2);
+	strassen_level (levels, m2, n2, k2, x, k2, y, n2, c21, ldc, next);
+
+	/* C22 = P5 = (A21 + A22) * (B12 - B11) */
+	add (m2, k2, a21, lda, a22, lda, x, k2);
+	sub (k2, n2, b12, ldb, b11, ldb, y, n2);
+	strassen_level (levels, m2, n2, k2, x, k2, y, n2, c22, ldc, next);
+
+	/* C12 = P6 = (A21 + A22 - A11) * (B22 - B12 + B11) */
+	sub (m2, k2, x, k2, a11, lda, x, k2);
+	sub (k2, n2, b22, ldb, y, n2, y, n2);
+	strassen_level (levels, m2, n2, k2, x, k2, y, n2, c12, ldc, next);
+
+	/* C11 = P3 = (A12 - A21 - A22 + A11) * B22 */
+	sub (m2, k2, a12, lda, x, k2, x, k2);
+	strassen_level (levels, m2, n2, k2, x, k2, b22, ldb, c11, ldc, next);
+
+	/* Z = P1 = A11 * B11 */
+	strassen_level (levels, m2, n2, k2, a11, lda, b11, ldb, z, n2, next);
+
+	add (m2, n2, z,   n2,  c12, ldc, c12, ldc);  /* C12 = U2 = P1 + P6 */
+	add (m2, n2, c12, ldc, c21, ldc, c21, ldc);  /* C21 = U3 = U2 + P7 */
+	add (m2, n2, c12, ldc, c22, ldc, c12, ldc);  /* C12 = U4 = U2 + P5 */
+	add (m2, n2, c21, ldc, c22, ldc, c22, ldc);  /* C22 = U3 + P5 */
+	add (m2, n2, c12, ldc, c11, ldc, c12, ldc);  /* C12 = U4 + P3 */
+
+	/* C11 = P4 = A22 * (B22 - B12 + B11 - B21), C21 = U3 - P4 */
+	sub (k2, n2, y, n2, b21, ldb, y, n2);
+	strassen_level (levels, m2, n2, k2, a22, lda, y, n2, c11, ldc, next);
+	sub (m2, n2, c21, ldc, c11, ldc, c21, ldc);
+
+	/* C11 = P2 + P1 = A12 * B21 + P1 */
+	strassen_level (levels, m2, n2, k2, a12, lda, b21, ldb, c11, ldc, next);
+	add (m2, n2, z, n2, c11, ldc, c11, ldc);
+}
+
+/** Copy an @a m by @a n matrix, transposed if @a trans is set, into
+ *  @a padded with @a ld columns, leaving the rest of it zero. */
+static void
+pad (const double *source, unsigned ls, bool trans, unsigned m, unsigned n,
+	double *padded, unsigned ld)
+{
+	for (unsigned r = 0; r < m; r++)
+	{
+		double *out = padded + (size_t) r * ld;
+		if (trans)
+			for (unsigned c = 0; c < n; c++)
+				out[c] = source[(size_t) c * ls + r];
+		else
+			memcpy (out, source + (size_t) r * ls, n * sizeof *out);
+	}
+}
+
+void
+strassen (bool trans_a, bool trans_b,
+	unsigned m, unsigned n, unsigned k,
+	const double *a, unsigned lda,
+	const double *b, unsigned ldb,
+	double *c, unsigned ldc)
+{
+	static unsigned cutoff = strassen_get_cutoff ();
+
+	unsigned lo = min (m, min (n, k));
+	unsigned hi = max (m, max (n, k));
+	unsigned levels = 0;
+	while (cutoff && (lo >> levels) > cutoff)
+		levels++;
+
+	if (!levels || hi > STRASSEN_MAX_RATIO * lo)
+	{
+		gemm (trans_a, trans_b, m, n, k, 1, a, lda, b, ldb, 0, c, ldc);
+		return;
+	}
+
+	/* Pad all dimensions to be divisible by 2 ^ levels.  Transposed
+	 * operands are simply stored transposed in the padded copies. */
+	unsigned mask = (1U << levels) - 1;
+	unsigned mp = (m + mask) & ~mask;
+	unsigned np = (n + mask) & ~mask;
+	unsigned kp = (k + mask) & ~mask;
+
+	double *pa = NULL, *pb = NULL, *pc = NULL;
+	if (trans_a || mp != m || kp != k)
+	{
+		pa = new double[(size_t) mp * kp] ();
+		pad (a, lda, trans_a, m, k, pa, kp);
+		a = pa;
+		lda = kp;
+	}
+	if (trans_b || kp != k || np != n)
+	{
+		pb = new double[(size_t) kp * np] ();
+		pad (b, ldb, trans_b, k, n, pb, np);
+		b = pb;
+		ldb = np;
+	}
+
+	double *out = c;
+	unsigned ldo = ldc;
+	if (mp != m || np != n)
+	{
+		out = pc = new double[(size_t) mp * np];
+		ldo = np;
+	}
+
+	double *ws = new double[strassen_workspace (levels, mp, np, kp)];
+	strassen_level (levels, mp, np, kp, a, lda, b, ldb, out, ldo, ws);
+	delete [] ws;
+
+	if (pc)
+		for (unsigned r = 0; r < m; r++)
+			memcpy (c + (size_t) r * ldc, pc + (size_t) r * ldo,
+				n * sizeof *c);
+
+	delete [] pa;
+	delete [] pb;
+	delete [] pc;
+}
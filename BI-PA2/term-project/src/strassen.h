@@ -0,0 +1,30 @@
+/**
+ * @file strassen.h
+ * Strassen-Winograd matrix multiplication.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __STRASSEN_H__
+#define __STRASSEN_H__
+
+/** Compute C = A * B, where A is @a m by @a k and B is @a k by @a n,
+ *  with the same conventions as gemm().  When enabled, large products
+ *  of roughly square matrices use the Strassen-Winograd algorithm,
+ *  which needs 7 instead of 8 half-sized products on each level of
+ *  recursion, and gemm() is used below a cutoff size.  Everything else
+ *  goes straight to gemm().
+ *
+ *  The algorithm is enabled by setting the MATRIXCALC_STRASSEN environment
+ *  variable to a non-zero value.  The cutoff may be tuned by setting
+ *  MATRIXCALC_STRASSEN_CUTOFF.  Results aren't bit-identical to those
+ *  of gemm(), the error bound being somewhat weaker.
+ */
+void strassen (bool trans_a, bool trans_b,
+	unsigned m, unsigned n, unsigned k,
+	const double *a, unsigned lda,
+	const double *b, unsigned ldb,
+	double *c, unsigned ldc);
+
+#endif /* ! __STRASSEN_H__ */
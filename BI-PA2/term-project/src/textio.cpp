@@ -0,0 +1,1094 @@
+/**
+ * @file textio.cpp
+ * Importing and exporting matrices in text formats.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ * Files are read into memory as a whole and split into chunks at line
+ * boundaries.  Lines of data in each chunk are counted first, so that
+ * the place of every line within the result is known in advance, and all
+ * of the chunks are then parsed at once.  Exports go the other way around,
+ * formatting chunks of rows in parallel and writing them out in order.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <exception>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <climits>
+#include <clocale>
+#include <stdint.h>
+
+#include <config.h>
+
+#include "matrix.h"
+#include "value.h"
+#include "tiled.h"
+#include "threadpool.h"
+#include "textio.h"
+#include "numlocale.h"
+
+using namespace std;
+
+
+/** Files are split into chunks of about this many bytes for parsing. */
+#define TEXT_CHUNK (1 << 20)
+
+/** Values are formatted in chunks of about this many. */
+#define TEXT_FORMAT_CHUNK 16384
+
+/** Space for a formatted number, including the terminating null. */
+#define TEXT_NUMBER_MAX 32
+
+/** Width of the number of entries in Matrix Market files that are written
+ *  before the number is known, so that it can be filled in afterwards. */
+#define TEXT_NNZ_WIDTH 20
+
+TextFormat
+text_format (const string &filename)
+{
+	size_t dot = filename.rfind ('.');
+	if (dot == string::npos)
+		return TEXT_NONE;
+
+	string ext = filename.substr (dot + 1);
+	for (size_t i = 0; i < ext.length (); i++)
+		ext[i] = tolower ((unsigned char) ext[i]);
+
+	if (ext == "csv")
+		return TEXT_CSV;
+	if (ext == "mtx")
+		return TEXT_MTX;
+	return TEXT_NONE;
+}
+
+
+/** Powers of ten that are represented exactly by a double. */
+static const double g_pow10[] =
+{
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/** Whether @a c separates items on a line. */
+static inline bool
+is_blank (char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/** Skip blank characters. */
+static inline const char *
+skip_blanks (const char *p, const char *end)
+{
+	while (p != end && is_blank (*p))
+		p++;
+	return p;
+}
+
+/** Match a lowercase @a word at @a p regardless of case.
+ *  Returns a pointer past it, or NULL if it doesn't match. */
+static const char *
+match_word (const char *p, const char *end, const char *word)
+{
+	for (; *word; word++, p++)
+		if (p == end || tolower ((unsigned char) *p) != *word)
+			return NULL;
+	return p;
+}
+
+/** Parse a number at @a p, not going past @a end.
+ *  Returns a pointer past the number, or NULL if there isn't one.
+ *
+ *  Mantissas that fit into a double, with small exponents, are computed
+ *  exactly right away.  strtod() is left with the rest, so the text must
+ *  be terminated and the locale of numbers must be "C". */
+static const char *
+parse_number (const char *p, const char *end, double &value)
+{
+	const char *start = p;
+	bool negative = false;
+	if (p != end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+
+	const char *q;
+	if ((q = match_word (p, end, "nan")))
+	{
+		value = NAN;
+		return q;
+	}
+	if ((q = match_word (p, end, "inf")))
+	{
+		value = negative ? -HUGE_VAL : HUGE_VAL;
+		const char *r = match_word (q, end, "inity");
+		return r ? r : q;
+	}
+
+	/* Up to 19 significant digits fit into the mantissa,
+	 * the rest only moves the decimal point. */
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+
+	for (; p != end && *p >= '0' && *p <= '9'; p++, any = true)
+	{
+		if (digits == 19)
+		{
+			exponent++;
+			continue;
+		}
+		mantissa = mantissa * 10 + (*p - '0');
+		if (mantissa)
+			digits++;
+	}
+	if (p != end && *p == '.')
+		for (p++; p != end && *p >= '0' && *p <= '9'; p++, any = true)
+		{
+			if (digits == 19)
+				continue;
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa)
+				digits++;
+			exponent--;
+		}
+	if (!any)
+		return NULL;
+
+	if (p != end && (*p == 'e' || *p == 'E'))
+	{
+		q = p + 1;
+		bool exp_negative = false;
+		if (q != end && (*q == '-' || *q == '+'))
+			exp_negative = *q++ == '-';
+
+		/* Without any digits, the `e' is left for the caller to reject. */
+		if (q != end && *q >= '0' && *q <= '9')
+		{
+			int e = 0;
+			for (; q != end && *q >= '0' && *q <= '9'; q++)
+				if (e < 100000)
+					e = e * 10 + (*q - '0');
+			exponent += exp_negative ? -e : e;
+			p = q;
+		}
+	}
+
+	if (!mantissa)
+		value = negative ? -0. : 0.;
+	else if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22)
+		value = strtod (start, NULL);
+	else
+	{
+		value = exponent < 0
+			? mantissa / g_pow10[-exponent]
+			: mantissa * g_pow10[exponent];
+		if (negative)
+			value = -value;
+	}
+	return p;
+}
+
+/** Parse an unsigned integer, such as a dimension or an index. */
+static const char *
+parse_count (const char *p, const char *end, uint64_t &value)
+{
+	if (p == end || *p < '0' || *p > '9')
+		return NULL;
+
+	for (value = 0; p != end && *p >= '0' && *p <= '9'; p++)
+	{
+		if (value > ((uint64_t) -1 - 9) / 10)
+			return NULL;
+		value = value * 10 + (*p - '0');
+	}
+	return p;
+}
+
+/** Find the end of the line starting at @a p, without the newline. */
+static inline const char *
+line_end (const char *p, const char *end)
+{
+	const char *nl = static_cast<const char *> (memchr (p, '\n', end - p));
+	return nl ? nl : end;
+}
+
+/** Whether a line contains data, as opposed to being blank
+ *  or a comment, which starts with either `%' or `#'. */
+static inline bool
+is_data (const char *p, const char *end)
+{
+	p = skip_blanks (p, end);
+	return p != end && *p != '%' && *p != '#';
+}
+
+/** A piece of a file, starting and ending at line boundaries. */
+struct TextChunk
+{
+	const char *begin;          //!< Beginning of the chunk.
+	const char *end;            //!< End of the chunk.
+	size_t first;               //!< Index of the first line of data
+	                            //!< of the chunk within the whole file.
+	size_t lines;               //!< Number of lines of data.
+	bool failed;                //!< Whether parsing the chunk has failed.
+};
+
+/** Split [@a begin, @a end) into chunks of about TEXT_CHUNK bytes. */
+static void
+split_chunks (const char *begin, const char *end, vector<TextChunk> &chunks)
+{
+	while (begin != end)
+	{
+		const char *stop = end;
+		if ((size_t) (end - begin) > TEXT_CHUNK)
+		{
+			stop = line_end (begin + TEXT_CHUNK, end);
+			if (stop != end)
+				stop++;
+		}
+
+		TextChunk chunk = {begin, stop, 0, 0, false};
+		chunks.push_back (chunk);
+		begin = stop;
+	}
+}
+
+/** Count lines of data in a range of chunks. */
+static void
+count_task (void *data, unsigned begin, unsigned end)
+{
+	vector<TextChunk> &chunks = *static_cast<vector<TextChunk> *> (data);
+	for (unsigned i = begin; i < end; i++)
+	{
+		TextChunk &chunk = chunks[i];
+		for (const char *p = chunk.begin; p != chunk.end; )
+		{
+			const char *eol = line_end (p, chunk.end);
+			if (is_data (p, eol))
+				chunk.lines++;
+			p = eol == chunk.end ? eol : eol + 1;
+		}
+	}
+}
+
+/** Count lines of data in all @a chunks and number them.
+ *  Returns the total number of lines of data. */
+static size_t
+count_lines (vector<TextChunk> &chunks)
+{
+	if (chunks.empty ())
+		return 0;
+
+	ThreadPool::get ().run (count_task, &chunks, chunks.size ());
+
+	size_t total = 0;
+	for (unsigned i = 0; i < chunks.size (); i++)
+	{
+		chunks[i].first = total;
+		total += chunks[i].lines;
+	}
+	return total;
+}
+
+/** Symmetry of a Matrix Market file. */
+enum MtxSymmetry
+{
+	MTX_GENERAL,         //!< All values are listed.
+	MTX_SYMMETRIC,       //!< Only the lower triangle is listed.
+	MTX_SKEW             //!< Only the lower triangle without the diagonal
+	                     //!< is listed, the upper one is negated.
+};
+
+/** A value of a sparse matrix. */
+struct TextEntry
+{
+	unsigned row;               //!< The row.
+	unsigned col;               //!< The column.
+	double value;               //!< The value.
+};
+
+/** Arguments for parsing lines of data. */
+struct ParseJob
+{
+	/** Parse the @a line-th line of data, which is [@a p, @a end). */
+	bool (*parse_line) (const ParseJob *job,
+		const char *p, const char *end, size_t line);
+
+	vector<TextChunk> *chunks;  //!< Chunks of the file.
+	unsigned rows;              //!< Number of rows of the matrix.
+	unsigned cols;              //!< Number of columns of the matrix.
+	MtxSymmetry symmetry;       //!< Symmetry of the matrix.
+	bool pattern;               //!< Values aren't listed, they're all ones.
+
+	double *values;             //!< Dense values, stored by rows.
+	const size_t *col_start;    //!< Index of the first listed value
+	                            //!< of each column in arrays, plus the end.
+	TextEntry *entries;         //!< Values of coordinates.
+};
+
+/** Parse lines of data in a range of chunks. */
+static void
+parse_task (void *data, unsigned begin, unsigned end)
+{
+	const ParseJob *job = static_cast<const ParseJob *> (data);
+	for (unsigned i = begin; i < end; i++)
+	{
+		TextChunk &chunk = (*job->chunks)[i];
+		size_t line = chunk.first;
+		for (const char *p = chunk.begin; p != chunk.end; )
+		{
+			const char *eol = line_end (p, chunk.end);
+			if (is_data (p, eol) && !job->parse_line (job, p, eol, line++))
+			{
+				chunk.failed = true;
+				break;
+			}
+			p = eol == chunk.end ? eol : eol + 1;
+		}
+	}
+}
+
+/** Parse all lines of data, returning false if any of them is invalid. */
+static bool
+parse_lines (ParseJob &job)
+{
+	vector<TextChunk> &chunks = *job.chunks;
+	if (chunks.empty ())
+		return true;
+
+	ThreadPool::get ().run (parse_task, &job, chunks.size ());
+	for (unsigned i = 0; i < chunks.size (); i++)
+		if (chunks[i].failed)
+			return false;
+	return true;
+}
+
+/** Parse a row of comma-separated values. */
+static bool
+parse_csv_line (const ParseJob *job, const char *p, const char *end,
+	size_t line)
+{
+	double *out = job->values + line * job->cols;
+	for (unsigned c = 0; c < job->cols; c++)
+	{
+		if (c && (p == end || *p++ != ','))
+			return false;
+		if (!(p = parse_number (skip_blanks (p, end), end, out[c])))
+			return false;
+		p = skip_blanks (p, end);
+	}
+	return p == end;
+}
+
+/** Parse a value of a Matrix Market array, which lists columns
+ *  one after another, only starting from the diagonal if it's symmetric. */
+static bool
+parse_array_line (const ParseJob *job, const char *p, const char *end,
+	size_t line)
+{
+	double value;
+	if (!(p = parse_number (skip_blanks (p, end), end, value))
+	 || skip_blanks (p, end) != end)
+		return false;
+
+	unsigned c = upper_bound (job->col_start,
+		job->col_start + job->cols + 1, line) - job->col_start - 1;
+	unsigned r = line - job->col_start[c];
+	if (job->symmetry != MTX_GENERAL)
+		r += c + (job->symmetry == MTX_SKEW);
+
+	job->values[(size_t) r * job->cols + c] = value;
+	if (job->symmetry != MTX_GENERAL)
+		job->values[(size_t) c * job->cols + r] =
+			job->symmetry == MTX_SKEW ? -value : value;
+	return true;
+}
+
+/** Parse a value of a Matrix Market coordinate list. */
+static bool
+parse_coordinate_line (const ParseJob *job, const char *p, const char *end,
+	size_t line)
+{
+	uint64_t row, col;
+	double value = 1;
+
+	if (!(p = parse_count (skip_blanks (p, end), end, row))
+	 || p == end || !is_blank (*p)
+	 || !(p = parse_count (skip_blanks (p, end), end, col)))
+		return false;
+	if (!job->pattern && (p == end || !is_blank (*p)
+	 || !(p = parse_number (skip_blanks (p, end), end, value))))
+		return false;
+	if (skip_blanks (p, end) != end
+	 || !row || row > job->rows || !col || col > job->cols)
+		return false;
+
+	TextEntry &entry = job->entries[line];
+	entry.row = row - 1;
+	entry.col = col - 1;
+	entry.value = value;
+	return true;
+}
+
+/** Arguments for sorting rows of a sparse matrix. */
+struct SortJob
+{
+	const unsigned *row_ptr;    //!< Beginnings of rows, plus the end.
+	pair<unsigned, double> *entries;  //!< Columns and values by rows.
+	unsigned *lengths;          //!< Resulting lengths of rows.
+};
+
+/** Sort a range of rows by columns, summing up values listed repeatedly
+ *  and dropping zeros, and moving what's left to the start of each row. */
+static void
+sort_rows_task (void *data, unsigned begin, unsigned end)
+{
+	const SortJob *job = static_cast<const SortJob *> (data);
+	for (unsigned r = begin; r < end; r++)
+	{
+		pair<unsigned, double> *first = job->entries + job->row_ptr[r];
+		pair<unsigned, double> *last  = job->entries + job->row_ptr[r + 1];
+		sort (first, last);
+
+		pair<unsigned, double> *out = first;
+		for (pair<unsigned, double> *i = first; i != last; )
+		{
+			*out = *i;
+			while (++i != last && i->first == out->first)
+				out->second += i->second;
+			if (out->second)
+				out++;
+		}
+		job->lengths[r] = out - first;
+	}
+}
+
+/** Build compressed sparse rows out of coordinates, adding the mirrored
+ *  values of symmetric matrices.  Returns NULL if there are too many. */
+static MatrixStorage *
+build_csr (unsigned rows, unsigned cols, const vector<TextEntry> &entries,
+	MtxSymmetry symmetry)
+{
+	/* Count values in each row first. */
+	vector<uint64_t> counts (rows + 1, 0);
+	for (size_t i = 0; i < entries.size (); i++)
+	{
+		const TextEntry &e = entries[i];
+		counts[e.row + 1]++;
+		if (symmetry != MTX_GENERAL && e.row != e.col)
+			counts[e.col + 1]++;
+	}
+	for (unsigned r = 0; r < rows; r++)
+		counts[r + 1] += counts[r];
+	if (counts[rows] > UINT_MAX)
+		return NULL;
+
+	vector<unsigned> row_ptr (counts.begin (), counts.end ());
+	vector<unsigned> fill (row_ptr.begin (), row_ptr.end () - 1);
+	vector<pair<unsigned, double> > sorted (row_ptr[rows]);
+	for (size_t i = 0; i < entries.size (); i++)
+	{
+		const TextEntry &e = entries[i];
+		sorted[fill[e.row]++] = make_pair (e.col, e.value);
+		if (symmetry != MTX_GENERAL && e.row != e.col)
+			sorted[fill[e.col]++] = make_pair (e.row,
+				symmetry == MTX_SKEW ? -e.value : e.value);
+	}
+
+	vector<unsigned> lengths (rows);
+	SortJob job = {&row_ptr[0], sorted.empty () ? NULL : &sorted[0],
+		&lengths[0]};
+	ThreadPool::get ().run (sort_rows_task, &job, rows,
+		16384 / (sorted.size () / rows + 1) + 1);
+
+	/* Squeeze out the gaps left by sorting. */
+	vector<unsigned> col_idx, new_row_ptr (rows + 1, 0);
+	vector<double> vals;
+	for (unsigned r = 0; r < rows; r++)
+		new_row_ptr[r + 1] = new_row_ptr[r] + lengths[r];
+
+	col_idx.resize (new_row_ptr[rows]);
+	vals.resize (new_row_ptr[rows]);
+	for (unsigned r = 0; r < rows; r++)
+		for (unsigned i = 0; i < lengths[r]; i++)
+		{
+			const pair<unsigned, double> &entry = sorted[row_ptr[r] + i];
+			col_idx[new_row_ptr[r] + i] = entry.first;
+			vals[new_row_ptr[r] + i] = entry.second;
+		}
+
+	MatrixCSRStorage *mcs = new MatrixCSRStorage (rows, cols);
+	mcs->assign (new_row_ptr, col_idx, vals);
+	return mcs;
+}
+
+/** Read a whole file into @a buffer. */
+static bool
+read_file (const string &filename, vector<char> &buffer)
+{
+	ifstream ifs (filename.c_str (), ios::binary);
+	if (!ifs || !ifs.seekg (0, ios::end))
+		return false;
+
+	streamoff length = ifs.tellg ();
+	if (length < 0 || !ifs.seekg (0))
+		return false;
+
+	/* Terminate the contents for strtod(). */
+	buffer.resize (length + 1);
+	buffer[length] = 0;
+	return !length || ifs.read (&buffer[0], length);
+}
+
+/** Import comma-separated values. */
+static MatrixStorage *
+import_csv (const char *p, const char *end)
+{
+	/* The first line of data decides about the number of columns. */
+	const char *eol;
+	for (; p != end; p = eol == end ? eol : eol + 1)
+		if (is_data (p, eol = line_end (p, end)))
+			break;
+	if (p == end)
+		return NULL;
+
+	uint64_t cols = count (p, eol, ',') + 1;
+
+	vector<TextChunk> chunks;
+	split_chunks (p, end, chunks);
+	uint64_t rows = count_lines (chunks);
+	if (cols > UINT_MAX || rows > UINT_MAX)
+		return NULL;
+
+	MatrixArrayStorage *mas = new MatrixArrayStorage (rows, cols, false);
+
+	ParseJob job;
+	job.parse_line = parse_csv_line;
+	job.chunks = &chunks;
+	job.rows = rows;
+	job.cols = cols;
+	job.values = mas->get_values ();
+
+	if (parse_lines (job))
+		return mas;
+
+	delete mas;
+	return NULL;
+}
+
+/** The header of a Matrix Market file. */
+struct MtxHeader
+{
+	bool array;                 //!< Dense array rather than coordinates.
+	bool pattern;               //!< Only positions of values are listed.
+	MtxSymmetry symmetry;       //!< Symmetry of the matrix.
+	uint64_t rows;              //!< Number of rows.
+	uint64_t cols;              //!< Number of columns.
+	uint64_t entries;           //!< Number of lines of data.
+};
+
+/** Read a word of the banner of a Matrix Market file, in lowercase. */
+static string
+read_banner_word (const char *&p, const char *end)
+{
+	p = skip_blanks (p, end);
+	string word;
+	for (; p != end && !is_blank (*p); p++)
+		word += tolower ((unsigned char) *p);
+	return word;
+}
+
+/** Parse the header of a Matrix Market file, leaving @a p
+ *  at the first line of data. */
+static bool
+parse_mtx_header (const char *&p, const char *end, MtxHeader &header)
+{
+	const char *eol = line_end (p, end);
+	if (!(p = match_word (p, eol, "%%matrixmarket"))
+	 || read_banner_word (p, eol) != "matrix")
+		return false;
+
+	string format = read_banner_word (p, eol);
+	string field = read_banner_word (p, eol);
+	string symmetry = read_banner_word (p, eol);
+	if (skip_blanks (p, eol) != eol)
+		return false;
+
+	if (format == "array")
+		header.array = true;
+	else if (format == "coordinate")
+		header.array = false;
+	else
+		return false;
+
+	/* Complex numbers aren't supported, and neither is anything
+	 * that goes with them. */
+	header.pattern = field == "pattern";
+	if (field != "real" && field != "integer" && field != "double"
+	 && (!header.pattern || header.array))
+		return false;
+
+	if (symmetry == "general")
+		header.symmetry = MTX_GENERAL;
+	else if (symmetry == "symmetric")
+		header.symmetry = MTX_SYMMETRIC;
+	else if (symmetry == "skew-symmetric")
+		header.symmetry = MTX_SKEW;
+	else
+		return false;
+
+	/* Comments are followed by the dimensions. */
+	for (p = eol; p != end; p = eol)
+	{
+		eol = line_end (++p, end);
+		if (is_data (p, eol))
+			break;
+	}
+	if (p == end)
+		return false;
+
+	if (!(p = parse_count (skip_blanks (p, eol), eol, header.rows))
+	 || p == eol || !is_blank (*p)
+	 || !(p = parse_count (skip_blanks (p, eol), eol, header.cols)))
+		return false;
+	if (!header.array && (p == eol || !is_blank (*p)
+	 || !(p = parse_count (skip_blanks (p, eol), eol, header.entries))))
+		return false;
+	if (skip_blanks (p, eol) != eol)
+		return false;
+	p = eol;
+
+	if (!header.rows || header.rows > UINT_MAX
+	 || !header.cols || header.cols > UINT_MAX)
+		return false;
+	if (header.symmetry != MTX_GENERAL && header.rows != header.cols)
+		return false;
+	return true;
+}
+
+/** Import a Matrix Market file. */
+static MatrixStorage *
+import_mtx (const char *p, const char *end)
+{
+	MtxHeader header;
+	if (!parse_mtx_header (p, end, header))
+		return NULL;
+
+	vector<TextChunk> chunks;
+	split_chunks (p, end, chunks);
+	uint64_t lines = count_lines (chunks);
+
+	ParseJob job;
+	job.chunks = &chunks;
+	job.rows = header.rows;
+	job.cols = header.cols;
+	job.symmetry = header.symmetry;
+	job.pattern = header.pattern;
+
+	if (!header.array)
+	{
+		if (lines != header.entries)
+			return NULL;
+
+		vector<TextEntry> entries (lines);
+		job.parse_line = parse_coordinate_line;
+		job.entries = entries.empty () ? NULL : &entries[0];
+		if (!parse_lines (job))
+			return NULL;
+		return build_csr (job.rows, job.cols, entries, job.symmetry);
+	}
+
+	/* Find out where each column starts in the list. */
+	vector<size_t> col_start (job.cols + 1, 0);
+	for (unsigned c = 0; c < job.cols; c++)
+	{
+		size_t length = job.rows;
+		if (job.symmetry != MTX_GENERAL)
+			length -= c + (job.symmetry == MTX_SKEW);
+		col_start[c + 1] = col_start[c] + length;
+	}
+	if (lines != col_start[job.cols])
+		return NULL;
+
+	/* The diagonal of skew-symmetric matrices isn't listed at all. */
+	MatrixArrayStorage *mas = new MatrixArrayStorage
+		(job.rows, job.cols, job.symmetry == MTX_SKEW);
+
+	job.parse_line = parse_array_line;
+	job.values = mas->get_values ();
+	job.col_start = &col_start[0];
+	if (parse_lines (job))
+		return mas;
+
+	delete mas;
+	return NULL;
+}
+
+bool
+text_import (Value &value, const string &filename, TextFormat format)
+{
+	vector<char> buffer;
+	if (!read_file (filename, buffer))
+		return false;
+
+	const char *begin = &buffer[0];
+	const char *end = begin + buffer.size () - 1;
+
+	NumericLocale locale;
+	MatrixStorage *ms = NULL;
+	switch (format)
+	{
+	case TEXT_CSV:
+		ms = import_csv (begin, end);
+		break;
+	case TEXT_MTX:
+		ms = import_mtx (begin, end);
+		break;
+	default:
+		break;
+	}
+	if (!ms)
+		return false;
+
+	Value loaded;
+	loaded.type = Value::MATRIX;
+	loaded.matrix = new Matrix (Matrix (ms).adapt ());
+	value = loaded;
+	return true;
+}
+
+
+/** Format a number so that it reads back the same into @a buffer.
+ *  Returns its length. */
+static unsigned
+format_number (double value, char *buffer)
+{
+	/* Most numbers don't need all the 17 digits. */
+	unsigned length = snprintf (buffer, TEXT_NUMBER_MAX, "%.15g", value);
+
+	double check;
+	if (value == value && (!parse_number (buffer, buffer + length, check)
+	 || check != value))
+		length = snprintf (buffer, TEXT_NUMBER_MAX, "%.17g", value);
+	return length;
+}
+
+/** Arguments for formatting a matrix.  Each unit of the output, a row
+ *  or a column, is formatted by one call of @a format. */
+struct FormatJob
+{
+	/** Format the @a unit-th unit of the matrix into @a out,
+	 *  returning the number of values listed. */
+	size_t (*format) (const FormatJob *job, unsigned unit, string &out);
+
+	unsigned rows;              //!< Number of rows of the matrix.
+	unsigned cols;              //!< Number of columns of the matrix.
+
+	const double *values;       //!< Dense values, stored by rows.
+	unsigned values_row;        //!< The row that @a values start at.
+
+	const unsigned *row_ptr;    //!< Beginnings of sparse rows.
+	const unsigned *col_idx;    //!< Column indexes of sparse values.
+	const double *vals;         //!< Sparse values.
+
+	unsigned first;             //!< The first unit being formatted.
+	unsigned last;              //!< The unit after the last one.
+	unsigned per_chunk;         //!< Number of units in a chunk.
+	vector<string> *chunks;     //!< Formatted chunks.
+	vector<size_t> *listed;     //!< Number of values listed in chunks.
+};
+
+/** Append a number to @a out. */
+static inline void
+append_number (string &out, double value)
+{
+	char buffer[TEXT_NUMBER_MAX];
+	out.append (buffer, format_number (value, buffer));
+}
+
+/** Append a coordinate entry of a Matrix Market file to @a out. */
+static inline void
+append_entry (string &out, unsigned row, unsigned col, double value)
+{
+	char buffer[TEXT_NUMBER_MAX];
+	out.append (buffer, snprintf (buffer, sizeof buffer,
+		"%u %u ", row + 1, col + 1));
+	append_number (out, value);
+	out += '\n';
+}
+
+/** Format a dense row as comma-separated values. */
+static size_t
+format_csv_dense (const FormatJob *job, unsigned unit, string &out)
+{
+	const double *row = job->values + (size_t) (unit - job->values_row)
+		* job->cols;
+	for (unsigned c = 0; c < job->cols; c++)
+	{
+		if (c)
+			out += ',';
+		append_number (out, row[c]);
+	}
+	out += '\n';
+	return job->cols;
+}
+
+/** Format a sparse row as comma-separated values. */
+static size_t
+format_csv_sparse (const FormatJob *job, unsigned unit, string &out)
+{
+	unsigned i = job->row_ptr[unit], end = job->row_ptr[unit + 1];
+	for (unsigned c = 0; c < job->cols; c++)
+	{
+		if (c)
+			out += ',';
+		if (i != end && job->col_idx[i] == c)
+			append_number (out, job->vals[i++]);
+		else
+			out += '0';
+	}
+	out += '\n';
+	return job->cols;
+}
+
+/** Format a dense column as a part of a Matrix Market array. */
+static size_t
+format_mtx_array (const FormatJob *job, unsigned unit, string &out)
+{
+	for (unsigned r = 0; r < job->rows; r++)
+	{
+		append_number (out,
+			job->values[(size_t) r * job->cols + unit]);
+		out += '\n';
+	}
+	return job->rows;
+}
+
+/** Format non-zero values of a dense row as Matrix Market coordinates. */
+static size_t
+format_mtx_dense (const FormatJob *job, unsigned unit, string &out)
+{
+	const double *row = job->values + (size_t) (unit - job->values_row)
+		* job->cols;
+	size_t listed = 0;
+	for (unsigned c = 0; c < job->cols; c++)
+		if (row[c])
+		{
+			append_entry (out, unit, c, row[c]);
+			listed++;
+		}
+	return listed;
+}
+
+/** Format non-zero values of a sparse row as Matrix Market coordinates. */
+static size_t
+format_mtx_sparse (const FormatJob *job, unsigned unit, string &out)
+{
+	size_t listed = 0;
+	for (unsigned i = job->row_ptr[unit]; i < job->row_ptr[unit + 1]; i++)
+		if (job->vals[i])
+		{
+			append_entry (out, unit, job->col_idx[i], job->vals[i]);
+			listed++;
+		}
+	return listed;
+}
+
+/** Format a range of chunks. */
+static void
+format_task (void *data, unsigned begin, unsigned end)
+{
+	const FormatJob *job = static_cast<const FormatJob *> (data);
+	for (unsigned i = begin; i < end; i++)
+	{
+		string &out = (*job->chunks)[i];
+		size_t &listed = (*job->listed)[i];
+		out.clear ();
+		listed = 0;
+
+		unsigned unit = job->first + i * job->per_chunk;
+		unsigned last = min (job->last, unit + job->per_chunk);
+		for (; unit < last; unit++)
+			listed += job->format (job, unit, out);
+	}
+}
+
+/** Format units [@a first, @a last) in parallel, writing them out in order.
+ *  Adds the number of values listed to @a listed. */
+static bool
+write_units (ofstream &ofs, FormatJob &job, unsigned first, unsigned last,
+	unsigned unit_size, uint64_t &listed)
+{
+	/* Give each thread a few chunks, so that uneven ones even out. */
+	vector<string> chunks (ThreadPool::get ().get_size () * 4);
+	vector<size_t> chunk_listed (chunks.size ());
+	job.chunks = &chunks;
+	job.listed = &chunk_listed;
+	job.per_chunk = TEXT_FORMAT_CHUNK / (unit_size + 1) + 1;
+
+	while (first < last)
+	{
+		unsigned n = min ((uint64_t) chunks.size (),
+			((uint64_t) last - first + job.per_chunk - 1) / job.per_chunk);
+		job.first = first;
+		job.last = min ((uint64_t) last, (uint64_t) first + n * job.per_chunk);
+		ThreadPool::get ().run (format_task, &job, n);
+
+		for (unsigned i = 0; i < n; i++)
+		{
+			if (!ofs.write (chunks[i].data (), chunks[i].length ()))
+				return false;
+			listed += chunk_listed[i];
+		}
+		first = job.last;
+	}
+	return true;
+}
+
+/** Write all rows of a matrix kept out of core, one row of tiles
+ *  at a time. */
+static bool
+write_tiled (ofstream &ofs, FormatJob &job, const MatrixTiledStorage &mts,
+	uint64_t &listed)
+{
+	double *panel = new double[(size_t) TILED_SIZE * job.cols];
+	bool ok = true;
+	for (unsigned ti = 0; ok && ti < mts.get_tile_rows (); ti++)
+	{
+		mts.read_rows (ti, panel);
+		job.values = panel;
+		job.values_row = ti * TILED_SIZE;
+		ok = write_units (ofs, job, job.values_row,
+			min (job.rows, job.values_row + TILED_SIZE), job.cols, listed);
+	}
+	delete [] panel;
+	return ok;
+}
+
+/** Export a matrix as comma-separated values. */
+static bool
+export_csv (ofstream &ofs, FormatJob &job, const MatrixStorage &ms)
+{
+	const MatrixTiledStorage *mts =
+		dynamic_cast<const MatrixTiledStorage *> (&ms);
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&ms);
+
+	uint64_t listed = 0;
+	job.format = mts || mas ? format_csv_dense : format_csv_sparse;
+	if (mts)
+		return write_tiled (ofs, job, *mts, listed);
+	if (mas)
+		job.values = mas->get_values ();
+	return write_units (ofs, job, 0, job.rows, job.cols, listed);
+}
+
+/** Export a matrix in the Matrix Market format. */
+static bool
+export_mtx (ofstream &ofs, FormatJob &job, const MatrixStorage &ms)
+{
+	const MatrixTiledStorage *mts =
+		dynamic_cast<const MatrixTiledStorage *> (&ms);
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&ms);
+
+	uint64_t listed = 0;
+	if (mas)
+	{
+		job.format = format_mtx_array;
+		job.values = mas->get_values ();
+		ofs << "%%MatrixMarket matrix array real general\n"
+			<< job.rows << ' ' << job.cols << '\n';
+		return write_units (ofs, job, 0, job.cols, job.rows, listed);
+	}
+
+	/* The number of values is only known once they've been listed,
+	 * so leave enough space for it and fill it in at the end. */
+	ofs << "%%MatrixMarket matrix coordinate real general\n"
+		<< job.rows << ' ' << job.cols << ' ';
+	streampos nnz_pos = ofs.tellp ();
+	ofs << string (TEXT_NNZ_WIDTH, ' ') << '\n';
+
+	bool ok;
+	if (mts)
+	{
+		job.format = format_mtx_dense;
+		ok = write_tiled (ofs, job, *mts, listed);
+	}
+	else
+	{
+		job.format = format_mtx_sparse;
+		ok = write_units (ofs, job, 0, job.rows,
+			ms.count_nonzero () / job.rows + 1, listed);
+	}
+
+	char buffer[TEXT_NNZ_WIDTH + 1];
+	snprintf (buffer, sizeof buffer, "%llu", (unsigned long long) listed);
+	return ok && ofs.seekp (nnz_pos) && ofs.write (buffer, strlen (buffer));
+}
+
+bool
+text_export (const Value &value, const string &filename, TextFormat format)
+{
+	Matrix m (new MatrixArrayStorage (1, 1));
+	switch (value.type)
+	{
+	case Value::INTEGER:
+		m.put (0, 0, value.integer);
+		break;
+	case Value::REAL:
+		m.put (0, 0, value.real);
+		break;
+	case Value::MATRIX:
+		/* Anything but dense storage is read as compressed rows. */
+		m = value.matrix->materialize ();
+		if (!dynamic_cast<const MatrixArrayStorage *> (&m.get_storage ())
+		 && !dynamic_cast<const MatrixTiledStorage *> (&m.get_storage ()))
+			m = m.compress ();
+		break;
+	}
+
+	ofstream ofs (filename.c_str (), ios::binary);
+	if (!ofs)
+		return false;
+
+	const MatrixStorage &ms = m.get_storage ();
+	FormatJob job;
+	job.rows = ms.get_rows ();
+	job.cols = ms.get_cols ();
+	job.values = NULL;
+	job.values_row = 0;
+
+	const MatrixCSRStorage *mcs = dynamic_cast<const MatrixCSRStorage *> (&ms);
+	if (mcs)
+	{
+		bool empty = mcs->get_vals ().empty ();
+		job.row_ptr = &mcs->get_row_ptr ()[0];
+		job.col_idx = empty ? NULL : &mcs->get_col_idx ()[0];
+		job.vals    = empty ? NULL : &mcs->get_vals ()[0];
+	}
+
+	NumericLocale locale;
+	bool ok = false;
+	switch (format)
+	{
+	case TEXT_CSV:
+		ok = export_csv (ofs, job, ms);
+		break;
+	case TEXT_MTX:
+		ok = export_mtx (ofs, job, ms);
+		break;
+	default:
+		break;
+	}
+	return ok && ofs.flush ().good ();
+}
@@ -0,0 +1,38 @@
+/**
+ * @file textio.h
+ * Importing and exporting matrices in text formats.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __TEXTIO_H__
+#define __TEXTIO_H__
+
+/** Text formats that matrices may be exchanged in. */
+enum TextFormat
+{
+	TEXT_NONE,           //!< Not a text format.
+	TEXT_CSV,            //!< Comma-separated values, a row on each line.
+	TEXT_MTX             //!< The Matrix Market exchange format.
+};
+
+/** Decide on the text format by the extension of @a filename,
+ *  that is either `.csv' or `.mtx'. */
+TextFormat text_format (const std::string &filename);
+
+/** Import a matrix from a text file.  The file is parsed in chunks
+ *  by the thread pool, straight into dense storage for CSV and arrays
+ *  of Matrix Market, and into compressed sparse rows for coordinates.
+ *  The kind of storage is then adapted to the values. */
+bool text_import (Value &value, const std::string &filename,
+	TextFormat format);
+
+/** Export a value into a text file.  Scalars become 1x1 matrices.
+ *  Matrix Market files store dense matrices as arrays and sparse ones
+ *  as coordinates.  Numbers are written with as many digits as needed
+ *  to read them back exactly. */
+bool text_export (const Value &value, const std::string &filename,
+	TextFormat format);
+
+#endif /* ! __TEXTIO_H__ */
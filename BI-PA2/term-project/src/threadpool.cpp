@@ -0,0 +1,207 @@
+/**
+ * @file threadpool.cpp
+ * A pool of worker threads for data-parallel loops.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#include <cstdlib>
+
+#include <config.h>
+
+#ifdef HAVE_PTHREAD_H
+	#include <pthread.h>
+	#include <unistd.h>
+#endif /* HAVE_PTHREAD_H */
+
+#include "threadpool.h"
+
+
+/** Shared state of the pool. */
+struct ThreadPool::Private
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;       //!< Protects everything below.
+	pthread_cond_t wake;        //!< Signals a new job or termination.
+	pthread_cond_t done;        //!< Signals that workers have finished.
+	pthread_t *threads;         //!< Worker threads.
+
+	unsigned long generation;   //!< Incremented with each new job.
+	unsigned working;           //!< Workers yet to finish the current job.
+	bool quit;                  //!< The workers should terminate.
+#endif /* HAVE_PTHREAD_H */
+	bool busy;                  //!< A job is running right now.
+
+	Task task;                  //!< The current job.
+	void *data;                 //!< Data for the current job.
+	unsigned n;                 //!< Number of items in the current job.
+	unsigned chunk;             //!< Number of items taken at once.
+	unsigned next;              //!< The first item not taken yet.
+};
+
+ThreadPool::ThreadPool (unsigned size) : p (new Private), size (size)
+{
+	p->busy = false;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init (&p->lock, NULL);
+	pthread_cond_init (&p->wake, NULL);
+	pthread_cond_init (&p->done, NULL);
+
+	p->generation = 0;
+	p->working = 0;
+	p->quit = false;
+
+	p->threads = new pthread_t[size];
+	for (unsigned i = 1; i < size; i++)
+		if (pthread_create (&p->threads[i], NULL, worker, this))
+		{
+			/* Make do with what we've got. */
+			this->size = i;
+			break;
+		}
+#else /* ! HAVE_PTHREAD_H */
+	this->size = 1;
+#endif /* ! HAVE_PTHREAD_H */
+}
+
+ThreadPool::~ThreadPool ()
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast (&p->wake);
+	pthread_mutex_unlock (&p->lock);
+
+	for (unsigned i = 1; i < size; i++)
+		pthread_join (p->threads[i], NULL);
+	delete [] p->threads;
+
+	pthread_cond_destroy (&p->done);
+	pthread_cond_destroy (&p->wake);
+	pthread_mutex_destroy (&p->lock);
+#endif /* HAVE_PTHREAD_H */
+
+	delete p;
+}
+
+/** Decide on the number of threads to use. */
+static unsigned
+threadpool_default_size ()
+{
+	const char *env = getenv ("MATRIXCALC_THREADS");
+	if (env && atoi (env) > 0)
+		return atoi (env);
+#ifdef _SC_NPROCESSORS_ONLN
+	if (sysconf (_SC_NPROCESSORS_ONLN) > 0)
+		return sysconf (_SC_NPROCESSORS_ONLN);
+#endif /* _SC_NPROCESSORS_ONLN */
+	return 1;
+}
+
+ThreadPool &
+ThreadPool::get ()
+{
+	static ThreadPool pool (threadpool_default_size ());
+	return pool;
+}
+
+void
+ThreadPool::work ()
+{
+	while (1)
+	{
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_lock (&p->lock);
+#endif /* HAVE_PTHREAD_H */
+		unsigned begin = p->next, end = begin + p->chunk;
+		if (end > p->n)
+			end = p->n;
+		p->next = end;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_unlock (&p->lock);
+#endif /* HAVE_PTHREAD_H */
+
+		if (begin == end)
+			break;
+		p->task (p->data, begin, end);
+	}
+}
+
+void *
+ThreadPool::worker (void *pool)
+{
+#ifdef HAVE_PTHREAD_H
+	Private *p = static_cast<ThreadPool *> (pool)->p;
+
+	/* The first job may be posted even before we get here. */
+	unsigned long seen = 0;
+
+	pthread_mutex_lock (&p->lock);
+	while (1)
+	{
+		while (!p->quit && p->generation == seen)
+			pthread_cond_wait (&p->wake, &p->lock);
+		if (p->quit)
+			break;
+
+		seen = p->generation;
+		pthread_mutex_unlock (&p->lock);
+		static_cast<ThreadPool *> (pool)->work ();
+		pthread_mutex_lock (&p->lock);
+
+		if (!--p->working)
+			pthread_cond_signal (&p->done);
+	}
+	pthread_mutex_unlock (&p->lock);
+#endif /* HAVE_PTHREAD_H */
+	return NULL;
+}
+
+void
+ThreadPool::run (Task task, void *data, unsigned n, unsigned grain)
+{
+	if (!n)
+		return;
+	if (!grain)
+		grain = 1;
+
+	/* A few chunks per thread even out differences in their speed. */
+	unsigned chunk = (n + size * 4 - 1) / (size * 4);
+	if (chunk < grain)
+		chunk = grain;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock (&p->lock);
+	if (p->busy || size == 1 || chunk >= n)
+	{
+		pthread_mutex_unlock (&p->lock);
+		task (data, 0, n);
+		return;
+	}
+
+	p->busy = true;
+	p->task = task;
+	p->data = data;
+	p->n = n;
+	p->chunk = chunk;
+	p->next = 0;
+	p->working = size - 1;
+	p->generation++;
+	pthread_cond_broadcast (&p->wake);
+	pthread_mutex_unlock (&p->lock);
+
+	/* The calling thread joins the effort. */
+	work ();
+
+	pthread_mutex_lock (&p->lock);
+	while (p->working)
+		pthread_cond_wait (&p->done, &p->lock);
+	p->busy = false;
+	pthread_mutex_unlock (&p->lock);
+#else /* ! HAVE_PTHREAD_H */
+	(void) chunk;
+	task (data, 0, n);
+#endif /* ! HAVE_PTHREAD_H */
+}
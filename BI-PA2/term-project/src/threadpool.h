@@ -0,0 +1,49 @@
+/**
+ * @file threadpool.h
+ * A pool of worker threads for data-parallel loops.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+/** Splits loops across a fixed set of worker threads.
+ *  Without thread support, everything runs in the calling thread. */
+class ThreadPool
+{
+public:
+	/** A piece of work on items [@a begin, @a end) of a loop. */
+	typedef void (*Task) (void *data, unsigned begin, unsigned end);
+
+private:
+	struct Private;
+	Private *p;          //!< Implementation details.
+	unsigned size;       //!< Number of threads, including the caller.
+
+	/** Run chunks of the current job until there are none left. */
+	void work ();
+	/** The entry point of worker threads. */
+	static void *worker (void *pool);
+
+	ThreadPool (unsigned size);
+	ThreadPool (const ThreadPool &);
+	ThreadPool &operator= (const ThreadPool &);
+public:
+	~ThreadPool ();
+
+	/** Get the process-wide pool.  Its size is the number of online
+	 *  processors, or the value of the MATRIXCALC_THREADS variable. */
+	static ThreadPool &get ();
+
+	/** Get the number of threads, including the caller. */
+	unsigned get_size () const {return size;}
+
+	/** Run @a task over [0, @a n) in chunks of at least @a grain items,
+	 *  returning once all of them have been processed.  Nested calls,
+	 *  and calls while the pool is busy, run in the calling thread. */
+	void run (Task task, void *data, unsigned n, unsigned grain = 1);
+};
+
+#endif /* ! __THREADPOOL_H__ */
@@ -0,0 +1,446 @@
+/**
+ * @file tiled.cpp
+ * Out-of-core storage for matrices that don't fit into memory.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "matrix.h"
+#include "gemm.h"
+#include "tiled.h"
+#include "profile.h"
+
+#include "gettext.h"
+#define _(String) gettext (String)
+
+using namespace std;
+
+
+/** Number of values in a tile. */
+#define TILE_LENGTH ((size_t) TILED_SIZE * TILED_SIZE)
+/** Number of bytes taken by a tile. */
+#define TILE_BYTES (TILE_LENGTH * sizeof (double))
+
+/** Number of tiles held in memory by a storage when there's no limit. */
+#define TILED_CACHE_DEFAULT 16
+
+size_t MatrixTiledStorage::memory_limit = 0;
+
+/** There's no way to recover from losing the backing file. */
+static void
+tiled_fail (const char *what)
+{
+	fprintf (stderr, _("Fatal error: %s: %s\n"), what, strerror (errno));
+	abort ();
+}
+
+/** Read the whole of @a length bytes at @a offset. */
+static void
+tiled_pread (int fd, void *buffer, size_t length, off_t offset)
+{
+	char *p = static_cast<char *> (buffer);
+	while (length)
+	{
+		ssize_t n = pread (fd, p, length, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			tiled_fail (_("cannot read a temporary file"));
+
+		p += n;
+		length -= n;
+		offset += n;
+	}
+}
+
+/** Write the whole of @a length bytes at @a offset. */
+static void
+tiled_pwrite (int fd, const void *buffer, size_t length, off_t offset)
+{
+	const char *p = static_cast<const char *> (buffer);
+	while (length)
+	{
+		ssize_t n = pwrite (fd, p, length, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			tiled_fail (_("cannot write a temporary file"));
+
+		p += n;
+		length -= n;
+		offset += n;
+	}
+}
+
+MatrixTiledStorage::MatrixTiledStorage (unsigned rows, unsigned cols)
+	: clock (0)
+{
+	this->rows = rows;
+	this->cols = cols;
+	tile_rows = (rows + TILED_SIZE - 1) / TILED_SIZE;
+	tile_cols = (cols + TILED_SIZE - 1) / TILED_SIZE;
+
+	const char *dir = getenv ("TMPDIR");
+	string path = string (dir && *dir ? dir : "/tmp") + "/matrixcalc.XXXXXX";
+	vector<char> name (path.begin (), path.end ());
+	name.push_back (0);
+
+	/* The file disappears along with the descriptor. */
+	if ((fd = mkstemp (&name[0])) == -1)
+		tiled_fail (_("cannot create a temporary file"));
+	unlink (&name[0]);
+
+	/* The system fills the file with zeros, and usually for free. */
+	if (ftruncate (fd, (off_t) tile_rows * tile_cols * TILE_BYTES))
+		tiled_fail (_("cannot resize a temporary file"));
+
+	cache_size = memory_limit ? memory_limit / 4 / TILE_BYTES
+		: TILED_CACHE_DEFAULT;
+	if (!cache_size)
+		cache_size = 1;
+}
+
+MatrixTiledStorage::~MatrixTiledStorage ()
+{
+	for (map<unsigned, Tile>::iterator iter = cache.begin ();
+		iter != cache.end (); iter++)
+		delete [] iter->second.values;
+	close (fd);
+}
+
+void
+MatrixTiledStorage::write_back (unsigned index, Tile &tile) const
+{
+	tiled_pwrite (fd, tile.values, TILE_BYTES, (off_t) index * TILE_BYTES);
+	tile.dirty = false;
+}
+
+MatrixTiledStorage::Tile &
+MatrixTiledStorage::fetch (unsigned ti, unsigned tj) const
+{
+	unsigned index = ti * tile_cols + tj;
+	map<unsigned, Tile>::iterator iter = cache.find (index);
+	if (iter != cache.end ())
+	{
+		iter->second.last_use = ++clock;
+		return iter->second;
+	}
+
+	/* Make room by evicting the least recently used tile. */
+	if (cache.size () >= cache_size)
+	{
+		map<unsigned, Tile>::iterator lru = cache.begin ();
+		for (iter = cache.begin (); iter != cache.end (); iter++)
+			if (iter->second.last_use < lru->second.last_use)
+				lru = iter;
+
+		if (lru->second.dirty)
+			write_back (lru->first, lru->second);
+		delete [] lru->second.values;
+		cache.erase (lru);
+	}
+
+	Tile &tile = cache[index];
+	tile.values = new double[TILE_LENGTH];
+	tile.dirty = false;
+	tile.last_use = ++clock;
+	tiled_pread (fd, tile.values, TILE_BYTES, (off_t) index * TILE_BYTES);
+	return tile;
+}
+
+void
+MatrixTiledStorage::read_rows (unsigned ti, double *buffer) const
+{
+	double *tile = new double[TILE_LENGTH];
+	for (unsigned tj = 0; tj < tile_cols; tj++)
+	{
+		read_tile (ti, tj, tile);
+
+		unsigned c0 = tj * TILED_SIZE;
+		unsigned nc = min (TILED_SIZE, cols - c0);
+		for (unsigned r = 0; r < TILED_SIZE; r++)
+			copy (tile + r * TILED_SIZE, tile + r * TILED_SIZE + nc,
+				buffer + (size_t) r * cols + c0);
+	}
+	delete [] tile;
+}
+
+void
+MatrixTiledStorage::read_tile (unsigned ti, unsigned tj, double *buffer) const
+{
+	unsigned index = ti * tile_cols + tj;
+	map<unsigned, Tile>::const_iterator iter = cache.find (index);
+	if (iter != cache.end ())
+		copy (iter->second.values, iter->second.values + TILE_LENGTH, buffer);
+	else
+		tiled_pread (fd, buffer, TILE_BYTES, (off_t) index * TILE_BYTES);
+}
+
+void
+MatrixTiledStorage::write_tile (unsigned ti, unsigned tj, const double *buffer)
+{
+	unsigned index = ti * tile_cols + tj;
+	tiled_pwrite (fd, buffer, TILE_BYTES, (off_t) index * TILE_BYTES);
+
+	map<unsigned, Tile>::iterator iter = cache.find (index);
+	if (iter != cache.end ())
+	{
+		copy (buffer, buffer + TILE_LENGTH, iter->second.values);
+		iter->second.dirty = false;
+	}
+}
+
+void
+MatrixTiledStorage::prefetch_tile (unsigned ti, unsigned tj) const
+{
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise (fd, (off_t) (ti * tile_cols + tj) * TILE_BYTES,
+		TILE_BYTES, POSIX_FADV_WILLNEED);
+#else /* ! HAVE_POSIX_FADVISE */
+	(void) ti;
+	(void) tj;
+#endif /* ! HAVE_POSIX_FADVISE */
+}
+
+double
+MatrixTiledStorage::get (unsigned row, unsigned col) const
+{
+	profile_count (PROFILE_GETS);
+	if (row >= rows || col >= cols)
+		return NAN;
+
+	Tile &tile = fetch (row / TILED_SIZE, col / TILED_SIZE);
+	return tile.values[row % TILED_SIZE * TILED_SIZE + col % TILED_SIZE];
+}
+
+void
+MatrixTiledStorage::put (unsigned row, unsigned col, double value)
+{
+	profile_count (PROFILE_PUTS);
+	if (row >= rows || col >= cols)
+		return;
+
+	Tile &tile = fetch (row / TILED_SIZE, col / TILED_SIZE);
+	tile.values[row % TILED_SIZE * TILED_SIZE + col % TILED_SIZE] = value;
+	tile.dirty = true;
+}
+
+void
+MatrixTiledStorage::swap_rows (unsigned row1, unsigned row2)
+{
+	if (row1 >= rows || row2 >= rows)
+		return;
+
+	for (unsigned c = 0; c < cols; c++)
+	{
+		double value = get (row1, c);
+		put (row1, c, get (row2, c));
+		put (row2, c, value);
+	}
+}
+
+bool
+MatrixTiledStorage::serialize (std::ostream &os) const
+{
+	/* The same format as MatrixArrayStorage uses. */
+	os.write ((char *) &rows, sizeof rows);
+	os.write ((char *) &cols, sizeof cols);
+
+	double *panel = new double[(size_t) TILED_SIZE * cols];
+	for (unsigned ti = 0; ti < tile_rows; ti++)
+	{
+		read_rows (ti, panel);
+		unsigned nr = min (TILED_SIZE, rows - ti * TILED_SIZE);
+		os.write ((char *) panel, sizeof *panel * nr * cols);
+	}
+	delete [] panel;
+	return os;
+}
+
+MatrixStorage *
+MatrixTiledStorage::clone () const
+{
+	MatrixTiledStorage *mts = new MatrixTiledStorage (rows, cols);
+	double *tile = new double[TILE_LENGTH];
+	for (unsigned ti = 0; ti < tile_rows; ti++)
+		for (unsigned tj = 0; tj < tile_cols; tj++)
+		{
+			read_tile (ti, tj, tile);
+			mts->write_tile (ti, tj, tile);
+		}
+	delete [] tile;
+
+	profile_count (PROFILE_CLONED_BYTES,
+		TILE_BYTES * tile_rows * tile_cols);
+	return mts;
+}
+
+MatrixStorage *
+MatrixTiledStorage::create (unsigned rows, unsigned cols) const
+{
+	return new MatrixTiledStorage (rows, cols);
+}
+
+
+bool
+tiled_should_use (unsigned rows, unsigned cols)
+{
+	size_t limit = MatrixTiledStorage::memory_limit;
+	return limit && (double) rows * cols * sizeof (double) > limit;
+}
+
+/** Copy a tile of any kind of storage into @a tile.  Values beyond
+ *  the edges of the matrix are zeros. */
+static void
+load_tile (const MatrixStorage &ms, unsigned ti, unsigned tj, double *tile)
+{
+	const MatrixTiledStorage *mts =
+		dynamic_cast<const MatrixTiledStorage *> (&ms);
+	if (mts)
+	{
+		mts->read_tile (ti, tj, tile);
+		return;
+	}
+
+	unsigned r0 = ti * TILED_SIZE, nr = min (TILED_SIZE, ms.get_rows () - r0);
+	unsigned c0 = tj * TILED_SIZE, nc = min (TILED_SIZE, ms.get_cols () - c0);
+	fill (tile, tile + TILE_LENGTH, 0.);
+
+	const MatrixArrayStorage *mas =
+		dynamic_cast<const MatrixArrayStorage *> (&ms);
+	for (unsigned r = 0; r < nr; r++)
+	{
+		double *row = tile + r * TILED_SIZE;
+		if (mas)
+		{
+			const double *source = mas->get_values ()
+				+ (size_t) (r0 + r) * ms.get_cols () + c0;
+			copy (source, source + nc, row);
+		}
+		else
+			for (unsigned c = 0; c < nc; c++)
+				row[c] = ms.get (r0 + r, c0 + c);
+	}
+}
+
+Matrix
+tiled_multiply (const Matrix &a, const Matrix &b)
+{
+	const MatrixStorage &as = a.get_storage ();
+	const MatrixStorage &bs = b.get_storage ();
+	const MatrixTiledStorage *ta = dynamic_cast<const MatrixTiledStorage *> (&as);
+	const MatrixTiledStorage *tb = dynamic_cast<const MatrixTiledStorage *> (&bs);
+
+	MatrixTiledStorage *mts =
+		new MatrixTiledStorage (as.get_rows (), bs.get_cols ());
+	Matrix result (mts);
+
+	unsigned mt = mts->get_tile_rows (), nt = mts->get_tile_cols ();
+	unsigned kt = (as.get_cols () + TILED_SIZE - 1) / TILED_SIZE;
+
+	/* Keep a whole row of tiles of A in memory if the limit allows it,
+	 * so that only B has to be read over and over again. */
+	size_t limit = MatrixTiledStorage::memory_limit;
+	bool keep_row = !limit || (kt + 2) * TILE_BYTES <= limit;
+
+	double *tiles_a = new double[(keep_row ? kt : 1) * TILE_LENGTH];
+	double *tile_b = new double[TILE_LENGTH];
+	double *tile_c = new double[TILE_LENGTH];
+
+	for (unsigned i = 0; i < mt; i++)
+	{
+		if (keep_row)
+		{
+			for (unsigned k = 0; k < kt; k++)
+				load_tile (as, i, k, tiles_a + k * TILE_LENGTH);
+
+			/* Let the system read the next row in the meantime. */
+			if (ta && i + 1 < mt)
+				for (unsigned k = 0; k < kt; k++)
+					ta->prefetch_tile (i + 1, k);
+		}
+
+		for (unsigned j = 0; j < nt; j++)
+		{
+			if (tb)
+				for (unsigned k = 0; k < kt; k++)
+					tb->prefetch_tile (k, (j + 1) % nt);
+
+			for (unsigned k = 0; k < kt; k++)
+			{
+				const double *tile_a = tiles_a;
+				if (keep_row)
+					tile_a += k * TILE_LENGTH;
+				else
+					load_tile (as, i, k, tiles_a);
+
+				load_tile (bs, k, j, tile_b);
+				gemm (TILED_SIZE, TILED_SIZE, TILED_SIZE, 1,
+					tile_a, TILED_SIZE, tile_b, TILED_SIZE,
+					k ? 1 : 0, tile_c, TILED_SIZE);
+			}
+			mts->write_tile (i, j, tile_c);
+		}
+	}
+
+	delete [] tiles_a;
+	delete [] tile_b;
+	delete [] tile_c;
+	return result;
+}
+
+Matrix
+tiled_add (const Matrix &a, const Matrix &b, double factor)
+{
+	const MatrixStorage &as = a.get_storage ();
+	const MatrixStorage &bs = b.get_storage ();
+	const MatrixTiledStorage *ta = dynamic_cast<const MatrixTiledStorage *> (&as);
+	const MatrixTiledStorage *tb = dynamic_cast<const MatrixTiledStorage *> (&bs);
+
+	MatrixTiledStorage *mts =
+		new MatrixTiledStorage (as.get_rows (), as.get_cols ());
+	Matrix result (mts);
+
+	double *tile_a = new double[TILE_LENGTH];
+	double *tile_b = new double[TILE_LENGTH];
+
+	unsigned mt = mts->get_tile_rows (), nt = mts->get_tile_cols ();
+	for (unsigned t = 0; t < mt * nt; t++)
+	{
+		unsigned i = t / nt, j = t % nt;
+		if (t + 1 < mt * nt)
+		{
+			if (ta)  ta->prefetch_tile ((t + 1) / nt, (t + 1) % nt);
+			if (tb)  tb->prefetch_tile ((t + 1) / nt, (t + 1) % nt);
+		}
+
+		load_tile (as, i, j, tile_a);
+		load_tile (bs, i, j, tile_b);
+		for (size_t s = 0; s < TILE_LENGTH; s++)
+			tile_a[s] += factor * tile_b[s];
+		mts->write_tile (i, j, tile_a);
+	}
+
+	delete [] tile_a;
+	delete [] tile_b;
+	return result;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file tiled.h
+ * Out-of-core storage for matrices that don't fit into memory.
+ *
+ * Copyright Přemysl Janouch 2012. All rights reserved.
+ *
+ */
+
+#ifndef __TILED_H__
+#define __TILED_H__
+
+/** Number of rows and columns in a tile. */
+#define TILED_SIZE 256U
+
+/** Dense storage kept in an unlinked temporary file, split into square
+ *  tiles of TILED_SIZE by TILED_SIZE values.  Only a few recently used tiles
+ *  are held in memory, so random access is slow; operations on whole
+ *  matrices should go through tiles instead. */
+class MatrixTiledStorage : public MatrixStorage
+{
+	/** A tile held in memory. */
+	struct Tile
+	{
+		double *values;          //!< The values.
+		bool dirty;              //!< Changed since it was read.
+		unsigned long last_use;  //!< When it's last been accessed.
+	};
+
+	int fd;                      //!< The backing file.
+	unsigned tile_rows;          //!< Number of rows of tiles.
+	unsigned tile_cols;          //!< Number of columns of tiles.
+
+	mutable std::map<unsigned, Tile> cache;  //!< Tiles held in memory.
+	mutable unsigned long clock;             //!< Counter of accesses.
+	unsigned cache_size;                     //!< Maximum number of tiles held.
+
+	/** Get a tile into the cache. */
+	Tile &fetch (unsigned ti, unsigned tj) const;
+	/** Write a changed tile back into the file. */
+	void write_back (unsigned index, Tile &tile) const;
+public:
+	/** Memory the program may use for out-of-core operations, in bytes.
+	 *  Dense results that would be larger than this are kept in files.
+	 *  Zero means there's no limit. */
+	static size_t memory_limit;
+
+	/** Initialize the storage with zeros. */
+	MatrixTiledStorage (unsigned rows, unsigned cols);
+	virtual ~MatrixTiledStorage ();
+
+	unsigned get_tile_rows () const {return tile_rows;}  //!< Rows of tiles.
+	unsigned get_tile_cols () const {return tile_cols;}  //!< Columns of tiles.
+
+	/** Copy a row of tiles into @a buffer of TILED_SIZE by @a cols values,
+	 *  stored by rows.  Rows beyond the edge of the matrix are zeros. */
+	void read_rows (unsigned ti, double *buffer) const;
+	/** Copy a tile into @a buffer, stored by rows.
+	 *  Values beyond the edges of the matrix are zeros. */
+	void read_tile (unsigned ti, unsigned tj, double *buffer) const;
+	/** Replace a tile with the values in @a buffer, stored by rows. */
+	void write_tile (unsigned ti, unsigned tj, const double *buffer);
+	/** Advise the system that a tile is going to be read soon. */
+	void prefetch_tile (unsigned ti, unsigned tj) const;
+
+	virtual double get (unsigned row, unsigned col) const;
+	virtual void put (unsigned row, unsigned col, double value);
+	virtual void swap_rows (unsigned row1, unsigned row2);
+
+	virtual bool serialize (std::ostream &os) const;
+
+	virtual MatrixStorage *clone () const;
+	virtual MatrixStorage *create (unsigned rows, unsigned cols) const;
+};
+
+/** Decide whether a dense result of the given size should be kept in a file. */
+bool tiled_should_use (unsigned rows, unsigned cols);
+
+/** Multiply @a a by @a b, which must have matching dimensions, into
+ *  a MatrixTiledStorage.  Tiles of the operands are streamed through memory
+ *  within MatrixTiledStorage::memory_limit. */
+Matrix tiled_multiply (const Matrix &a, const Matrix &b);
+
+/** Compute @a a + @a factor * @a b, which must have the same dimensions,
+ *  into a MatrixTiledStorage, going through one tile at a time. */
+Matrix tiled_add (const Matrix &a, const Matrix &b, double factor);
+
+#endif /* ! __TILED_H__ */
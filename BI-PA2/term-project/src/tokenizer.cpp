@@ -34,7 +34,9 @@ Token::to_string () const
 	case TYPEOF:
 	case EXIT:
 	case HELP:
-	case SET:        return s;
+	case SET:
+	case SOLVE:
+	case PROFILE:    return s;
 
 	case EQUALS:     return "=";
 	case PLUS:       return "+";
@@ -78,6 +80,8 @@ keywords[] =
 	{"exit",      EXIT},
 	{"help",      HELP},
 	{"set",       SET},
+	{"solve",     SOLVE},
+	{"profile",   PROFILE},
 
 	{"rank",      RANK},
 	{"det",       DET},
@@ -15,7 +15,7 @@ enum TokenType
 	INVALID, END,
 
 	/* Commands. */
-	INPUT, DELETE, LOAD, SAVE, TYPEOF, EXIT, HELP, SET,
+	INPUT, DELETE, LOAD, SAVE, TYPEOF, EXIT, HELP, SET, SOLVE, PROFILE,
 
 	/* Operators. */
 	EQUALS, PLUS, MINUS, TIMES, POWER,
@@ -8,6 +8,7 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
 #include <exception>
 
 #include <cstdio>
@@ -89,6 +90,31 @@ operator<< (ostream &os, const Value &v)
 	}
 }
 
+string
+Value::describe_type () const
+{
+	switch (type)
+	{
+	case INTEGER:
+		return _("Integer");
+	case REAL:
+		return _("Real number");
+	default:
+		break;
+	}
+
+	const MatrixStorage *ms = &matrix->get_storage ();
+	const MatrixTransposedStorage *mts =
+		dynamic_cast<const MatrixTransposedStorage *> (ms);
+	if (mts)
+		ms = &mts->get_source ().get_storage ();
+
+	if (dynamic_cast<const MatrixCSRStorage *> (ms)
+	 || dynamic_cast<const MatrixMapStorage *> (ms))
+		return _("Sparse matrix");
+	return _("Dense matrix");
+}
+
 
 /** Describe steps of Gaussian elimination. */
 static void
@@ -307,9 +333,8 @@ Value::binary_power (const Value &v)
 
 		try
 		{
+			/* Negative powers are powers of the inverse. */
 			Matrix m (*matrix);
-			for (long i = abs (v.integer); --i; )
-				m = m * *matrix;
 			if (v.integer < 0)
 			{
 				if (describe)
@@ -322,6 +347,11 @@ Value::binary_power (const Value &v)
 					m = m.inverse ();
 			}
 
+			unsigned long exponent = v.integer;
+			if (v.integer < 0)
+				exponent = -exponent;
+			m = m.power (exponent);
+
 			value.type = MATRIX;
 			value.matrix = new Matrix (m);
 			return value;
@@ -367,12 +397,9 @@ Value::unary_rank ()
 	if (type != MATRIX)
 		throw EInvalidOperand (_("matrix rank"));
 
-	unsigned rank;
-	matrix->eliminate (&rank);
-
 	Value value;
 	value.type = INTEGER;
-	value.integer = rank;
+	value.integer = matrix->get_rank ();
 	return value;
 }
 
@@ -47,6 +47,8 @@ struct Value
 	Value &operator= (const Value &value);
 	/** Print the value out into an output stream. */
 	friend std::ostream &operator<< (std::ostream &os, const Value &v);
+	/** Return a human-readable name of the type of this value. */
+	std::string describe_type () const;
 
 	Value binary_plus   (const Value &v);  //!< Addition.
 	Value binary_minus  (const Value &v);  //!< Subtraction.
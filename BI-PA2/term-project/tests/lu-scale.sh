@@ -0,0 +1,32 @@
+#!/bin/sh
+# Matrices mustn't be deemed singular merely for having small entries.
+
+LC_ALL=C
+export LC_ALL
+
+matrixcalc=`pwd`/matrixcalc
+cd "${srcdir-.}/tests" || exit 1
+
+output=`"$matrixcalc" --script lu-scale.mc` || exit 1
+expected='1e-22
+2
+| 1 , 0 |
+| 0 , 1 |
+-2e-22
+2
+| 1 , 0 |
+| 0 , 1 |
+0
+2
+2
+2
+1
+12'
+
+if test "$output" != "$expected"; then
+	echo "Expected:"
+	echo "$expected"
+	echo "Got:"
+	echo "$output"
+	exit 1
+fi